@@ -5,17 +5,27 @@ If only one file is supplied, dumps the location of all the fragments making up
 
 Flow
 main -> parse arguments
-	 -> check for files (supplied on the cli)
-	 -> check for files in the input file (supplied by -i)
-	 -> check for files by piping (strongly recommended not to use)
+	 -> start the discovery thread (see PIPELINE) that looks for
+		-> files supplied on the cli, -m, -d or -t
+		-> files in the input file (supplied by -i)
+		-> files by piping (strongly recommended not to use)
+		-> all files of the recording given with -r if there are no other files (see REPLAY)
+	 -> wait for the first 2 files
 
 If one file -> dumpfile(
 				-> vcnnums(
-				-> printsingle( or xmlprintsingle( to output the result (depending on -x)
+				-> printsingle( or xmlprintsingle(, jsonprintsingle(, csvprintsingle(, binprintsingle( to output the extents (depending on -f), per batch with -S
 
 If multiple file	-> comparefiles(
-						-> vcnnums( per file (update an int map which keeps how many  any cluster is shared by the inputing file)
-						-> use printcompare( or xmlprintcompare( to output the result
+						-> validatefiles( thread checks the files while discovery is still running
+						-> compareworker( per file, on -j worker threads if requested
+							-> vcnnums( (update an int map which keeps how many  any cluster is shared by the inputing file)
+						-> use printcompare( or xmlprintcompare(, jsonprintcompare(, csvprintcompare(, binprintcompare( to output the result (see OUTPUT)
+
+vcnnums( gets the extents of the file from an ExtentSource
+	windows -> FSCTL_GET_RETRIEVAL_POINTERS (REFS)
+	linux	-> FS_IOC_FIEMAP (XFS, btrfs)
+	-r		-> the recorded runs of a -f bin or -f csv dump
 
 						
 						
@@ -40,319 +50,3601 @@ Powershell calling can be done:
 						*/
 
 #include "stdafx.h"
+#ifdef _WIN32
 #include "windows.h"
 #include "Shlwapi.h"
-#include "blockstat.h"
+#include "Psapi.h"
+#include <io.h>
+#include <fcntl.h>
 #pragma comment(lib, "Shlwapi.lib")
+#pragma comment(lib, "Psapi.lib")
+#else
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <errno.h>
+#include <locale.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#endif
+#include "blockstat.h"
 
 //very big size in characters
 #define SUPERMAXPATH 4096
 #define ERRORWIDTH 4096
-//max amount of files blockstat will compare
-//
-//#define SOMETHINGFISHY
-#ifdef SOMETHINGFISHY
-	#define MAXCOMPAREFILES 16384
+
+#ifdef _WIN32
+	#define PATHSEP L'\\'
+	#define PATHSEPSTR L"\\"
 #else
-	#define MAXCOMPAREFILES 1024
+	#define PATHSEP L'/'
+	#define PATHSEPSTR L"/"
 #endif
+//there is no max amount of files, the file list, the per file results and the share ratios all grow with the input
+//the dense engine has to pick its counter width before all files are validated, while the list is still growing it is sized for this many files (see densewidth)
+#define GUESSCOMPAREFILES 1024
 
 #include <iostream>
+#include <chrono>
+#include <climits>
+#include <cstdarg>
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+//sse2 is there on every x64 cpu (and the default for x86 builds), otherwise the simd parts fall back to plain loops
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BLOCKSTAT_SSE2
+#include <emmintrin.h>
+#endif
 
-//Don't have mem will use a uint8_t for referencing counting. This will slash memory usage in half
-//However, in this case a block can not be shared more then 255 time because it will overflow to 0 again and give false results
-//with uint16 64k shares are possible, which should not be reached so fast
-//#define DONTHAVEANYMEM
-
+//sse4.2 and avx2 kernels are compiled in for every x86 build and only used if the cpu supports them (see simdlevel)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BLOCKSTAT_X86
+#define TARGET_AVX2 __attribute__((target("avx2,popcnt")))
+#define TARGET_SSE42 __attribute__((target("sse4.2,popcnt")))
+#define POPCOUNT32(x) __builtin_popcount(x)
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define BLOCKSTAT_X86
+#define TARGET_AVX2
+#define TARGET_SSE42
+#define POPCOUNT32(x) __popcnt(x)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
 
-#ifdef DONTHAVEANYMEM
-typedef uint8_t ShareMemCounterInt;
+//POPCOUNT32 is only for the kernels above (the cpu is checked first), POPCOUNT64 works on every cpu
+#if defined(__GNUC__)
+#define POPCOUNT64(x) __builtin_popcountll(x)
 #else
-typedef uint16_t ShareMemCounterInt;
+inline int popcount64(unsigned long long x) {
+	x = x - ((x >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (int)((x * 0x0101010101010101ULL) >> 56);
+}
+#define POPCOUNT64(x) popcount64(x)
+#endif
+
+//the counters of the dense refmap are 8, 16 or 32 bit depending on the amount of files (see newDenseEngine)
+//narrow counters do not overflow to 0 anymore, so there is no need for a compile time switch
+
+
+/*
+
+LINUX GLUE
+
+The code was written against the win32 api. Instead of rewriting every call, the few functions that are used are mapped to their posix counterpart
+Paths are kept as wchar_t internally and converted to the locale multibyte encoding (normally utf8) just before calling the kernel
+
+*/
+#ifndef _WIN32
+typedef long long LONGLONG;
+typedef unsigned long long ULONGLONG;
+typedef uint32_t DWORD;
+typedef int BOOL;
+typedef const wchar_t * LPCWSTR;
+typedef void * HANDLE;
+
+#define TRUE 1
+#define FALSE 0
+#define INVALID_HANDLE_VALUE ((HANDLE)(intptr_t)-1)
+#define FILE_ATTRIBUTE_DIRECTORY 0x10
+#define FILE_ATTRIBUTE_REPARSE_POINT 0x400
+#define MAX_PATH (NAME_MAX+1)
+
+#define _wcsicmp wcscasecmp
+#define swprintf_s swprintf
+
+DWORD GetLastError() {
+	return (DWORD)errno;
+}
+
+int wcscpy_s(wchar_t * dst, size_t sz, const wchar_t * src) {
+	if (wcslen(src) >= sz) { dst[0] = 0; return ERANGE; }
+	wcscpy(dst, src);
+	return 0;
+}
+
+int wcscat_s(wchar_t * dst, size_t sz, const wchar_t * src) {
+	size_t dl = wcslen(dst);
+	if (dl + wcslen(src) >= sz) { dst[0] = 0; return ERANGE; }
+	wcscpy(dst + dl, src);
+	return 0;
+}
+
+int strcpy_s(char * dst, size_t sz, const char * src) {
+	if (strlen(src) >= sz) { dst[0] = 0; return ERANGE; }
+	strcpy(dst, src);
+	return 0;
+}
+
+//count is ignored, all callers pass the full string anyway
+int mbstowcs_s(size_t * conv, wchar_t * dst, size_t sz, const char * src, size_t /*count*/) {
+	size_t r = mbstowcs(dst, src, sz - 1);
+	if (r == (size_t)-1) { dst[0] = 0; *conv = 0; return EILSEQ; }
+	dst[r] = 0;
+	*conv = r + 1;
+	return 0;
+}
+
+//the ", ccs=" encoding suffix only exists in the msvc crt, strip it
+int fopen_s(FILE ** f, const char * name, const char * mode) {
+	char m[16];
+	size_t ml = 0;
+	while (mode[ml] != 0 && mode[ml] != ',' && ml < sizeof(m) - 1) {
+		m[ml] = mode[ml];
+		ml++;
+	}
+	m[ml] = 0;
+	*f = fopen(name, m);
+	return (*f == NULL) ? errno : 0;
+}
+
+//convert a wide path to something the kernel understands
+bool tombpath(const wchar_t * src, char * dst, size_t sz) {
+	size_t r = wcstombs(dst, src, sz);
+	if (r == (size_t)-1 || r >= sz) {
+		errno = ENAMETOOLONG;
+		dst[0] = 0;
+		return false;
+	}
+	return true;
+}
+
+BOOL PathFileExists(const wchar_t * path) {
+	char mb[SUPERMAXPATH * 4];
+	struct stat st;
+	return tombpath(path, mb, sizeof(mb)) && stat(mb, &st) == 0;
+}
+
+//minimal FindFirstFile/FindNextFile, only supports a wildcard in the last part of the path (which is all we use)
+typedef struct _WIN32_FIND_DATA {
+	DWORD dwFileAttributes;
+	wchar_t cFileName[MAX_PATH];
+} WIN32_FIND_DATA;
+
+typedef struct _findctx {
+	DIR * dir;
+	char base[SUPERMAXPATH * 4];
+	char pattern[MAX_PATH];
+} FindCtx;
+
+//only stat when the filesystem does not tell us the type in the dirent
+//a symlink is a reparse point like on windows, with the directory flag if it points to a directory
+bool findfill(FindCtx * fc, struct dirent * de, WIN32_FIND_DATA * ffd) {
+	DWORD attr = (de->d_type == DT_DIR) ? FILE_ATTRIBUTE_DIRECTORY : 0;
+	if (de->d_type == DT_UNKNOWN || de->d_type == DT_LNK) {
+		char full[SUPERMAXPATH * 4];
+		struct stat st;
+		if (snprintf(full, sizeof(full), "%s/%s", fc->base, de->d_name) >= (int)sizeof(full)) {
+			return false;
+		}
+		attr = 0;
+		if (lstat(full, &st) == 0) {
+			if (S_ISLNK(st.st_mode)) {
+				attr = FILE_ATTRIBUTE_REPARSE_POINT;
+				if (stat(full, &st) == 0 && S_ISDIR(st.st_mode)) {
+					attr |= FILE_ATTRIBUTE_DIRECTORY;
+				}
+			}
+			else if (S_ISDIR(st.st_mode)) {
+				attr = FILE_ATTRIBUTE_DIRECTORY;
+			}
+		}
+	}
+	ffd->dwFileAttributes = attr;
+	ffd->cFileName[MAX_PATH - 1] = 0;
+	return (mbstowcs(ffd->cFileName, de->d_name, MAX_PATH - 1) != (size_t)-1);
+}
+
+BOOL FindNextFile(HANDLE h, WIN32_FIND_DATA * ffd) {
+	FindCtx * fc = (FindCtx*)h;
+	if (fc->dir == NULL) { return FALSE; }
+
+	struct dirent * de;
+	while ((de = readdir(fc->dir)) != NULL) {
+		if (fnmatch(fc->pattern, de->d_name, 0) == 0 && findfill(fc, de, ffd)) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+BOOL FindClose(HANDLE h) {
+	FindCtx * fc = (FindCtx*)h;
+	if (fc->dir != NULL) { closedir(fc->dir); }
+	free(fc);
+	return TRUE;
+}
+
+HANDLE FindFirstFile(const wchar_t * wpattern, WIN32_FIND_DATA * ffd) {
+	FindCtx * fc = (FindCtx*)malloc(sizeof(FindCtx));
+	fc->dir = NULL;
+
+	if (!tombpath(wpattern, fc->base, sizeof(fc->base))) { free(fc); return INVALID_HANDLE_VALUE; }
+
+	//split in directory and the last part
+	char * leaf = strrchr(fc->base, '/');
+	if (leaf == NULL) {
+		strcpy_s(fc->pattern, MAX_PATH, fc->base);
+		strcpy(fc->base, ".");
+	}
+	else {
+		strcpy_s(fc->pattern, MAX_PATH, leaf + 1);
+		if (leaf == fc->base) { leaf[1] = 0; }
+		else { leaf[0] = 0; }
+	}
+
+	//no wildcard, behaves like windows and returns the entry itself
+	if (strpbrk(fc->pattern, "*?[") == NULL) {
+		char full[SUPERMAXPATH * 4];
+		struct stat st;
+		if (!tombpath(wpattern, full, sizeof(full)) || stat(full, &st) != 0) { free(fc); return INVALID_HANDLE_VALUE; }
+		ffd->dwFileAttributes = S_ISDIR(st.st_mode) ? FILE_ATTRIBUTE_DIRECTORY : 0;
+		ffd->cFileName[MAX_PATH - 1] = 0;
+		mbstowcs(ffd->cFileName, fc->pattern, MAX_PATH - 1);
+		return (HANDLE)fc;
+	}
+
+	fc->dir = opendir(fc->base);
+	if (fc->dir == NULL || !FindNextFile((HANDLE)fc, ffd)) {
+		if (fc->dir == NULL) { errno = ENOENT; }
+		FindClose((HANDLE)fc);
+		return INVALID_HANDLE_VALUE;
+	}
+	return (HANDLE)fc;
+}
 #endif
 
 
+/*
+ARENA
+
+Strings that live till the end of the run (paths, errors) are bump allocated in big chunks instead of one malloc each
+Nothing is freed on its own, the whole arena goes at once. Not thread safe, the owner of the arena takes care of locking
+*/
+#define ARENACHUNK (256*1024)
+
+typedef struct _arena {
+	//every chunk starts with a pointer to the previous chunk
+	char * chunk;
+	size_t used;
+	size_t size;
+	LONGLONG bytes;
+} Arena;
+
+void arenainit(Arena * a) {
+	a->chunk = NULL;
+	a->used = 0;
+	a->size = 0;
+	a->bytes = 0;
+}
+
+void * arenaalloc(Arena * a, size_t sz) {
+	sz = (sz + 7) & ~(size_t)7;
+	if (a->chunk == NULL || a->used + sz > a->size) {
+		//something bigger then a chunk gets a chunk of its own
+		size_t size = (sz + sizeof(char*) > ARENACHUNK) ? sz + sizeof(char*) : ARENACHUNK;
+		char * chunk = (char*)malloc(size);
+		*(char**)chunk = a->chunk;
+		a->chunk = chunk;
+		a->used = sizeof(char*);
+		a->size = size;
+		a->bytes += size;
+	}
+	void * p = a->chunk + a->used;
+	a->used += sz;
+	return p;
+}
+
+wchar_t * arenawcsdup(Arena * a, const wchar_t * s, size_t len) {
+	wchar_t * cp = (wchar_t*)arenaalloc(a, sizeof(wchar_t) * (len + 1));
+	wmemcpy(cp, s, len);
+	cp[len] = 0;
+	return cp;
+}
+
+void arenafree(Arena * a) {
+	while (a->chunk != NULL) {
+		char * prev = *(char**)a->chunk;
+		free(a->chunk);
+		a->chunk = prev;
+	}
+	a->used = 0;
+	a->size = 0;
+	a->bytes = 0;
+}
+
 //generic stacking function for strings
-//makes an array of strings that will automatically resize when using addStrStack
+//makes an array of strings that will automatically grow when using addStrStack
+//the strings are copied in the arena of the stack, the pointers are kept in blocks of STRSTACKBLOCK that never move (only the small list of blocks is resized)
 //c = how many actually used
-//l = provisioned space
-//ss = current array
+//blocksl = provisioned blocks
+#define STRSTACKBLOCK 1024
 typedef struct _stringstack {
 	int c;
-	int l;
-	wchar_t** ss = NULL;
+	int blocksl;
+	wchar_t *** blocks;
+	Arena arena;
 } StringStack;
+
 //free the lines itself + the stack
 void freeStringStack(StringStack * ps) {
-	for (int i = 0; i < ps->c; i++) {
-		free(ps->ss[i]);
+	for (int b = 0; b < (ps->c + STRSTACKBLOCK - 1) / STRSTACKBLOCK; b++) {
+		free(ps->blocks[b]);
 	}
-	free(ps->ss);
+	free(ps->blocks);
+	arenafree(&ps->arena);
+	free(ps);
 }
 //make a new empty stack
 StringStack* newStringStack() {
 	StringStack* stack = (StringStack*)malloc(sizeof(StringStack));
 	stack->c = 0;
-	stack->l = 0;
-	stack->ss = nullptr;
+	stack->blocksl = 0;
+	stack->blocks = NULL;
+	arenainit(&stack->arena);
 	return stack;
 }
-//if stack is big enough, add the pointer
-//if not, resize by 4x the current size
-void addStrStack(StringStack* ssp, wchar_t * pushstr) {
-	if (ssp->c < ssp->l) {
-		//printf("%d %d\n", ssp->c, ssp->l);
-		ssp->ss[ssp->c] = pushstr;
-		(ssp->c)++;
+
+//make room for one more entry in a list of fixed blocks, returns false if the block list could not grow
+bool blockgrow(void *** blocks, int * blocksl, int c, int blocksz, size_t entrysz) {
+	int b = c / blocksz;
+	if (c % blocksz != 0) {
+		return true;
 	}
-	else {
-		//new length
-		int newlength = 5;
-		if (ssp->l > 0) { newlength = ssp->l * 4; }
+	if (b == *blocksl) {
+		int newl = (*blocksl > 0) ? *blocksl * 2 : 4;
+		void ** newblocks = (void**)realloc(*blocks, sizeof(void*) * newl);
+		if (newblocks == NULL) {
+			return false;
+		}
+		*blocks = newblocks;
+		*blocksl = newl;
+	}
+	(*blocks)[b] = malloc(entrysz * blocksz);
+	return (*blocks)[b] != NULL;
+}
+
+//copies pushstr in the stack
+void addStrStack(StringStack* ssp, const wchar_t * pushstr) {
+	if (!blockgrow((void***)&ssp->blocks, &ssp->blocksl, ssp->c, STRSTACKBLOCK, sizeof(wchar_t*))) {
+		return;
+	}
+	ssp->blocks[ssp->c / STRSTACKBLOCK][ssp->c % STRSTACKBLOCK] = arenawcsdup(&ssp->arena, pushstr, wcslen(pushstr));
+	ssp->c++;
+}
 
-		//allocate new warray
-		wchar_t** newarr = (wchar_t**)malloc(sizeof(wchar_t*) * newlength);
+wchar_t * strstackget(StringStack * ssp, int i) {
+	return ssp->blocks[i / STRSTACKBLOCK][i % STRSTACKBLOCK];
+}
+
+/*
+PATH LIST
 
-		//copy pointers
-		for (int i = 0; i < ssp->l; i++) {
-			(newarr)[i] = ssp->ss[i];
+The list of compared files, there can be millions of them and most share their directory with the files before them
+Every path is kept as an interned directory (with the separator at the end) and a leaf name, both in the arena of the list
+The full path is only put together in a buffer of the caller when it is needed (opening the file, printing)
+*/
+typedef struct _pathref {
+	const wchar_t * dir;
+	const wchar_t * leaf;
+} PathRef;
+
+struct WcsHash {
+	size_t operator()(const wchar_t * s) const {
+		//fnv-1a
+		size_t h = (size_t)14695981039346656037ULL;
+		for (; *s != 0; s++) {
+			h = (h ^ (size_t)*s) * (size_t)1099511628211ULL;
 		}
-		//add the new string
-		(newarr)[ssp->c] = pushstr;
+		return h;
+	}
+};
+struct WcsEq {
+	bool operator()(const wchar_t * a, const wchar_t * b) const { return wcscmp(a, b) == 0; }
+};
+typedef std::unordered_set<const wchar_t*, WcsHash, WcsEq> DirIndex;
+
+#define PATHLISTBLOCK 4096
+typedef struct _pathlist {
+	int c;
+	int blocksl;
+	PathRef ** blocks;
+	Arena arena;
+	DirIndex * dirs;
+	//the directory of the last path, most paths come in directory order so the lookup is skipped
+	const wchar_t * lastdir;
+	wchar_t * scratch;
+} PathList;
+
+PathList * newPathList() {
+	PathList * pl = (PathList*)malloc(sizeof(PathList));
+	pl->c = 0;
+	pl->blocksl = 0;
+	pl->blocks = NULL;
+	arenainit(&pl->arena);
+	pl->dirs = new DirIndex();
+	pl->lastdir = NULL;
+	pl->scratch = (wchar_t*)malloc(sizeof(wchar_t)*SUPERMAXPATH);
+	return pl;
+}
+
+void freePathList(PathList * pl) {
+	for (int b = 0; b < (pl->c + PATHLISTBLOCK - 1) / PATHLISTBLOCK; b++) {
+		free(pl->blocks[b]);
+	}
+	free(pl->blocks);
+	arenafree(&pl->arena);
+	delete pl->dirs;
+	free(pl->scratch);
+	free(pl);
+}
 
-		//update the count (used counter)
-		(ssp->c)++;
-		//update to the new length
-		ssp->l = newlength;
-		//free the old array
-		free(ssp->ss);
-		//assign the newly created array with pointers
-		ssp->ss = newarr;
+//copies path in the list
+void addPathList(PathList * pl, const wchar_t * path) {
+	if (!blockgrow((void***)&pl->blocks, &pl->blocksl, pl->c, PATHLISTBLOCK, sizeof(PathRef))) {
+		return;
+	}
+	const wchar_t * leaf = wcsrchr(path, PATHSEP);
+	leaf = (leaf == NULL) ? path : leaf + 1;
+	size_t dirlen = leaf - path;
 
-		//wprintf(L"resized");
+	const wchar_t * dir;
+	if (pl->lastdir != NULL && wcslen(pl->lastdir) == dirlen && wmemcmp(pl->lastdir, path, dirlen) == 0) {
+		dir = pl->lastdir;
+	}
+	else {
+		wmemcpy(pl->scratch, path, dirlen);
+		pl->scratch[dirlen] = 0;
+		DirIndex::iterator it = pl->dirs->find(pl->scratch);
+		if (it != pl->dirs->end()) {
+			dir = *it;
+		}
+		else {
+			dir = arenawcsdup(&pl->arena, path, dirlen);
+			pl->dirs->insert(dir);
+		}
+		pl->lastdir = dir;
 	}
+
+	PathRef * ref = &pl->blocks[pl->c / PATHLISTBLOCK][pl->c % PATHLISTBLOCK];
+	ref->dir = dir;
+	ref->leaf = arenawcsdup(&pl->arena, leaf, wcslen(leaf));
+	pl->c++;
+}
+
+PathRef pathlistget(PathList * pl, int i) {
+	return pl->blocks[i / PATHLISTBLOCK][i % PATHLISTBLOCK];
+}
+
+//the full path in buf (SUPERMAXPATH)
+wchar_t * pathformat(PathRef ref, wchar_t * buf) {
+	wcscpy_s(buf, SUPERMAXPATH, ref.dir);
+	wcscat_s(buf, SUPERMAXPATH, ref.leaf);
+	return buf;
 }
 
 //error handling
+//fills errorbuffer with the readable version of the last error and returns the code
+DWORD lastErrorText(wchar_t * errorbuffer) {
+	DWORD code = GetLastError();
+#ifdef _WIN32
+	FormatMessageW(FORMAT_MESSAGE_FROM_SYSTEM, NULL, code, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), errorbuffer, ERRORWIDTH, NULL);
+#else
+	if (mbstowcs(errorbuffer, strerror((int)code), ERRORWIDTH - 1) == (size_t)-1) { errorbuffer[0] = 0; }
+	errorbuffer[ERRORWIDTH - 1] = 0;
+#endif
+	return code;
+}
+
 //just a generic function to print out the last error in a readable format
 void printLastError(LPCWSTR errdetails) {
 	wchar_t errorbuffer[ERRORWIDTH];
-	DWORD code = GetLastError();
-	FormatMessageW(FORMAT_MESSAGE_FROM_SYSTEM, NULL, code, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), errorbuffer, ERRORWIDTH, NULL);
-	wprintf(L"%ls : %ld %ls\n", errdetails, code, errorbuffer);
+	DWORD code = lastErrorText(errorbuffer);
+	wprintf(L"%ls : %ld %ls\n", errdetails, (long)code, errorbuffer);
 }
 
 
-//add the latest error to the stack
-void addStringStackError(StringStack * ps, LPCWSTR errdetails) {
+//the latest error as a line, buf should hold ERRORLINEWIDTH
+//20 should be enough to hold " : "+num+eol
+#define ERRORLINEWIDTH (ERRORWIDTH + SUPERMAXPATH + 20)
+void formatLastError(wchar_t * buf, LPCWSTR errdetails) {
 	wchar_t errorbuffer[ERRORWIDTH];
-	DWORD code = GetLastError();
-	FormatMessageW(FORMAT_MESSAGE_FROM_SYSTEM, NULL, code, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), errorbuffer, ERRORWIDTH, NULL);
+	DWORD code = lastErrorText(errorbuffer);
+	swprintf_s(buf, ERRORLINEWIDTH, L"%ls : %ld %ls\n", errdetails, (long)code, errorbuffer);
+}
 
-	//20 should be enough to hold " : "+num+eol
-	int allocsize = (wcslen(errorbuffer) + wcslen(errdetails) + 20);
-	wchar_t * endresult = (wchar_t*)(malloc(allocsize* sizeof(wchar_t)));
-	swprintf_s(endresult,allocsize, L"%ls : %ld %ls\n", errdetails, code, errorbuffer);
+//peak memory use of the process in bytes (working set / resident), 0 if it is not known
+LONGLONG peakmemory() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+		return (LONGLONG)pmc.PeakWorkingSetSize;
+	}
+	return 0;
+#else
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) == 0) {
+		return (LONGLONG)ru.ru_maxrss * 1024;
+	}
+	return 0;
+#endif
+}
 
+//add the latest error to the stack, the stack keeps its own copy
+void addStringStackError(StringStack * ps, LPCWSTR errdetails) {
+	wchar_t endresult[ERRORLINEWIDTH];
+	formatLastError(endresult, errdetails);
 	addStrStack(ps, endresult);
 }
 
 
 //structs for vcnquering
-//should already be defined in the headers. Just manually overwritten to see if we can figure out why querying multiple extents doesnt work
+//layout of one entry in RETRIEVAL_POINTERS_BUFFER.Extents
+#ifdef _WIN32
 typedef struct _VCNLCNMAP {
 	LARGE_INTEGER NextVcn;
 	LARGE_INTEGER Lcn;
 } VCNLCNMAP, *PVCNLCNMAP;
+#endif
 
+//Device is the st_dev of the volume on linux (not used on windows, there the volume path is compared)
 typedef struct _VINFO {
 	DWORD ClusterSize;
 	//DWORD Clusters;
 	ULONGLONG Clusters;
+	ULONGLONG Device;
 	wchar_t Volume[SUPERMAXPATH];
 } VINFO;
 
+//one extent (fragment) of a file, everything is expressed in clusters
+//lcn is -1 if the extent has no location on the volume (sparse, inline or delayed allocation)
+typedef struct _extent {
+	LONGLONG vcn;
+	LONGLONG lcn;
+	LONGLONG clusters;
+} Extent;
+
+//what makes a file the same file with the same content for the extent cache (see EXTENT CACHE)
+//dev is the st_dev / volume serial, id the inode / file index (0 if not known), the times are in ns (linux) or 100ns (windows)
+typedef struct _fileid {
+	ULONGLONG dev;
+	ULONGLONG id;
+	ULONGLONG size;
+	ULONGLONG mtime;
+	ULONGLONG ctime;
+} FileId;
+
 //compare structs
 //might be good to analyse vcnnums/compare function for more info on how this is used
 typedef struct _shareline {
 	LONGLONG savingsbytes;
 	LONGLONG savingsmb;
-	int shareratio;
+	LONGLONG shareratio;
 } ShareLine;
 
+//-g and -u (see SHARING MATRIX)
+struct _sharingmatrix;
+
 typedef struct _compareresult {
-	StringStack * files;
+	PathList * files;
 	StringStack * errors;
 	ShareLine* sharelines;
 	int sharelinesc;
 	LONGLONG savings;
 	LONGLONG fragments;
+	LONGLONG ioctls;
 	VINFO* gvinfo = NULL;
+	//NULL unless -g is used
+	struct _sharingmatrix * matrix;
+	//NULL unless -u is used, one group per file
+	struct _sharingmatrix * exclusive;
 	
 } CompareResult;
 
 //single structs
 //might be good to analyse vcnnums function for more info on how this is used
-typedef struct _vcnres {
-	LONGLONG startvcn;
-	LONGLONG lcn;
-	LONGLONG sizepart;
-	LONGLONG totsize; //so far in the file
-} VCNRes;
+//the extents are kept as a structure of arrays in one contiguous buffer, one column per field
+//so a very fragmented file does not need an allocation per extent
+#define VCNSTACKMIN 1024
 
 typedef struct _vcnstack {
 	long provisioned;
 	long used;
-	VCNRes** vs;
+	LONGLONG flushed; //extents already printed and dropped in streaming mode
+	LONGLONG* startvcn;
+	LONGLONG* lcn;
+	LONGLONG* sizepart;
+	LONGLONG* totsize; //so far in the file
 } VCNStack;
 
+//points the columns into the buffer starting at base
+void vcnstackcolumns(VCNStack *stack, LONGLONG* base) {
+	stack->startvcn = base;
+	stack->lcn = base + stack->provisioned;
+	stack->sizepart = base + 2 * stack->provisioned;
+	stack->totsize = base + 3 * stack->provisioned;
+}
+
 //creating a vcn stack
 VCNStack* newVCNStack() {
 	VCNStack * v = (VCNStack*)(malloc(sizeof(VCNStack)));
-	v->provisioned = 20;
+	v->provisioned = VCNSTACKMIN;
 	v->used = 0;
-	v->vs = (VCNRes**)(malloc(sizeof(VCNRes*) * 20));
+	v->flushed = 0;
+	vcnstackcolumns(v, (LONGLONG*)malloc(sizeof(LONGLONG) * 4 * v->provisioned));
 	return v;
 }
+//make sure there is room for extra extents
+//doubles the buffer until it fits and copies every column to its new place
+void reserveVCNStack(VCNStack *stack, LONGLONG extra) {
+	if (stack->used + extra <= stack->provisioned) { return; }
+
+	VCNStack old = *stack;
+	while (stack->used + extra > stack->provisioned) { stack->provisioned *= 2; }
+
+	vcnstackcolumns(stack, (LONGLONG*)malloc(sizeof(LONGLONG) * 4 * stack->provisioned));
+	memcpy(stack->startvcn, old.startvcn, sizeof(LONGLONG)*old.used);
+	memcpy(stack->lcn, old.lcn, sizeof(LONGLONG)*old.used);
+	memcpy(stack->sizepart, old.sizepart, sizeof(LONGLONG)*old.used);
+	memcpy(stack->totsize, old.totsize, sizeof(LONGLONG)*old.used);
+	free(old.startvcn);
+}
 //add a vcn to the result when querying one single file (singleresult)
-//add's if the current array is big enough
-//otherwise make an array 4* the current size
-//copies the pointers
-//add the result
-//updates the struct and remove the old stack
-void addVCNStack(VCNStack *stack, VCNRes * result) {
-	if (stack->used < stack->provisioned) {
-		(stack->vs)[stack->used] = result;
-		stack->used++;
-	}
-	else {
-
-		long newsize = stack->provisioned * 4;
-
-		//wprintf(L"resizing %lld +",newsize);
-
-		VCNRes ** newstack = (VCNRes**)(malloc(sizeof(VCNRes*) * newsize));
-
-		for (long i = 0; i < stack->used; i++) {
-			newstack[i] = stack->vs[i];
-		}
-		newstack[stack->used] = result;
-
-		VCNRes ** oldstack = stack->vs;
-		stack->provisioned = newsize;
-		stack->used++;
-		stack->vs = newstack;
-
-		free(oldstack);
-	}
+void addVCNStack(VCNStack *stack, LONGLONG startvcn, LONGLONG lcn, LONGLONG sizepart, LONGLONG totsize) {
+	reserveVCNStack(stack, 1);
+	long i = stack->used++;
+	stack->startvcn[i] = startvcn;
+	stack->lcn[i] = lcn;
+	stack->sizepart[i] = sizepart;
+	stack->totsize[i] = totsize;
+}
+//the extents are printed, forget about them but keep counting
+void flushVCNStack(VCNStack *stack) {
+	stack->flushed += stack->used;
+	stack->used = 0;
+}
+void freeVCNStack(VCNStack *stack) {
+	free(stack->startvcn);
+	free(stack);
 }
 //result when querying one file
 typedef struct _singleResult {
 	wchar_t * file;
 	StringStack * errors;
 	VCNStack * vcnstack;
+	LONGLONG ioctls;
 	VINFO* gvinfo = NULL;
+	bool headprinted; //streaming, the header is already out
+	int errorsprinted; //errors already in the header
+	LONGLONG binrecord; //offset of the record in the binary dump
 } SingleResult;
 
 
 
-//generic option struct
-typedef struct _Blockstatflags {
-	bool xmlout;
-	FILE* printer;
-	bool printerisfile;
-	bool verbose;
-} Blockstatflags;
-
-//generic function to get volume the volume info we need
-bool GetVolInfo(wchar_t * pfname, VINFO * vinfo) {
-	bool success = false;
-
-	if (GetVolumePathName(pfname, vinfo->Volume, SUPERMAXPATH)) {
-		DWORD SectorsPerCluster;
-		DWORD BytesPerSector;
-		DWORD NumberOfFreeClusters;
-		DWORD TotalNumberOfClusters;
-
-		if (GetDiskFreeSpace(vinfo->Volume, &SectorsPerCluster, &BytesPerSector, &NumberOfFreeClusters, &TotalNumberOfClusters)) {
-			//vinfo->Clusters = TotalNumberOfClusters;
-			vinfo->ClusterSize = SectorsPerCluster*BytesPerSector;
-
-			//very big volumes don't like the 32 bit integer 
-			//16TB at 4KB cluster size maxes out TotalNumberOfClusters
-			
-			ULARGE_INTEGER TotalNumberOfBytes;
-			if (GetDiskFreeSpaceEx(vinfo->Volume, NULL, &TotalNumberOfBytes, NULL)) {
-				vinfo->Clusters = (TotalNumberOfBytes.QuadPart / vinfo->ClusterSize);
-
-				
-				success = true;
+/*
+OUTPUT
+
+All results go through a Writer instead of a fwprintf per line
+The text is encoded to utf8 in a big buffer and written to the file descriptor in blocks, integers are formatted by hand so the crt does not parse a format string and convert through the locale for every extent
+The stream itself is flushed before every block so the verbose wprintf lines still end up in the right place (the printers flush at the end of every part)
+
+Formats (-f, -x is the same as -f xml)
+	text	human readable
+	xml		as before, strings are escaped now
+	json	one compact object per result
+	csv		one record per line, the first column tells what the record is
+				kind,text,v1,v2,v3,v4
+				fsinfo,volume,clustersize,clusters
+				file,path
+				error,message
+				vcn,,start,lcn,sz,totalsz						(single)
+				share,,ratio,bytes,mb							(compare)
+				group,name,id,bytes,sharedbytes,exclusivebytes	(compare -g)
+				pair,,a,b,bytes,mb								(compare -g)
+				exclusive,path,size,bytes,mb					(compare -u)
+				total,,extents,ioctls							(single)
+				total,,savingsbytes,savingsmb,fragments,ioctls	(compare)
+	bin		the extents of every file, delta and varint encoded (see BINARY DUMP)
+*/
+#define OUTTEXT 0
+#define OUTXML 1
+#define OUTJSON 2
+#define OUTCSV 3
+#define OUTBIN 4
+
+#define WRITERBUF (256*1024)
+//room for the biggest single write (an integer or one encoded char)
+#define WRITERSLACK 32
+
+typedef struct _writer {
+	FILE * f;
+	char * buf;
+	int used;
+	unsigned int pending; //high surrogate waiting for its pair (utf16 wchar_t on windows)
+	LONGLONG written; //bytes handed to the file descriptor, the binary dump needs the offsets
+	bool failed; //a write or flush came short (disk full, closed pipe), the output is incomplete
+} Writer;
+
+Writer * newWriter(FILE * f) {
+	Writer * w = (Writer*)malloc(sizeof(Writer));
+	w->f = f;
+	w->buf = (char*)malloc(WRITERBUF + WRITERSLACK);
+	w->used = 0;
+	w->pending = 0;
+	w->written = 0;
+	w->failed = false;
+	return w;
+}
+//hand the buffer to the file descriptor in one go
+//what does not get written is dropped, failed tells the owner
+void writerflush(Writer * w) {
+	if (w->used > 0) {
+		if (fflush(w->f) != 0) { w->failed = true; }
+		const char * p = w->buf;
+		int left = w->used;
+		while (left > 0) {
+#ifdef _WIN32
+			int n = _write(_fileno(w->f), p, left);
+#else
+			int n = (int)write(fileno(w->f), p, left);
+			if (n < 0 && errno == EINTR) { continue; }
+#endif
+			if (n <= 0) {
+				w->failed = true;
+				break;
 			}
+			p += n;
+			left -= n;
 		}
+		w->written += w->used;
+		w->used = 0;
 	}
-	return success;
 }
-
-//adding errors to the result for printing later
-void resulterradd(SingleResult * singleresult, CompareResult * compareresult,LPCWSTR errprefix) {
-	if (singleresult != NULL) {
-		addStringStackError(singleresult->errors, errprefix);
+void freeWriter(Writer * w) {
+	writerflush(w);
+	free(w->buf);
+	free(w);
+}
+//makes sure n bytes fit, only flushes when the buffer is full
+inline void writerroom(Writer * w, int n) {
+	if (w->used + n > WRITERBUF) { writerflush(w); }
+}
+//encodes one char, ascii is the fast path
+inline void writechar(Writer * w, wchar_t wc) {
+	unsigned int c = (unsigned int)wc;
+	writerroom(w, 4);
+	char * o = w->buf + w->used;
+	if (c < 0x80 && w->pending == 0) {
+		*o = (char)c;
+		w->used++;
+		return;
 	}
-	else if (compareresult != NULL) {
-		addStringStackError(compareresult->errors, errprefix);
+	if (c >= 0xD800 && c <= 0xDBFF) {
+		w->pending = c;
+		return;
+	}
+	if (c >= 0xDC00 && c <= 0xDFFF && w->pending != 0) {
+		c = 0x10000 + ((w->pending - 0xD800) << 10) + (c - 0xDC00);
+	}
+	w->pending = 0;
+	if (c < 0x80) {
+		o[0] = (char)c;
+		w->used += 1;
+	}
+	else if (c < 0x800) {
+		o[0] = (char)(0xC0 | (c >> 6));
+		o[1] = (char)(0x80 | (c & 0x3F));
+		w->used += 2;
+	}
+	else if (c < 0x10000) {
+		o[0] = (char)(0xE0 | (c >> 12));
+		o[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+		o[2] = (char)(0x80 | (c & 0x3F));
+		w->used += 3;
 	}
 	else {
-		wprintf(L"Error printing fails, should not happen, predumping to console\n");
-		printLastError(errprefix);
+		o[0] = (char)(0xF0 | (c >> 18));
+		o[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+		o[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+		o[3] = (char)(0x80 | (c & 0x3F));
+		w->used += 4;
+	}
+}
+void writestr(Writer * w, const wchar_t * s) {
+	for (; *s != L'\0'; s++) { writechar(w, *s); }
+}
+//right aligned in width chars (like %20lld), 0 is no padding
+void writeintpad(Writer * w, LONGLONG v, int width) {
+	char tmp[24];
+	int n = 0;
+	unsigned long long u = (v < 0) ? (0ULL - (unsigned long long)v) : (unsigned long long)v;
+	do {
+		tmp[n++] = (char)('0' + (u % 10));
+		u /= 10;
+	} while (u != 0);
+	if (v < 0) { tmp[n++] = '-'; }
+
+	if (width > WRITERSLACK) { width = WRITERSLACK; }
+	writerroom(w, (n > width) ? n : width);
+	for (int i = n; i < width; i++) { w->buf[w->used++] = ' '; }
+	while (n > 0) { w->buf[w->used++] = tmp[--n]; }
+}
+inline void writeint(Writer * w, LONGLONG v) {
+	writeintpad(w, v, 0);
+}
+//escaped for xml attributes and text
+void writexml(Writer * w, const wchar_t * s) {
+	for (; *s != L'\0'; s++) {
+		switch (*s) {
+		case L'&': writestr(w, L"&amp;"); break;
+		case L'<': writestr(w, L"&lt;"); break;
+		case L'>': writestr(w, L"&gt;"); break;
+		case L'\'': writestr(w, L"&apos;"); break;
+		case L'"': writestr(w, L"&quot;"); break;
+		default: writechar(w, *s); break;
+		}
+	}
+}
+//quoted and escaped json string
+void writejson(Writer * w, const wchar_t * s) {
+	writechar(w, L'"');
+	for (; *s != L'\0'; s++) {
+		wchar_t c = *s;
+		if (c == L'"' || c == L'\\') {
+			writechar(w, L'\\');
+			writechar(w, c);
+		}
+		else if (c == L'\n') { writestr(w, L"\\n"); }
+		else if (c == L'\r') { writestr(w, L"\\r"); }
+		else if (c == L'\t') { writestr(w, L"\\t"); }
+		else if (c < 0x20) {
+			const wchar_t * hex = L"0123456789abcdef";
+			writestr(w, L"\\u00");
+			writechar(w, hex[(c >> 4) & 0xf]);
+			writechar(w, hex[c & 0xf]);
+		}
+		else { writechar(w, c); }
+	}
+	writechar(w, L'"');
+}
+//csv field, only quoted if it has to be
+void writecsv(Writer * w, const wchar_t * s) {
+	if (wcspbrk(s, L",\"\r\n") == NULL) {
+		writestr(w, s);
+		return;
+	}
+	writechar(w, L'"');
+	for (; *s != L'\0'; s++) {
+		if (*s == L'"') { writechar(w, L'"'); }
+		writechar(w, *s);
 	}
+	writechar(w, L'"');
+}
+//a json array of strings, used for the files and errors
+void writejsonstrings(Writer * w, const wchar_t * name, StringStack * ss) {
+	writechar(w, L'"');
+	writestr(w, name);
+	writestr(w, L"\":[");
+	for (int i = 0; i < ss->c; i++) {
+		if (i > 0) { writechar(w, L','); }
+		writejson(w, strstackget(ss, i));
+	}
+	writechar(w, L']');
 }
 
-//the heart of the app
+/*
+BINARY DUMP
+
+-f bin writes the extents of every file in a compact form so nightly dumps of thousands of files can be archived and loaded again without parsing
+The vcns and lcns of a file mostly continue where the previous extent stopped, so they are stored as the difference with that prediction in a varint (1 byte most of the time)
+Everything is in clusters, the clustersize is in the header
+
+varint	7 bits per byte, the high bit tells there is more, little end first
+zigzag	varint of (v << 1) ^ (v >> 63) so small negative differences stay small
+string	varint length + utf8
+fixed	8 byte little endian, only used where an offset has to be found without decoding
+
+header	"BSXD" 1 (version byte) varint clustersize, varint clusters, string volume
+records	per file: string path, then runs till a run with count 0
+		run: varint count, then per extent
+			varint clusters << 1 | 1 if the extent has no location (sparse)
+			zigzag vcn - end of the previous extent of the run (0 for the first one)
+			zigzag lcn - end of the previous located extent of the run (0 for the first one), not there for sparse extents
+		a file has one run per retrieval batch (single) or per range a worker queried (compare), an extent crossing two ranges is split
+summary	varint savings bytes, varint fragments, varint ioctls
+		varint share lines, per line varint ratio, varint clusters
+		varint errors, per error string
+index	per file (fixed record offset, fixed extents, fixed 1 if the query failed and the extents can be partial)
+trailer	fixed index offset, fixed summary offset, fixed files, "BSXI"
+
+A reader maps the file, takes the trailer from the end and can jump to any file with the index
+*/
+#define BINMAGIC "BSXD"
+#define BINTRAILERMAGIC "BSXI"
+#define BINVERSION 1
+#define BINTRAILER (3 * 8 + 4)
 
-bool vcnnums(HANDLE * psrchandle, VINFO* vinfo, ShareMemCounterInt * refmap, LONGLONG refmapsz, bool singlefiledump, SingleResult * singleresult,CompareResult * compareresult, Blockstatflags * bsf) {
+inline unsigned long long zigzag(LONGLONG v) {
+	return ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63);
+}
+//returns the amount of bytes, at most 10
+inline int varintencode(unsigned char * o, unsigned long long v) {
+	int n = 0;
+	while (v >= 0x80) {
+		o[n++] = (unsigned char)(v | 0x80);
+		v >>= 7;
+	}
+	o[n++] = (unsigned char)v;
+	return n;
+}
+void writebytes(Writer * w, const void * p, size_t n) {
+	const char * c = (const char*)p;
+	while (n > 0) {
+		writerroom(w, 1);
+		size_t part = WRITERBUF - w->used;
+		if (part > n) { part = n; }
+		memcpy(w->buf + w->used, c, part);
+		w->used += (int)part;
+		c += part;
+		n -= part;
+	}
+}
+inline void writevarint(Writer * w, unsigned long long v) {
+	writerroom(w, 10);
+	w->used += varintencode((unsigned char*)w->buf + w->used, v);
+}
+void writefixed(Writer * w, unsigned long long v) {
+	writerroom(w, 8);
+	for (int i = 0; i < 8; i++) {
+		w->buf[w->used++] = (char)(v >> (8 * i));
+	}
+}
+//where the next byte will end up
+inline LONGLONG writeroffset(Writer * w) {
+	return w->written + w->used;
+}
+//utf8 length as writechar encodes it
+size_t utf8len(const wchar_t * s) {
+	size_t n = 0;
+	bool pending = false;
+	for (; *s != L'\0'; s++) {
+		unsigned int c = (unsigned int)*s;
+		if (c >= 0xD800 && c <= 0xDBFF) { pending = true; continue; }
+		if (c >= 0xDC00 && c <= 0xDFFF && pending) { n += 4; }
+		else { n += (c < 0x80) ? 1 : (c < 0x800) ? 2 : (c < 0x10000) ? 3 : 4; }
+		pending = false;
+	}
+	return n;
+}
+void writebinstr(Writer * w, const wchar_t * s) {
+	writevarint(w, utf8len(s));
+	writestr(w, s);
+}
 
-	//need to have  a file handle open to the file
-	HANDLE fhandle = *psrchandle;
-	bool success = FALSE;
+//encodes one run of extents in its own buffer, the compare workers keep them till the output is written
+typedef struct _extentlog {
+	unsigned char * buf;
+	size_t used;
+	size_t size;
+	LONGLONG count;
+	LONGLONG nextvcn;
+	LONGLONG nextlcn;
+} ExtentLog;
+
+void extentlogreset(ExtentLog * log) {
+	log->used = 0;
+	log->count = 0;
+	log->nextvcn = 0;
+	log->nextlcn = 0;
+}
+void extentloginit(ExtentLog * log) {
+	log->size = 64 * 1024;
+	log->buf = (unsigned char*)malloc(log->size);
+	extentlogreset(log);
+}
+//lcn is -1 for an extent without location
+void extentlogadd(ExtentLog * log, LONGLONG vcn, LONGLONG lcn, LONGLONG clusters) {
+	if (log->used + 30 > log->size) {
+		log->size *= 2;
+		log->buf = (unsigned char*)realloc(log->buf, log->size);
+	}
+	unsigned char * o = log->buf + log->used;
+	int n = varintencode(o, ((unsigned long long)clusters << 1) | ((lcn < 0) ? 1 : 0));
+	n += varintencode(o + n, zigzag(vcn - log->nextvcn));
+	if (lcn >= 0) {
+		n += varintencode(o + n, zigzag(lcn - log->nextlcn));
+		log->nextlcn = lcn + clusters;
+	}
+	log->nextvcn = vcn + clusters;
+	log->used += n;
+	log->count++;
+}
+void extentlogfree(ExtentLog * log) {
+	free(log->buf);
+}
+//a run as it is stored in a record
+void writebinrun(Writer * w, LONGLONG count, const void * data, size_t len) {
+	writevarint(w, (unsigned long long)count);
+	writebytes(w, data, len);
+}
+void writebinheader(Writer * w, VINFO * vinfo) {
+	writebytes(w, BINMAGIC, 4);
+	writechar(w, (wchar_t)BINVERSION);
+	writevarint(w, (unsigned long long)vinfo->ClusterSize);
+	writevarint(w, (unsigned long long)vinfo->Clusters);
+	writebinstr(w, vinfo->Volume);
+}
+void writebinerrors(Writer * w, StringStack * ss) {
+	writevarint(w, ss->c);
+	for (int i = 0; i < ss->c; i++) {
+		writebinstr(w, strstackget(ss, i));
+	}
+}
+void writebintrailer(Writer * w, LONGLONG index, LONGLONG summary, LONGLONG files) {
+	writefixed(w, index);
+	writefixed(w, summary);
+	writefixed(w, files);
+	writebytes(w, BINTRAILERMAGIC, 4);
+}
 
-	//what is the clustersize
-	LONGLONG clustersize = vinfo->ClusterSize;
+/*
+TELEMETRY
+
+-T file writes how long every phase of the run took, as json or as a node_exporter textfile if the file ends with .prom
+discovery	-> finding the files (discovery thread, the cpu time does not include the tree walkers of -j)
+volume		-> checking that the files exist and are on the same volume
+extents		-> opening the files and querying the extents (FSCTL / FIEMAP / recording)
+refmap		-> adding the extents to the refcount engine
+histogram	-> share ratios out of the refcount engine
+output		-> formatting and writing the result
+The phases overlap (see PIPELINE), so every phase has
+	wall	first start till the last end
+	busy	time in the phase summed over all threads, more then wall if multiple workers are in it
+	cpu		cpu time of those threads while they were in the phase
+A worker keeps its own PhaseStat for a range and adds it when the range is done, so the hot loop only reads the clocks once per batch of extents
+Without -T the telemetry is NULL and nothing is measured
+*/
+#define PHASEDISCOVERY 0
+#define PHASEVOLUME 1
+#define PHASEEXTENTS 2
+#define PHASEREFMAP 3
+#define PHASEHISTOGRAM 4
+#define PHASEOUTPUT 5
+#define PHASES 6
+
+const char * phasenames[PHASES] = { "discovery", "volume", "extents", "refmap", "histogram", "output" };
+
+//times are ns since the start of the run, first is LLONG_MAX while the phase did not run
+typedef struct _phasestat {
+	LONGLONG first;
+	LONGLONG last;
+	LONGLONG busy;
+	LONGLONG cpu;
+	LONGLONG files;
+	LONGLONG extents;
+	LONGLONG ioctls;
+	//peak memory of the process the last time the phase reported
+	LONGLONG peak;
+} PhaseStat;
+
+typedef struct _telemetry {
+	std::chrono::steady_clock::time_point start;
+	LONGLONG startcpu;
+	PhaseStat phases[PHASES];
+	//bytes of the recording that are mapped (-r) and bytes the refcount engine holds
+	LONGLONG mapped;
+	LONGLONG committed;
+	std::mutex * lock;
+} Telemetry;
+
+//a phase that is running on this thread
+typedef struct _phasetimer {
+	LONGLONG wall;
+	LONGLONG cpu;
+} PhaseTimer;
+
+//cpu time in ns of the calling thread or of the whole process
+LONGLONG threadcputime() {
+#ifdef _WIN32
+	FILETIME c, e, k, u;
+	if (GetThreadTimes(GetCurrentThread(), &c, &e, &k, &u)) {
+		return ((((LONGLONG)k.dwHighDateTime << 32) | k.dwLowDateTime) + (((LONGLONG)u.dwHighDateTime << 32) | u.dwLowDateTime)) * 100;
+	}
+	return 0;
+#else
+	struct timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+		return (LONGLONG)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	}
+	return 0;
+#endif
+}
+LONGLONG processcputime() {
+#ifdef _WIN32
+	FILETIME c, e, k, u;
+	if (GetProcessTimes(GetCurrentProcess(), &c, &e, &k, &u)) {
+		return ((((LONGLONG)k.dwHighDateTime << 32) | k.dwLowDateTime) + (((LONGLONG)u.dwHighDateTime << 32) | u.dwLowDateTime)) * 100;
+	}
+	return 0;
+#else
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) == 0) {
+		return ((LONGLONG)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000LL + ((LONGLONG)ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000;
+	}
+	return 0;
+#endif
+}
 
-	
+void phasestatinit(PhaseStat * ps) {
+	memset(ps, 0, sizeof(PhaseStat));
+	ps->first = LLONG_MAX;
+}
 
+Telemetry * newTelemetry() {
+	Telemetry * tm = (Telemetry*)malloc(sizeof(Telemetry));
+	tm->start = std::chrono::steady_clock::now();
+	tm->startcpu = processcputime();
+	for (int p = 0; p < PHASES; p++) {
+		phasestatinit(&tm->phases[p]);
+	}
+	tm->mapped = 0;
+	tm->committed = 0;
+	tm->lock = new std::mutex();
+	return tm;
+}
 
-	//VCN -> virtual cluster number 
-	//	This reference the cluster number in the file itself. E.g 0 points to the beginning of the file, the last (VCN+The size of the extent)*clustersize should be the size of the file
-	//LCN -> logical cluster number
-	//	Where is the block located on the volume. It makes the mapping from VCN to volume. While the first VCN for every file is 0, the first LCN will of course not be because that would mean that every file starts at location zero on the filesystem
+void freeTelemetry(Telemetry * tm) {
+	delete tm->lock;
+	free(tm);
+}
 
-	//to query the vcn number, we have to pass the previous result last vcn number
-	//at the start, we just pass 0 to say we are starting at the verry beginning
-	LONGLONG startvcn = 0;
+LONGLONG telemetrynow(Telemetry * tm) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - tm->start).count();
+}
+
+//all of these do nothing if tm is NULL (no -T)
+void phasestart(Telemetry * tm, PhaseTimer * pt) {
+	if (tm == NULL) {
+		return;
+	}
+	pt->wall = telemetrynow(tm);
+	pt->cpu = threadcputime();
+}
+
+//add the time since phasestart to ps (which belongs to the calling thread)
+void phasestop(Telemetry * tm, PhaseTimer * pt, PhaseStat * ps) {
+	if (tm == NULL) {
+		return;
+	}
+	LONGLONG now = telemetrynow(tm);
+	ps->busy += now - pt->wall;
+	ps->cpu += threadcputime() - pt->cpu;
+	if (pt->wall < ps->first) { ps->first = pt->wall; }
+	if (now > ps->last) { ps->last = now; }
+}
+
+//merge the stats of a thread into the phase and start over
+void telemetryadd(Telemetry * tm, int phase, PhaseStat * ps) {
+	if (tm == NULL) {
+		return;
+	}
+	LONGLONG peak = peakmemory();
+	std::lock_guard<std::mutex> guard(*tm->lock);
+	PhaseStat * to = &tm->phases[phase];
+	if (ps->first < to->first) { to->first = ps->first; }
+	if (ps->last > to->last) { to->last = ps->last; }
+	to->busy += ps->busy;
+	to->cpu += ps->cpu;
+	to->files += ps->files;
+	to->extents += ps->extents;
+	to->ioctls += ps->ioctls;
+	if (peak > to->peak) { to->peak = peak; }
+	phasestatinit(ps);
+}
+
+//phasestop and telemetryadd in one for a phase that runs once
+void phasedone(Telemetry * tm, int phase, PhaseTimer * pt, LONGLONG files, LONGLONG extents, LONGLONG ioctls) {
+	if (tm == NULL) {
+		return;
+	}
+	PhaseStat ps;
+	phasestatinit(&ps);
+	phasestop(tm, pt, &ps);
+	ps.files = files;
+	ps.extents = extents;
+	ps.ioctls = ioctls;
+	telemetryadd(tm, phase, &ps);
+}
+
+void telemetryjson(Telemetry * tm, FILE * f, double wall, double cpu, LONGLONG peak) {
+	fprintf(f, "{\n\t\"wall\": %.6f,\n\t\"cpu\": %.6f,\n\t\"peakrss\": %lld,\n\t\"mapped\": %lld,\n\t\"refmapcommitted\": %lld,\n\t\"phases\": [", wall, cpu, peak, tm->mapped, tm->committed);
+	for (int p = 0; p < PHASES; p++) {
+		PhaseStat * ps = &tm->phases[p];
+		double span = (ps->last > ps->first) ? (ps->last - ps->first) / 1e9 : 0;
+		fprintf(f, "%s\n\t\t{ \"phase\": \"%s\", \"wall\": %.6f, \"busy\": %.6f, \"cpu\": %.6f, \"files\": %lld, \"extents\": %lld, \"ioctls\": %lld, \"peakrss\": %lld }", (p > 0) ? "," : "", phasenames[p], span, ps->busy / 1e9, ps->cpu / 1e9, ps->files, ps->extents, ps->ioctls, ps->peak);
+	}
+	fprintf(f, "\n\t]\n}\n");
+}
+
+void telemetryprom(Telemetry * tm, FILE * f, double wall, double cpu, LONGLONG peak) {
+	fprintf(f, "# HELP blockstat_wall_seconds Wall time of the run\n# TYPE blockstat_wall_seconds gauge\nblockstat_wall_seconds %.6f\n", wall);
+	fprintf(f, "# HELP blockstat_cpu_seconds Cpu time of the run\n# TYPE blockstat_cpu_seconds gauge\nblockstat_cpu_seconds %.6f\n", cpu);
+	fprintf(f, "# HELP blockstat_peak_rss_bytes Peak resident memory\n# TYPE blockstat_peak_rss_bytes gauge\nblockstat_peak_rss_bytes %lld\n", peak);
+	fprintf(f, "# HELP blockstat_mapped_bytes Bytes of the recording that were mapped\n# TYPE blockstat_mapped_bytes gauge\nblockstat_mapped_bytes %lld\n", tm->mapped);
+	fprintf(f, "# HELP blockstat_refmap_committed_bytes Bytes held by the refcount engine\n# TYPE blockstat_refmap_committed_bytes gauge\nblockstat_refmap_committed_bytes %lld\n", tm->committed);
+
+	const char * names[] = { "wall_seconds", "busy_seconds", "cpu_seconds", "files", "extents", "ioctls", "peak_rss_bytes" };
+	const char * help[] = { "First start till the last end of the phase", "Time in the phase summed over all threads", "Cpu time of the threads in the phase", "Files processed in the phase", "Extents processed in the phase", "Extent queries in the phase", "Peak resident memory at the end of the phase" };
+	for (int m = 0; m < 7; m++) {
+		fprintf(f, "# HELP blockstat_phase_%s %s\n# TYPE blockstat_phase_%s gauge\n", names[m], help[m], names[m]);
+		for (int p = 0; p < PHASES; p++) {
+			PhaseStat * ps = &tm->phases[p];
+			double v[] = { (ps->last > ps->first) ? (ps->last - ps->first) / 1e9 : 0, ps->busy / 1e9, ps->cpu / 1e9, (double)ps->files, (double)ps->extents, (double)ps->ioctls, (double)ps->peak };
+			fprintf(f, "blockstat_phase_%s{phase=\"%s\"} %.*f\n", names[m], phasenames[p], (m < 3) ? 6 : 0, v[m]);
+		}
+	}
+}
+
+//a textfile is written to a temporary file first, node_exporter should never read half of it
+bool telemetrywrite(Telemetry * tm, const char * file) {
+	size_t len = strlen(file);
+	bool prom = (len > 5 && strcmp(file + len - 5, ".prom") == 0);
+	char * tmp = (char*)malloc(len + 5);
+	snprintf(tmp, len + 5, "%s%s", file, prom ? ".tmp" : "");
+
+	FILE * f = NULL;
+	if (fopen_s(&f, tmp, "w") != 0) {
+		free(tmp);
+		return false;
+	}
+	double wall = telemetrynow(tm) / 1e9;
+	double cpu = (processcputime() - tm->startcpu) / 1e9;
+	if (prom) {
+		telemetryprom(tm, f, wall, cpu, peakmemory());
+	}
+	else {
+		telemetryjson(tm, f, wall, cpu, peakmemory());
+	}
+	bool ok = (fclose(f) == 0);
+	if (ok && prom) {
+#ifdef _WIN32
+		ok = MoveFileExA(tmp, file, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+		ok = rename(tmp, file) == 0;
+#endif
+	}
+	free(tmp);
+	return ok;
+}
+
+//recorded extents for -r (see REPLAY)
+struct _replay;
+//-c (see EXTENT CACHE)
+struct _extentcache;
+
+//generic option struct
+typedef struct _Blockstatflags {
+	int format;
+	FILE* printer;
+	Writer* out;
+	bool printerisfile;
+	bool verbose;
+	int engine;
+	int width;
+	int jobs;
+	bool hugepages;
+	bool stream;
+	struct _replay * replay;
+	//-T, NULL if the phases are not measured
+	Telemetry * telemetry;
+	//-p seconds between progress lines, 0 is none
+	int progress;
+	//-c, NULL if there is no cache
+	struct _extentcache * cache;
+	//-g, MATRIXNONE if there is no sharing matrix, groups holds the prefixes of a groups file
+	int matrix;
+	StringStack * groups;
+	//-u exclusive bytes per file
+	bool exclusive;
+} Blockstatflags;
+
+//-v lines, they go to stderr if the output is a file (-o) so they never end up in the result
+//on the screen they stay on stdout so they are shown in between the output
+void verboseprint(Blockstatflags * bsf, const wchar_t * format, ...) {
+	FILE * f = bsf->printerisfile ? stderr : stdout;
+	va_list args;
+	va_start(args, format);
+	fputws(L"VERBOSE: ", f);
+	vfwprintf(f, format, args);
+	va_end(args);
+}
+
+//generic function to get volume the volume info we need
+#ifdef _WIN32
+bool GetVolInfo(wchar_t * pfname, VINFO * vinfo) {
+	bool success = false;
+	vinfo->Device = 0;
+
+	if (GetVolumePathName(pfname, vinfo->Volume, SUPERMAXPATH)) {
+		DWORD SectorsPerCluster;
+		DWORD BytesPerSector;
+		DWORD NumberOfFreeClusters;
+		DWORD TotalNumberOfClusters;
+
+		if (GetDiskFreeSpace(vinfo->Volume, &SectorsPerCluster, &BytesPerSector, &NumberOfFreeClusters, &TotalNumberOfClusters)) {
+			//vinfo->Clusters = TotalNumberOfClusters;
+			vinfo->ClusterSize = SectorsPerCluster*BytesPerSector;
+
+			//very big volumes don't like the 32 bit integer 
+			//16TB at 4KB cluster size maxes out TotalNumberOfClusters
+			
+			ULARGE_INTEGER TotalNumberOfBytes;
+			if (GetDiskFreeSpaceEx(vinfo->Volume, NULL, &TotalNumberOfBytes, NULL)) {
+				vinfo->Clusters = (TotalNumberOfBytes.QuadPart / vinfo->ClusterSize);
+
+				
+				success = true;
+			}
+		}
+	}
+	return success;
+}
+#else
+//cluster size is the fundamental block size of the filesystem (f_frsize, f_blocks is expressed in it)
+//the volume is identified by st_dev. For printing, we walk up the path until the device changes, which gives the mount point (like GetVolumePathName)
+bool GetVolInfo(wchar_t * pfname, VINFO * vinfo) {
+	bool success = false;
+	char path[SUPERMAXPATH * 4];
+	char mount[PATH_MAX];
+	struct stat st;
+	struct statfs sfs;
+
+	if (tombpath(pfname, path, sizeof(path)) && stat(path, &st) == 0 && statfs(path, &sfs) == 0 && realpath(path, mount) != NULL) {
+		vinfo->ClusterSize = (DWORD)(sfs.f_frsize > 0 ? sfs.f_frsize : sfs.f_bsize);
+		vinfo->Clusters = (ULONGLONG)sfs.f_blocks;
+		if (sfs.f_frsize == 0) { vinfo->Clusters = ((ULONGLONG)sfs.f_blocks * sfs.f_bsize) / vinfo->ClusterSize; }
+		vinfo->Device = (ULONGLONG)st.st_dev;
+
+		char * cut;
+		while ((cut = strrchr(mount, '/')) != NULL) {
+			char parent[PATH_MAX];
+			struct stat pst;
+			size_t pl = (cut == mount) ? 1 : (size_t)(cut - mount);
+			memcpy(parent, mount, pl);
+			parent[pl] = 0;
+			if (strcmp(parent, mount) == 0 || stat(parent, &pst) != 0 || pst.st_dev != st.st_dev) {
+				break;
+			}
+			strcpy(mount, parent);
+		}
 
-	//we need this to hold the ref to the very first vcn
-	STARTING_VCN_INPUT_BUFFER StartingPointInputBuffer = { 0 };
-	StartingPointInputBuffer.StartingVcn.QuadPart = startvcn;
+		if (mbstowcs(vinfo->Volume, mount, SUPERMAXPATH - 1) != (size_t)-1) {
+			vinfo->Volume[SUPERMAXPATH - 1] = 0;
+			success = true;
+		}
+	}
+	return success;
+}
+#endif
+
+//are two files on the same volume
+bool samevolume(VINFO * a, VINFO * b) {
+#ifdef _WIN32
+	return (_wcsicmp(a->Volume, b->Volume) == 0);
+#else
+	return (a->Device == b->Device);
+#endif
+}
+
+//adding errors to the result for printing later
+void resulterradd(SingleResult * singleresult, CompareResult * compareresult,LPCWSTR errprefix) {
+	if (singleresult != NULL) {
+		addStringStackError(singleresult->errors, errprefix);
+	}
+	else if (compareresult != NULL) {
+		addStringStackError(compareresult->errors, errprefix);
+	}
+	else {
+		wprintf(L"Error printing fails, should not happen, predumping to console\n");
+		printLastError(errprefix);
+	}
+}
 
-	//Normally you should be able to query multiple VCN + Extentsize ( reference of a block/fragment) at once but this give bad result
-	//querying them one by one seems to work
-	INT extents = 4096;
-	extents = 1;
 
+/*
+EXTENT SOURCES
+
+Hides how the extents of a file are queried so that vcnnums does not care about the platform
+windows -> FSCTL_GET_RETRIEVAL_POINTERS
+linux	-> FS_IOC_FIEMAP
+-r		-> a recording (see REPLAY)
+
+next fills batch with a pointer to the extents (owned by the source) and got with the amount of extents
+returns 0 if there is more to query, 1 if the end of the file is reached, 2 if something went wrong (GetLastError tells what)
+seek makes the next query start at a vcn, the first extent returned can start before it if the vcn is in the middle of an extent
+vcnend stops the querying at a vcn (-1 is till the end of the file), the last extent can go past it
+vcns is the size of the file in clusters
+ioctls counts how many times the kernel was queried for this file
+*/
+typedef struct _extentsource {
+	void * ctx;
+	int (*next)(struct _extentsource * es, Extent ** batch, LONGLONG * got);
+	void (*seek)(struct _extentsource * es, LONGLONG vcn);
+	void (*close)(struct _extentsource * es);
+	LONGLONG vcns;
+	LONGLONG vcnend;
+	LONGLONG ioctls;
+} ExtentSource;
+
+//every query asks for a lot of extents at once so that fragmented files do not cost one syscall per extent
+//if the kernel tells us there is more data than fitted, the buffer grows 4x for the next query (up to the max)
+#define EXTENTSFIRSTQUERY 4096
+#define EXTENTSMAXQUERY (1024*1024)
+
+#ifdef _WIN32
+typedef struct _winextentctx {
+	HANDLE fhandle;
+	STARTING_VCN_INPUT_BUFFER StartingPointInputBuffer;
+	PRETRIEVAL_POINTERS_BUFFER lpRetrievalPointersBuffer;
+	INT iExtentsBufferSize;
+	INT extents;
+	bool grow;
+	Extent * batch;
+} WinExtentCtx;
+
+//(re)allocate the buffers so they can hold extents
+void winextentalloc(WinExtentCtx * ctx, INT extents) {
 	//2*LI = StartVCN + ExtCount | 2*LI*extents = (NextVcn+Lcn)*extents
 	//Per "extent" we need 2* the result of large integer
 	//on top of that, we will store the the startvcn
-	INT iExtentsBufferSize = (sizeof(LARGE_INTEGER)*2)+((sizeof(LARGE_INTEGER) * 2)*extents);
+	ctx->extents = extents;
+	ctx->iExtentsBufferSize = (sizeof(LARGE_INTEGER)*2)+((sizeof(LARGE_INTEGER) * 2)*extents);
+
+	free(ctx->lpRetrievalPointersBuffer);
+	free(ctx->batch);
+	ctx->lpRetrievalPointersBuffer = (PRETRIEVAL_POINTERS_BUFFER)malloc(ctx->iExtentsBufferSize);
+	ctx->batch = (Extent*)malloc(sizeof(Extent)*extents);
+}
+
+int winextentnext(ExtentSource * es, Extent ** batch, LONGLONG * got) {
+	WinExtentCtx * ctx = (WinExtentCtx*)es->ctx;
 
-	//we allocate space for this in memory using the previously calculated size
-	//this is overcomplicated code since we query only one extent at the time but just if ever we can figure out why the extents 4096 does not work
-	PRETRIEVAL_POINTERS_BUFFER lpRetrievalPointersBuffer = (PRETRIEVAL_POINTERS_BUFFER)malloc(iExtentsBufferSize);
+	//previous call did not fit, the caller is done with the previous batch so we can safely grow now
+	if (ctx->grow) {
+		winextentalloc(ctx, ctx->extents * 4);
+		ctx->grow = false;
+	}
+
+	*batch = ctx->batch;
+	*got = 0;
+
+	//the part that was asked for is done
+	if (es->vcnend >= 0 && ctx->StartingPointInputBuffer.StartingVcn.QuadPart >= es->vcnend) {
+		return 1;
+	}
 
 	//how much data is return by the code
 	//obligatory field for the call pointer retrieval call
 	DWORD dwBytesReturned;
+	int contstatus = 0;
+
+	//on the file execute get pointers. Watchout they do not refer to the physical volume but rather to the logical volume
+	es->ioctls++;
+	BOOL s = DeviceIoControl(ctx->fhandle, FSCTL_GET_RETRIEVAL_POINTERS, &ctx->StartingPointInputBuffer, sizeof(STARTING_VCN_INPUT_BUFFER), ctx->lpRetrievalPointersBuffer, ctx->iExtentsBufferSize, &dwBytesReturned, NULL);
+
+	//if sucess = true, there is no error. It means all the pointers retrieval fitted into the buffer
+	//basically it means we are at the end of the file
+	if (s) { contstatus = 1; }
+	//if we have success = false, that doesn't mean there is a real issue. In most cases, it just means the data did not fit completely in the the buffer. Means we need to requery
+	//if however the error does not equal ERROR_MORE_DATA, something else went wrong, and we stop the process
+	else {
+		DWORD error = GetLastError();
+
+		//nothing is returned for (small) files that have no extents
+		if (error == ERROR_HANDLE_EOF) {
+			return 1;
+		}
+		else if (error != ERROR_MORE_DATA) {
+			return 2;
+		}
+		ctx->grow = (ctx->extents < EXTENTSMAXQUERY);
+	}
+
+	//work directly on the buffer. Copying the struct (as was done before) only copies the first extent which is why querying multiple extents gave bad results
+	PRETRIEVAL_POINTERS_BUFFER rpb = ctx->lpRetrievalPointersBuffer;
+
+	//what is the startvcn
+	LONGLONG startvcn = rpb->StartingVcn.QuadPart;
+
+	//convert the extent array from a pointer to an array
+	PVCNLCNMAP extents = (PVCNLCNMAP)&(rpb->Extents);
+
+	for (DWORD ec = 0; ec < (rpb->ExtentCount); ec++) {
+		//the size of this extent is the (nextvcn it's address - the current vcn/startvcn)
+		ctx->batch[ec].vcn = startvcn;
+		ctx->batch[ec].lcn = extents[ec].Lcn.QuadPart;
+		ctx->batch[ec].clusters = (extents[ec].NextVcn.QuadPart - startvcn);
+
+		//the new startvcn (cluster number) is set to nextvcn, so that we can do correct calculation on the size of the of the extent
+		startvcn = extents[ec].NextVcn.QuadPart;
+	}
+	*got = rpb->ExtentCount;
+
+	//set the startingvcn to the nextvcn of the last extent so we can query more pointers
+	ctx->StartingPointInputBuffer.StartingVcn.QuadPart = startvcn;
+	return contstatus;
+}
+
+void winextentseek(ExtentSource * es, LONGLONG vcn) {
+	WinExtentCtx * ctx = (WinExtentCtx*)es->ctx;
+	ctx->StartingPointInputBuffer.StartingVcn.QuadPart = vcn;
+}
+
+void winextentclose(ExtentSource * es) {
+	WinExtentCtx * ctx = (WinExtentCtx*)es->ctx;
+	CloseHandle(ctx->fhandle);
+	free(ctx->lpRetrievalPointersBuffer);
+	free(ctx->batch);
+	free(ctx);
+}
+
+//open the file in read/shared modus and prepare the buffers for querying the pointers
+bool openextentsource(wchar_t * src, VINFO * vinfo, ExtentSource * es) {
+	HANDLE srchandle = CreateFile(src, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (srchandle == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	WinExtentCtx * ctx = (WinExtentCtx*)malloc(sizeof(WinExtentCtx));
+	ctx->fhandle = srchandle;
+
+	//to query the vcn number, we have to pass the previous result last vcn number
+	//at the start, we just pass 0 to say we are starting at the verry beginning
+	ctx->StartingPointInputBuffer = { 0 };
+	ctx->StartingPointInputBuffer.StartingVcn.QuadPart = 0;
+
+	ctx->lpRetrievalPointersBuffer = NULL;
+	ctx->batch = NULL;
+	ctx->grow = false;
+	winextentalloc(ctx, EXTENTSFIRSTQUERY);
+
+	LARGE_INTEGER filesize;
+	if (!GetFileSizeEx(srchandle, &filesize)) {
+		filesize.QuadPart = 0;
+	}
+
+	es->ctx = ctx;
+	es->next = winextentnext;
+	es->seek = winextentseek;
+	es->close = winextentclose;
+	es->vcns = (filesize.QuadPart + vinfo->ClusterSize - 1) / vinfo->ClusterSize;
+	es->vcnend = -1;
+	es->ioctls = 0;
+	return true;
+}
+
+//windows has no change time in the handle info, the creation time is used instead
+bool fileidentity(wchar_t * src, FileId * fid) {
+	HANDLE h = CreateFile(src, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (h == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	BY_HANDLE_FILE_INFORMATION info;
+	bool ok = GetFileInformationByHandle(h, &info) != 0;
+	CloseHandle(h);
+	if (!ok) {
+		return false;
+	}
+	fid->dev = info.dwVolumeSerialNumber;
+	fid->id = ((ULONGLONG)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+	fid->size = ((ULONGLONG)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+	fid->mtime = ((ULONGLONG)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+	fid->ctime = ((ULONGLONG)info.ftCreationTime.dwHighDateTime << 32) | info.ftCreationTime.dwLowDateTime;
+	return fid->id != 0;
+}
+#else
+//fiemap works in bytes, extents are converted to clusters of the volume
+typedef struct _fiemapextentctx {
+	int fd;
+	LONGLONG clustersize;
+	ULONGLONG nextoffset;
+	struct fiemap * fm;
+	int extents;
+	bool grow;
+	Extent * batch;
+} FiemapExtentCtx;
+
+//extents without a real location are flagged with lcn -1 (same as a sparse range on windows)
+#define FIEMAP_NOT_LOCATED (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL | FIEMAP_EXTENT_NOT_ALIGNED)
+
+//(re)allocate the buffers so they can hold extents
+void fiemapextentalloc(FiemapExtentCtx * ctx, int extents) {
+	ctx->extents = extents;
+	free(ctx->fm);
+	free(ctx->batch);
+	ctx->fm = (struct fiemap*)malloc(sizeof(struct fiemap) + sizeof(struct fiemap_extent)*extents);
+	ctx->batch = (Extent*)malloc(sizeof(Extent)*extents);
+}
+
+int fiemapextentnext(ExtentSource * es, Extent ** batch, LONGLONG * got) {
+	FiemapExtentCtx * ctx = (FiemapExtentCtx*)es->ctx;
+
+	//previous call filled the buffer, the caller is done with the previous batch so we can safely grow now
+	if (ctx->grow) {
+		fiemapextentalloc(ctx, ctx->extents * 4);
+		ctx->grow = false;
+	}
+
+	struct fiemap * fm = ctx->fm;
+	LONGLONG clustersize = ctx->clustersize;
+	int contstatus = 0;
+	*batch = ctx->batch;
+	*got = 0;
+
+	//query from the end of the previous extent till the end of the file (or vcnend)
+	//sync makes sure delayed allocations get a real location before we ask for it (only needed the first time)
+	ULONGLONG endoffset = (es->vcnend >= 0) ? (ULONGLONG)es->vcnend * clustersize : FIEMAP_MAX_OFFSET;
+	if (ctx->nextoffset >= endoffset) {
+		return 1;
+	}
+	memset(fm, 0, sizeof(struct fiemap));
+	fm->fm_start = ctx->nextoffset;
+	fm->fm_length = endoffset - ctx->nextoffset;
+	fm->fm_flags = (es->ioctls == 0) ? FIEMAP_FLAG_SYNC : 0;
+	fm->fm_extent_count = ctx->extents;
+
+	es->ioctls++;
+	if (ioctl(ctx->fd, FS_IOC_FIEMAP, fm) < 0) {
+		return 2;
+	}
+
+	//nothing mapped anymore (or an empty file)
+	if (fm->fm_mapped_extents == 0) {
+		return 1;
+	}
+
+	for (__u32 ec = 0; ec < fm->fm_mapped_extents; ec++) {
+		struct fiemap_extent * fe = &(fm->fm_extents[ec]);
+		Extent * e = &(ctx->batch[ec]);
+
+		e->vcn = (LONGLONG)(fe->fe_logical / clustersize);
+		e->clusters = (LONGLONG)((fe->fe_length + clustersize - 1) / clustersize);
+		e->lcn = (fe->fe_flags & FIEMAP_NOT_LOCATED) ? -1 : (LONGLONG)(fe->fe_physical / clustersize);
+
+		ctx->nextoffset = fe->fe_logical + fe->fe_length;
+		if (fe->fe_flags & FIEMAP_EXTENT_LAST) {
+			contstatus = 1;
+		}
+	}
+	*got = fm->fm_mapped_extents;
+
+	//a full buffer means the kernel had more to tell
+	if (contstatus == 0 && fm->fm_mapped_extents == fm->fm_extent_count && ctx->extents < EXTENTSMAXQUERY) {
+		ctx->grow = true;
+	}
+	return contstatus;
+}
+
+void fiemapextentseek(ExtentSource * es, LONGLONG vcn) {
+	FiemapExtentCtx * ctx = (FiemapExtentCtx*)es->ctx;
+	ctx->nextoffset = (ULONGLONG)vcn * ctx->clustersize;
+}
+
+void fiemapextentclose(ExtentSource * es) {
+	FiemapExtentCtx * ctx = (FiemapExtentCtx*)es->ctx;
+	close(ctx->fd);
+	free(ctx->fm);
+	free(ctx->batch);
+	free(ctx);
+}
+
+bool openextentsource(wchar_t * src, VINFO * vinfo, ExtentSource * es) {
+	char path[SUPERMAXPATH * 4];
+	if (!tombpath(src, path, sizeof(path))) {
+		return false;
+	}
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+
+	FiemapExtentCtx * ctx = (FiemapExtentCtx*)malloc(sizeof(FiemapExtentCtx));
+	ctx->fd = fd;
+	ctx->clustersize = vinfo->ClusterSize;
+	ctx->nextoffset = 0;
+	ctx->fm = NULL;
+	ctx->batch = NULL;
+	ctx->grow = false;
+	fiemapextentalloc(ctx, EXTENTSFIRSTQUERY);
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		st.st_size = 0;
+	}
+
+	es->ctx = ctx;
+	es->next = fiemapextentnext;
+	es->seek = fiemapextentseek;
+	es->close = fiemapextentclose;
+	es->vcns = ((LONGLONG)st.st_size + vinfo->ClusterSize - 1) / vinfo->ClusterSize;
+	es->vcnend = -1;
+	es->ioctls = 0;
+	return true;
+}
+
+bool fileidentity(wchar_t * src, FileId * fid) {
+	char path[SUPERMAXPATH * 4];
+	struct stat st;
+	if (!tombpath(src, path, sizeof(path)) || stat(path, &st) != 0) {
+		return false;
+	}
+	fid->dev = (ULONGLONG)st.st_dev;
+	fid->id = (ULONGLONG)st.st_ino;
+	fid->size = (ULONGLONG)st.st_size;
+	fid->mtime = (ULONGLONG)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+	fid->ctime = (ULONGLONG)st.st_ctim.tv_sec * 1000000000ULL + st.st_ctim.tv_nsec;
+	return fid->id != 0;
+}
+#endif
+
+/*
+REPLAY
+
+-r reads the extents from a recording instead of asking the filesystem, so the analysis can run somewhere else (another machine, other engines or parameters, a benchmark without a reflink volume)
+The recording is a binary dump (-f bin, mapped as is) or a csv with the records of -f csv (a file record followed by its vcn records, fsinfo gives the volume and clustersize)
+Only the single file dumps of -f csv have vcn records, the csv of a compare only has the results so it is refused (it would replay every file as empty)
+A csv is encoded to the same runs in memory, so the extent source only knows one format
+All files are on the volume of the recording. The files are all the files in it, unless files are given on the cli, with -i or on stdin (then they are looked up by path)
+*/
+#define REPLAYBATCH 4096
+
+typedef struct _replayfile {
+	const wchar_t * path;
+	//runs of the file (see BINARY DUMP), decoding never goes past end
+	const unsigned char * runs;
+	const unsigned char * end;
+	LONGLONG vcns;
+} ReplayFile;
+
+typedef std::unordered_map<const wchar_t*, int, WcsHash, WcsEq> ReplayIndex;
+
+typedef struct _replay {
+	VINFO vinfo;
+	ReplayFile * files;
+	int filesc;
+	int filesl;
+	ReplayIndex * index;
+	Arena arena;
+	//the mapped dump, NULL for a csv
+	unsigned char * map;
+	size_t mapsize;
+#ifdef _WIN32
+	HANDLE fh;
+	HANDLE mh;
+#endif
+} Replay;
+
+bool varintdecode(const unsigned char ** p, const unsigned char * end, unsigned long long * v) {
+	unsigned long long r = 0;
+	for (int s = 0; s < 64 && *p < end; s += 7) {
+		unsigned char c = *(*p)++;
+		r |= (unsigned long long)(c & 0x7f) << s;
+		if (c < 0x80) {
+			*v = r;
+			return true;
+		}
+	}
+	return false;
+}
+inline LONGLONG unzigzag(unsigned long long v) {
+	return (LONGLONG)(v >> 1) ^ -(LONGLONG)(v & 1);
+}
+//one extent of a run, the reverse of extentlogadd
+bool extentdecode(const unsigned char ** p, const unsigned char * end, LONGLONG * nextvcn, LONGLONG * nextlcn, Extent * e) {
+	unsigned long long c, dv, dl;
+	if (!varintdecode(p, end, &c) || !varintdecode(p, end, &dv)) {
+		return false;
+	}
+	e->clusters = (LONGLONG)(c >> 1);
+	e->vcn = *nextvcn + unzigzag(dv);
+	*nextvcn = e->vcn + e->clusters;
+	if (c & 1) {
+		e->lcn = -1;
+	}
+	else {
+		if (!varintdecode(p, end, &dl)) {
+			return false;
+		}
+		e->lcn = *nextlcn + unzigzag(dl);
+		*nextlcn = e->lcn + e->clusters;
+	}
+	return true;
+}
+//utf8 to wide, bad bytes become U+FFFD, false if it does not fit in outl (with the terminator)
+bool utf8decode(const unsigned char * s, size_t n, wchar_t * out, size_t outl) {
+	size_t o = 0;
+	size_t i = 0;
+	while (i < n) {
+		unsigned int c = s[i++];
+		int more = (c < 0x80) ? 0 : (c < 0xC0) ? -1 : (c < 0xE0) ? 1 : (c < 0xF0) ? 2 : (c < 0xF8) ? 3 : -1;
+		if (more < 0 || i + more > n) {
+			c = 0xFFFD;
+		}
+		else if (more > 0) {
+			c &= (0x7F >> (more + 1));
+			for (int m = 0; m < more; m++, i++) {
+				if ((s[i] & 0xC0) != 0x80) {
+					c = 0xFFFD;
+					break;
+				}
+				c = (c << 6) | (s[i] & 0x3F);
+			}
+		}
+		if (o + 3 > outl) {
+			return false;
+		}
+		if (sizeof(wchar_t) == 2 && c >= 0x10000) {
+			c -= 0x10000;
+			out[o++] = (wchar_t)(0xD800 + (c >> 10));
+			out[o++] = (wchar_t)(0xDC00 + (c & 0x3FF));
+		}
+		else {
+			out[o++] = (wchar_t)c;
+		}
+	}
+	out[o] = L'\0';
+	return true;
+}
+ULONGLONG readfixed(const unsigned char * p) {
+	ULONGLONG v = 0;
+	for (int i = 7; i >= 0; i--) {
+		v = (v << 8) | p[i];
+	}
+	return v;
+}
+
+//walks the runs once, checks that they decode and finds the size of the file (end of the last extent)
+bool replayscan(const unsigned char * p, const unsigned char * end, LONGLONG * vcns) {
+	*vcns = 0;
+	while (true) {
+		unsigned long long count;
+		if (!varintdecode(&p, end, &count)) {
+			return false;
+		}
+		if (count == 0) {
+			return true;
+		}
+		LONGLONG nextvcn = 0;
+		LONGLONG nextlcn = 0;
+		for (unsigned long long i = 0; i < count; i++) {
+			Extent e;
+			if (!extentdecode(&p, end, &nextvcn, &nextlcn, &e)) {
+				return false;
+			}
+			if (nextvcn > *vcns) { *vcns = nextvcn; }
+		}
+	}
+}
+
+//a path can be recorded more than once (it was given more than once), every record is replayed but a lookup by path finds the first one
+bool replayadd(Replay * rp, const wchar_t * path, const unsigned char * runs, const unsigned char * end) {
+	LONGLONG vcns;
+	if (!replayscan(runs, end, &vcns)) {
+		return false;
+	}
+	if (rp->filesc == rp->filesl) {
+		rp->filesl = (rp->filesl > 0) ? rp->filesl * 2 : 1024;
+		rp->files = (ReplayFile*)realloc(rp->files, sizeof(ReplayFile) * rp->filesl);
+	}
+	ReplayFile * rf = &rp->files[rp->filesc];
+	ReplayIndex::iterator it = rp->index->find(path);
+	rf->runs = runs;
+	rf->end = end;
+	rf->vcns = vcns;
+	if (it == rp->index->end()) {
+		rf->path = arenawcsdup(&rp->arena, path, wcslen(path));
+		(*rp->index)[rf->path] = rp->filesc;
+	}
+	else {
+		rf->path = it->first;
+	}
+	rp->filesc++;
+	return true;
+}
+
+//the dump is used in place, only the paths are decoded
+bool replaybin(Replay * rp, const unsigned char * data, size_t size) {
+	if (size < 5 + BINTRAILER || memcmp(data, BINMAGIC, 4) != 0 || data[4] != BINVERSION || memcmp(data + size - 4, BINTRAILERMAGIC, 4) != 0) {
+		return false;
+	}
+	const unsigned char * trailer = data + size - BINTRAILER;
+	ULONGLONG index = readfixed(trailer);
+	ULONGLONG summary = readfixed(trailer + 8);
+	ULONGLONG files = readfixed(trailer + 16);
+	if (summary > index || index > size - BINTRAILER || (size - BINTRAILER - index) / 24 != files || (size - BINTRAILER - index) % 24 != 0) {
+		return false;
+	}
+
+	const unsigned char * p = data + 5;
+	const unsigned char * end = data + summary;
+	unsigned long long clustersize, clusters, len;
+	if (!varintdecode(&p, end, &clustersize) || !varintdecode(&p, end, &clusters) || !varintdecode(&p, end, &len) || len > (unsigned long long)(end - p) || clustersize == 0) {
+		return false;
+	}
+	rp->vinfo.ClusterSize = (DWORD)clustersize;
+	rp->vinfo.Clusters = clusters;
+	if (!utf8decode(p, (size_t)len, rp->vinfo.Volume, SUPERMAXPATH)) {
+		return false;
+	}
+
+	wchar_t * path = (wchar_t*)malloc(sizeof(wchar_t)*SUPERMAXPATH);
+	bool ok = true;
+	for (ULONGLONG f = 0; f < files && ok; f++) {
+		ULONGLONG record = readfixed(data + index + 24 * f);
+		p = data + record;
+		ok = record < summary && varintdecode(&p, end, &len) && len <= (unsigned long long)(end - p) && utf8decode(p, (size_t)len, path, SUPERMAXPATH);
+		if (ok) {
+			ok = replayadd(rp, path, p + len, end);
+		}
+	}
+	free(path);
+	return ok;
+}
+
+//splits a csv line in place, quoted fields are unquoted, returns the amount of fields
+int csvsplit(char * line, char ** fields, int max) {
+	int n = 0;
+	char * r = line;
+	while (n < max) {
+		char * w = r;
+		fields[n++] = w;
+		if (*r == '"') {
+			r++;
+			while (*r != '\0') {
+				if (*r == '"' && r[1] == '"') { *w++ = '"'; r += 2; }
+				else if (*r == '"') { r++; break; }
+				else { *w++ = *r++; }
+			}
+		}
+		while (*r != '\0' && *r != ',') { *w++ = *r++; }
+		bool more = (*r == ',');
+		*w = '\0';
+		if (!more) {
+			break;
+		}
+		r++;
+	}
+	return n;
+}
+
+//the runs of a csv file are encoded in the arena: one run with all its vcn records and the end marker
+bool replaycsvfile(Replay * rp, const wchar_t * path, ExtentLog * log) {
+	unsigned char * runs = (unsigned char*)arenaalloc(&rp->arena, log->used + 20);
+	int n = varintencode(runs, log->count);
+	memcpy(runs + n, log->buf, log->used);
+	n += (int)log->used;
+	if (log->count > 0) {
+		n += varintencode(runs + n, 0);
+	}
+	return replayadd(rp, path, runs, runs + n);
+}
+
+bool replaycsv(Replay * rp, char * text) {
+	wchar_t * path = (wchar_t*)malloc(sizeof(wchar_t)*SUPERMAXPATH);
+	path[0] = L'\0';
+	bool infile = false;
+	bool ok = true;
+	//vcn records and the records that only a compare writes (share, pair, group, exclusive and its total)
+	bool extents = false;
+	bool compared = false;
+	ExtentLog log;
+	extentloginit(&log);
+	rp->vinfo.ClusterSize = 0;
+
+	char * line = text;
+	while (line != NULL && ok) {
+		char * next = strchr(line, '\n');
+		if (next != NULL) { *next++ = '\0'; }
+		size_t l = strlen(line);
+		if (l > 0 && line[l - 1] == '\r') { line[l - 1] = '\0'; }
+
+		char * f[6];
+		int n = csvsplit(line, f, 6);
+		if (n >= 4 && strcmp(f[0], "fsinfo") == 0) {
+			//the first one counts, every dump in a concatenated csv has its own
+			if (rp->vinfo.ClusterSize == 0) {
+				rp->vinfo.ClusterSize = (DWORD)atoll(f[2]);
+				rp->vinfo.Clusters = (ULONGLONG)atoll(f[3]);
+				ok = utf8decode((unsigned char*)f[1], strlen(f[1]), rp->vinfo.Volume, SUPERMAXPATH);
+			}
+		}
+		else if (n >= 2 && strcmp(f[0], "file") == 0) {
+			if (infile) {
+				ok = replaycsvfile(rp, path, &log);
+			}
+			extentlogreset(&log);
+			infile = ok && utf8decode((unsigned char*)f[1], strlen(f[1]), path, SUPERMAXPATH);
+			ok = infile;
+		}
+		else if (n >= 5 && strcmp(f[0], "vcn") == 0) {
+			//sz is in bytes
+			ok = infile && rp->vinfo.ClusterSize > 0;
+			if (ok) {
+				LONGLONG clustersize = rp->vinfo.ClusterSize;
+				extentlogadd(&log, atoll(f[2]), atoll(f[3]), (atoll(f[4]) + clustersize - 1) / clustersize);
+				extents = true;
+			}
+		}
+		else if (strcmp(f[0], "share") == 0 || strcmp(f[0], "pair") == 0 || strcmp(f[0], "group") == 0 || strcmp(f[0], "exclusive") == 0 || (n >= 6 && strcmp(f[0], "total") == 0)) {
+			compared = true;
+		}
+		line = next;
+	}
+	if (ok && compared && !extents) {
+		wprintf(L"The csv is the result of a compare and has no extents, record with -f bin or dump the files one by one with -f csv\n");
+		ok = false;
+	}
+	if (ok && infile) {
+		ok = replaycsvfile(rp, path, &log);
+	}
+	extentlogfree(&log);
+	free(path);
+	return ok && rp->vinfo.ClusterSize > 0;
+}
+
+void freeReplay(Replay * rp) {
+	if (rp->map != NULL) {
+#ifdef _WIN32
+		UnmapViewOfFile(rp->map);
+		CloseHandle(rp->mh);
+		CloseHandle(rp->fh);
+#else
+		munmap(rp->map, rp->mapsize);
+#endif
+	}
+	delete rp->index;
+	arenafree(&rp->arena);
+	free(rp->files);
+	free(rp);
+}
+
+//maps a binary dump or reads a csv, NULL if it is neither
+Replay * openreplay(const char * file) {
+	Replay * rp = (Replay*)calloc(1, sizeof(Replay));
+	rp->index = new ReplayIndex();
+	arenainit(&rp->arena);
+
+	size_t size = 0;
+	unsigned char * data = NULL;
+#ifdef _WIN32
+	LARGE_INTEGER li;
+	rp->fh = CreateFileA(file, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (rp->fh != INVALID_HANDLE_VALUE && GetFileSizeEx(rp->fh, &li) && li.QuadPart > 0) {
+		size = (size_t)li.QuadPart;
+		rp->mh = CreateFileMapping(rp->fh, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (rp->mh != NULL) {
+			data = (unsigned char*)MapViewOfFile(rp->mh, FILE_MAP_READ, 0, 0, 0);
+		}
+	}
+#else
+	int fd = open(file, O_RDONLY);
+	struct stat st;
+	if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+		size = (size_t)st.st_size;
+		void * m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		data = (m == MAP_FAILED) ? NULL : (unsigned char*)m;
+	}
+	if (fd >= 0) { close(fd); }
+#endif
+	if (data == NULL) {
+		freeReplay(rp);
+		return NULL;
+	}
+	rp->map = data;
+	rp->mapsize = size;
+
+	bool ok;
+	if (size >= 4 && memcmp(data, BINMAGIC, 4) == 0) {
+		ok = replaybin(rp, data, size);
+	}
+	else {
+		//the csv is parsed in a copy, the runs end up in the arena
+		char * text = (char*)malloc(size + 1);
+		memcpy(text, data, size);
+		text[size] = '\0';
+		ok = replaycsv(rp, text);
+		free(text);
+	}
+	if (!ok) {
+		freeReplay(rp);
+		return NULL;
+	}
+	return rp;
+}
+
+//-1 if the path is not in the recording
+int replayfind(Replay * rp, const wchar_t * path) {
+	ReplayIndex::iterator it = rp->index->find(path);
+	return (it == rp->index->end()) ? -1 : it->second;
+}
+
+//extent source over the runs of a recorded file, a query decodes a batch
+typedef struct _replayextentctx {
+	ReplayFile * file;
+	const unsigned char * p;
+	LONGLONG left;
+	LONGLONG nextvcn;
+	LONGLONG nextlcn;
+	LONGLONG seekvcn;
+	Extent * batch;
+} ReplayExtentCtx;
+
+int replayextentnext(ExtentSource * es, Extent ** batch, LONGLONG * got) {
+	ReplayExtentCtx * ctx = (ReplayExtentCtx*)es->ctx;
+	*batch = ctx->batch;
+	*got = 0;
+	es->ioctls++;
+	while (*got < REPLAYBATCH) {
+		if (ctx->left == 0) {
+			unsigned long long count;
+			if (!varintdecode(&ctx->p, ctx->file->end, &count)) {
+				return 2;
+			}
+			if (count == 0) {
+				//stay on the end marker
+				ctx->p--;
+				return 1;
+			}
+			ctx->left = (LONGLONG)count;
+			ctx->nextvcn = 0;
+			ctx->nextlcn = 0;
+		}
+		Extent e;
+		if (!extentdecode(&ctx->p, ctx->file->end, &ctx->nextvcn, &ctx->nextlcn, &e)) {
+			return 2;
+		}
+		ctx->left--;
+		if (e.vcn + e.clusters <= ctx->seekvcn) {
+			continue;
+		}
+		if (es->vcnend >= 0 && e.vcn >= es->vcnend) {
+			return 1;
+		}
+		ctx->batch[(*got)++] = e;
+	}
+	return 0;
+}
+
+//the runs are in vcn order, so a seek decodes from the start and skips what is before the vcn
+void replayextentseek(ExtentSource * es, LONGLONG vcn) {
+	ReplayExtentCtx * ctx = (ReplayExtentCtx*)es->ctx;
+	ctx->p = ctx->file->runs;
+	ctx->left = 0;
+	ctx->seekvcn = vcn;
+}
+
+void replayextentclose(ExtentSource * es) {
+	ReplayExtentCtx * ctx = (ReplayExtentCtx*)es->ctx;
+	free(ctx->batch);
+	free(ctx);
+}
+
+bool openreplaysource(Replay * rp, const wchar_t * path, ExtentSource * es) {
+	int f = replayfind(rp, path);
+	if (f < 0) {
+		return false;
+	}
+	ReplayExtentCtx * ctx = (ReplayExtentCtx*)malloc(sizeof(ReplayExtentCtx));
+	ctx->file = &rp->files[f];
+	ctx->batch = (Extent*)malloc(sizeof(Extent)*REPLAYBATCH);
+	es->ctx = ctx;
+	es->next = replayextentnext;
+	es->seek = replayextentseek;
+	es->close = replayextentclose;
+	es->vcns = ctx->file->vcns;
+	es->vcnend = -1;
+	es->ioctls = 0;
+	replayextentseek(es, 0);
+	return true;
+}
+
+//what dumpfile and the compare stages use to reach a file, the recording with -r, the filesystem otherwise
+bool sourceexists(Blockstatflags * bsf, wchar_t * path) {
+	return (bsf->replay != NULL) ? replayfind(bsf->replay, path) >= 0 : PathFileExists(path) == TRUE;
+}
+bool sourcevolinfo(Blockstatflags * bsf, wchar_t * path, VINFO * vinfo) {
+	if (bsf->replay != NULL) {
+		*vinfo = bsf->replay->vinfo;
+		return replayfind(bsf->replay, path) >= 0;
+	}
+	return GetVolInfo(path, vinfo);
+}
+bool sourceopen(Blockstatflags * bsf, wchar_t * path, VINFO * vinfo, ExtentSource * es) {
+	if (bsf->replay != NULL) {
+		return openreplaysource(bsf->replay, path, es);
+	}
+	return openextentsource(path, vinfo, es);
+}
+
+/*
+EXTENT CACHE
+
+-c file keeps the extents of every compared file between runs, so a compare of the same repository only queries the files that changed
+A file is found by its identity (see FileId), the size and times have to be the same as well
+	hit		-> the cached runs go straight into the refcount engine, the file is not even opened
+	miss	-> the file is queried as always and its runs are kept for the new cache
+After the compare the cache is written again with only the files of this run (to a temporary file that replaces it), deleted and changed files drop out
+The runs are the ones of the binary dump (see BINARY DUMP), a file that was split over workers has a run per range
+	"BSXC" version
+	per file: dev, id, size, mtime, ctime, fragments and the length of the runs as varints, then the runs (ending with a run of 0 extents)
+A cache that can not be read is ignored (it is only a cache). Not used with -r, a recording has no file identity
+*/
+#define CACHEMAGIC "BSXC"
+#define CACHEVERSION 1
+
+typedef struct _cacheentry {
+	FileId fid;
+	LONGLONG fragments;
+	const unsigned char * runs;
+	const unsigned char * end;
+} CacheEntry;
+
+//dev, id
+typedef std::map<std::pair<ULONGLONG, ULONGLONG>, CacheEntry> CacheIndex;
+
+typedef struct _extentcache {
+	const char * file;
+	unsigned char * data;
+	CacheIndex * index;
+} ExtentCache;
+
+//the whole cache is read in memory, the runs of a hit are used from there until the new cache is written
+ExtentCache * openextentcache(const char * file) {
+	ExtentCache * ec = (ExtentCache*)malloc(sizeof(ExtentCache));
+	ec->file = file;
+	ec->data = NULL;
+	ec->index = new CacheIndex();
+
+	FILE * f = NULL;
+	if (fopen_s(&f, file, "rb") != 0) {
+		return ec;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (size > 5) {
+		ec->data = (unsigned char*)malloc(size);
+		if (fread(ec->data, 1, size, f) != (size_t)size) {
+			size = 0;
+		}
+	}
+	fclose(f);
+	if (ec->data == NULL || size <= 5 || memcmp(ec->data, CACHEMAGIC, 4) != 0 || ec->data[4] != CACHEVERSION) {
+		return ec;
+	}
+
+	const unsigned char * p = ec->data + 5;
+	const unsigned char * end = ec->data + size;
+	while (p < end) {
+		CacheEntry ce;
+		unsigned long long v[7];
+		for (int i = 0; i < 7; i++) {
+			if (!varintdecode(&p, end, &v[i])) {
+				ec->index->clear();
+				return ec;
+			}
+		}
+		ce.fid.dev = v[0];
+		ce.fid.id = v[1];
+		ce.fid.size = v[2];
+		ce.fid.mtime = v[3];
+		ce.fid.ctime = v[4];
+		ce.fragments = (LONGLONG)v[5];
+		LONGLONG vcns;
+		if (v[6] > (unsigned long long)(end - p) || !replayscan(p, p + v[6], &vcns)) {
+			ec->index->clear();
+			return ec;
+		}
+		ce.runs = p;
+		ce.end = p + v[6];
+		(*ec->index)[std::make_pair(ce.fid.dev, ce.fid.id)] = ce;
+		p += v[6];
+	}
+	return ec;
+}
+
+void freeExtentCache(ExtentCache * ec) {
+	delete ec->index;
+	free(ec->data);
+	free(ec);
+}
+
+//NULL if the file is not cached or changed since
+const CacheEntry * cachefind(ExtentCache * ec, FileId * fid) {
+	CacheIndex::iterator it = ec->index->find(std::make_pair(fid->dev, fid->id));
+	if (it == ec->index->end()) {
+		return NULL;
+	}
+	FileId * c = &it->second.fid;
+	if (c->size != fid->size || c->mtime != fid->mtime || c->ctime != fid->ctime) {
+		return NULL;
+	}
+	return &it->second;
+}
+
+/*
+ATOMICS
+
+The compare workers (-j) update the dense and delta engines at the same time, these wrap the compiler intrinsics
+Relaxed ordering is enough, the results are only read after the workers are joined
+*/
+#ifdef _MSC_VER
+//on failure expected gets the value that was found
+template <typename T>
+inline bool atomiccas(T * p, T * expected, T desired) {
+	T old;
+	if (sizeof(T) == 1) { old = (T)_InterlockedCompareExchange8((volatile char*)p, (char)desired, (char)*expected); }
+	else if (sizeof(T) == 2) { old = (T)_InterlockedCompareExchange16((volatile short*)p, (short)desired, (short)*expected); }
+	else { old = (T)_InterlockedCompareExchange((volatile long*)p, (long)desired, (long)*expected); }
+	if (old == *expected) {
+		return true;
+	}
+	*expected = old;
+	return false;
+}
+inline void atomicadd32(int32_t * p, int32_t v) { _InterlockedExchangeAdd((volatile long*)p, (long)v); }
+inline void atomicor64(ULONGLONG * p, ULONGLONG v) { InterlockedOr64((volatile LONGLONG*)p, (LONGLONG)v); }
+template <typename T>
+inline T atomicload(T * p) { return *(volatile T*)p; }
+#else
+template <typename T>
+inline bool atomiccas(T * p, T * expected, T desired) { return __atomic_compare_exchange_n(p, expected, desired, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED); }
+inline void atomicadd32(int32_t * p, int32_t v) { __atomic_fetch_add(p, v, __ATOMIC_RELAXED); }
+inline void atomicor64(ULONGLONG * p, ULONGLONG v) { __atomic_fetch_or(p, v, __ATOMIC_RELAXED); }
+template <typename T>
+inline T atomicload(T * p) { return __atomic_load_n(p, __ATOMIC_RELAXED); }
+#endif
+
+/*
+LAZY MEMORY
+
+Reserves address space for a big map without backing it by ram
+Chunks are only committed when they are written to for the first time (VirtualAlloc MEM_COMMIT on windows, first touch of a MAP_NORESERVE mapping on linux)
+Committed memory is always zero so there is no need to clear the map
+touched keeps one bit per chunk so that whoever reads the map can skip the chunks that were never written
+
+Placement (flags)
+LAZYHUGE		-> back the map with huge pages so walking a map of multiple GB does not miss the TLB all the time
+				   linux: transparent huge pages (madvise), windows: large pages, these can not be committed lazily so the whole map is committed at once
+				   (needs the lock pages in memory right, if that fails the map stays lazy with normal pages)
+LAZYINTERLEAVE	-> spread the pages round robin over the numa nodes, the map is shared by all compare workers so no node should have all of it
+				   linux: mbind MPOL_INTERLEAVE, windows: every chunk is committed on the next node
+Without interleave the pages end up on the node of the worker that touches them first
+*/
+#define LAZYCHUNK (64*1024)
+#define LAZYHUGE 1
+#define LAZYINTERLEAVE 2
+
+typedef struct _lazymem {
+	char * base;
+	LONGLONG size;
+	LONGLONG chunks;
+	ULONGLONG * touched;
+	//the whole map was committed when it was reserved (large pages)
+	bool committed;
+	//numa nodes to interleave the chunks over (windows), 0 is no interleave
+	int nodes;
+} LazyMem;
+
+//amount of numa nodes on this machine
+int numanodes() {
+#ifdef _WIN32
+	ULONG highest = 0;
+	if (!GetNumaHighestNodeNumber(&highest)) {
+		return 1;
+	}
+	return (int)highest + 1;
+#else
+	//online looks like "0" or "0-3"
+	int nodes = 1;
+	FILE * f = fopen("/sys/devices/system/node/online", "r");
+	if (f != NULL) {
+		int first = 0, last = 0;
+		int n = fscanf(f, "%d-%d", &first, &last);
+		if (n == 2 && last >= first) {
+			nodes = last + 1;
+		}
+		fclose(f);
+	}
+	return nodes;
+#endif
+}
+
+#ifdef _WIN32
+//large pages need the lock pages in memory privilege enabled on the token
+bool lazylargepageprivilege() {
+	HANDLE token;
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) {
+		return false;
+	}
+	TOKEN_PRIVILEGES tp;
+	tp.PrivilegeCount = 1;
+	tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	bool ok = LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &tp.Privileges[0].Luid) && AdjustTokenPrivileges(token, FALSE, &tp, 0, NULL, NULL) && GetLastError() == ERROR_SUCCESS;
+	CloseHandle(token);
+	return ok;
+}
+#endif
+
+bool lazyreserve(LazyMem * lm, LONGLONG size, int flags) {
+	lm->size = size;
+	lm->chunks = (size + LAZYCHUNK - 1) / LAZYCHUNK;
+	lm->committed = false;
+	lm->nodes = 0;
+	int nodes = (flags & LAZYINTERLEAVE) ? numanodes() : 1;
+#ifdef _WIN32
+	lm->base = NULL;
+	SIZE_T largepage = GetLargePageMinimum();
+	if ((flags & LAZYHUGE) && largepage > 0 && lazylargepageprivilege()) {
+		SIZE_T rounded = ((size + largepage - 1) / largepage) * largepage;
+		if (nodes > 1) {
+			//large pages are committed at once, so they can not be spread per chunk. Let the first node have them
+			lm->base = (char*)VirtualAllocExNuma(GetCurrentProcess(), NULL, rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE, 0);
+		}
+		else {
+			lm->base = (char*)VirtualAlloc(NULL, rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		}
+		lm->committed = (lm->base != NULL);
+	}
+	if (lm->base == NULL) {
+		lm->base = (char*)VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_READWRITE);
+		if (nodes > 1) { lm->nodes = nodes; }
+	}
+	if (lm->base == NULL) {
+		return false;
+	}
+#else
+	void * m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (m == MAP_FAILED) {
+		return false;
+	}
+	lm->base = (char*)m;
+	//both are only hints, the map works without them
+	if (flags & LAZYHUGE) {
+		madvise(lm->base, size, MADV_HUGEPAGE);
+	}
+	if (nodes > 1) {
+		unsigned long mask[16] = { 0 };
+		for (int n = 0; n < nodes && n < (int)(sizeof(mask) * 8); n++) {
+			mask[n / (sizeof(unsigned long) * 8)] |= (1UL << (n % (sizeof(unsigned long) * 8)));
+		}
+		syscall(SYS_mbind, lm->base, size, MPOL_INTERLEAVE, mask, sizeof(mask) * 8, 0);
+	}
+#endif
+	lm->touched = (ULONGLONG*)calloc((lm->chunks + 63) / 64, sizeof(ULONGLONG));
+	//everything is already there, so everything has to be scanned
+	if (lm->committed) {
+		memset(lm->touched, 0xFF, sizeof(ULONGLONG) * ((lm->chunks + 63) / 64));
+	}
+	return true;
+}
+
+bool lazyistouched(LazyMem * lm, LONGLONG chunk) {
+	return (atomicload(&lm->touched[chunk >> 6]) & (1ULL << (chunk & 63))) != 0;
+}
+
+//make sure the bytes from till to (exclusive) can be written
+//safe to call from several threads, committing a chunk twice does no harm and the bit is only set once the chunk is committed
+bool lazytouch(LazyMem * lm, LONGLONG from, LONGLONG to) {
+	LONGLONG last = (to - 1) / LAZYCHUNK;
+	for (LONGLONG c = from / LAZYCHUNK; c <= last; c++) {
+		if (!lazyistouched(lm, c)) {
+#ifdef _WIN32
+			LONGLONG offset = c * LAZYCHUNK;
+			LONGLONG sz = (lm->size - offset < LAZYCHUNK) ? (lm->size - offset) : LAZYCHUNK;
+			LPVOID committed;
+			if (lm->nodes > 1) {
+				committed = VirtualAllocExNuma(GetCurrentProcess(), lm->base + offset, sz, MEM_COMMIT, PAGE_READWRITE, (DWORD)(c % lm->nodes));
+			}
+			else {
+				committed = VirtualAlloc(lm->base + offset, sz, MEM_COMMIT, PAGE_READWRITE);
+			}
+			if (committed == NULL) {
+				return false;
+			}
+#endif
+			atomicor64(&lm->touched[c >> 6], (1ULL << (c & 63)));
+		}
+	}
+	return true;
+}
+
+//bytes of the map that are backed by memory
+LONGLONG lazycommitted(LazyMem * lm) {
+	if (lm->committed) {
+		return lm->size;
+	}
+	LONGLONG chunks = 0;
+	for (LONGLONG i = 0; i < (lm->chunks + 63) / 64; i++) {
+		ULONGLONG t = atomicload(&lm->touched[i]);
+		chunks += POPCOUNT64(t);
+	}
+	return chunks * LAZYCHUNK;
+}
+
+void lazyrelease(LazyMem * lm) {
+#ifdef _WIN32
+	VirtualFree(lm->base, 0, MEM_RELEASE);
+#else
+	munmap(lm->base, lm->size);
+#endif
+	free(lm->touched);
+}
+
+/*
+REFCOUNT ENGINES
+
+Keep track of how many times every cluster of the volume is referenced by the compared files
+add			-> +1 for the clusters lcn till lcn+clusters, returns false if the extent does not fit in the engine
+histogram	-> fills shared[ratio] with the amount of clusters that are referenced ratio times
+			   clusters that are referenced sharedsz times or more are counted in the overflow map (ratio -> clusters), so there is no max ratio
+			   jobs is the amount of threads that may be used, every thread makes a partial histogram of a contiguous part of the volume (dense and delta)
+committed	-> bytes of memory the engine holds (see TELEMETRY)
+
+dense	-> one counter per cluster on the volume, memory depends on the part of the volume that is used by the files
+sparse	-> ordered map of lcn ranges with the same count, memory depends on the amount of distinct extents
+sweep	-> list of extent start/end events that is sorted and swept once at the end, memory and time depend only on the amount of extents
+delta	-> difference array, +1/-1 per extent instead of +1 per cluster, the counts are rebuilt with a (simd) prefix sum at the end
+
+dense and delta use atomic increments when they are shared by multiple compare workers, sparse and sweep are locked
+*/
+#define REFENGINEDENSE 0
+#define REFENGINESPARSE 1
+#define REFENGINESWEEP 2
+#define REFENGINEDELTA 3
+
+//share ratios that do not fit in the shared array
+typedef std::map<LONGLONG, LONGLONG> ShareMap;
+
+//threadsafe tells if add can be called from several compare workers at the same time, if not the workers take a lock around it
+typedef struct _refengine {
+	void * ctx;
+	bool threadsafe;
+	bool (*add)(struct _refengine * re, LONGLONG lcn, LONGLONG clusters);
+	void (*histogram)(struct _refengine * re, LONGLONG * shared, int sharedsz, ShareMap * overflow, int jobs);
+	LONGLONG (*committed)(struct _refengine * re);
+	void (*destroy)(struct _refengine * re);
+} RefEngine;
+
+//runs fn(arg, p) for p = 0 till parts-1, every part on its own thread (part 0 on the calling thread)
+void parallelfor(int parts, void (*fn)(void * arg, int p), void * arg) {
+	std::thread ** threads = (std::thread**)malloc(sizeof(std::thread*) * parts);
+	for (int p = 1; p < parts; p++) {
+		threads[p] = new std::thread(fn, arg, p);
+	}
+	fn(arg, 0);
+	for (int p = 1; p < parts; p++) {
+		threads[p]->join();
+		delete threads[p];
+	}
+	free(threads);
+}
+
+//one part of a histogram, writes in its own shared and overflow
+typedef void (*HistPart)(RefEngine * re, int p, int parts, LONGLONG * shared, int sharedsz, ShareMap * overflow);
+
+typedef struct _histparallelctx {
+	RefEngine * re;
+	HistPart part;
+	int parts;
+	int sharedsz;
+	LONGLONG * partial;
+	ShareMap * overflows;
+} HistParallelCtx;
+
+void histparallelpart(void * arg, int p) {
+	HistParallelCtx * hpc = (HistParallelCtx*)arg;
+	hpc->part(hpc->re, p, hpc->parts, hpc->partial + (LONGLONG)p * hpc->sharedsz, hpc->sharedsz, &hpc->overflows[p]);
+}
+
+//every part gets its own histogram so the threads never write to the same counters, they are added together at the end
+void histparallel(RefEngine * re, HistPart part, int parts, LONGLONG * shared, int sharedsz, ShareMap * overflow) {
+	if (parts <= 1) {
+		part(re, 0, 1, shared, sharedsz, overflow);
+		return;
+	}
+
+	HistParallelCtx hpc;
+	hpc.re = re;
+	hpc.part = part;
+	hpc.parts = parts;
+	hpc.sharedsz = sharedsz;
+	hpc.partial = (LONGLONG*)calloc((LONGLONG)parts * sharedsz, sizeof(LONGLONG));
+	hpc.overflows = new ShareMap[parts];
+	parallelfor(parts, histparallelpart, &hpc);
+
+	for (int p = 0; p < parts; p++) {
+		for (int i = 0; i < sharedsz; i++) {
+			shared[i] += hpc.partial[(LONGLONG)p * sharedsz + i];
+		}
+		for (ShareMap::iterator it = hpc.overflows[p].begin(); it != hpc.overflows[p].end(); ++it) {
+			(*overflow)[it->first] += it->second;
+		}
+	}
+	free(hpc.partial);
+	delete[] hpc.overflows;
+}
+
+//dense engine
+//the map is lazy memory, only the chunks that hold clusters of the compared files are committed and scanned
+//the width of the counters (8, 16 or 32 bit) is picked at runtime. Narrow counters saturate at their max value,
+//every reference above that is kept in the overflow table so a block shared more then 255 times with 8 bit counters is still counted correctly
+typedef std::unordered_map<LONGLONG, uint32_t> OverflowMap;
+
+/*
+HISTOGRAM KERNELS
+
+Turn a part of the dense refmap into counts per share ratio. This runs over every used cluster on the volume so it needs to be fast
+- blocks of counters that are all zero are skipped with one vector test (avx2 128 bytes, sse4.2 64 bytes, scalar 8 bytes at the time), the runs in between are counted in one go
+- in the sse4.2 and avx2 kernels the low ratios are counted with vector compares (see HISTSMALL)
+- other non zero counters are counted in 4 private sub histograms (picked by cluster number) so the same ratio on consecutive clusters does not wait on the previous increment
+- counters >= subsz (saturated or above the histogram) take the slow path in histrare
+The best kernel for the cpu is picked at runtime (simdlevel)
+*/
+#define SIMDSCALAR 0
+#define SIMDSSE42 1
+#define SIMDAVX2 2
+
+//what is the best kernel this cpu can run
+int simdprobe() {
+	int level = SIMDSCALAR;
+#if defined(BLOCKSTAT_X86) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) { level = SIMDAVX2; }
+	else if (__builtin_cpu_supports("sse4.2")) { level = SIMDSSE42; }
+#elif defined(BLOCKSTAT_X86)
+	int info[4];
+	__cpuid(info, 0);
+	int maxleaf = info[0];
+	__cpuid(info, 1);
+	bool sse42 = (info[2] & (1 << 20)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	if (sse42) { level = SIMDSSE42; }
+	//avx2 also needs the os to save the ymm registers
+	if (maxleaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6) {
+		__cpuidex(info, 7, 0);
+		if (info[1] & (1 << 5)) { level = SIMDAVX2; }
+	}
+#endif
+	return level;
+}
+
+//the histogram threads can ask at the same time, a static initializer is only run once
+int simdlevel() {
+	static int level = simdprobe();
+	return level;
+}
+
+//where the kernels write to
+//overflowmap can be NULL if the counters can not saturate
+typedef struct _histout {
+	LONGLONG * sub[4];
+	ULONGLONG subsz;
+	LONGLONG * shared;
+	int sharedsz;
+	ShareMap * overflow;
+	OverflowMap * overflowmap;
+	ULONGLONG maxcount;
+} HistOut;
+
+void histrare(HistOut * ho, LONGLONG r, ULONGLONG count) {
+	//saturated, the rest of the count is in the overflow table
+	if (count == ho->maxcount && ho->overflowmap != NULL && !ho->overflowmap->empty()) {
+		OverflowMap::iterator it = ho->overflowmap->find(r);
+		if (it != ho->overflowmap->end()) {
+			count += it->second;
+		}
+	}
+	if (count < (ULONGLONG)ho->sharedsz) {
+		ho->shared[count]++;
+	}
+	else {
+		(*ho->overflow)[count]++;
+	}
+}
+
+//one counter, sub is the private histogram for this cluster
+//no branch on the value, zeros and rare counters land in slot 0 which is never added to shared
+template <typename T>
+inline void histone(const T * map, LONGLONG r, LONGLONG * sub, ULONGLONG subsz, HistOut * ho) {
+	ULONGLONG v = map[r];
+	bool rare = (v >= subsz);
+	sub[rare ? 0 : v]++;
+	if (rare) {
+		histrare(ho, r, v);
+	}
+}
+
+//the histogram pointers are copied to locals, stores to the histograms could otherwise alias ho and force a reload every cluster
+template <typename T>
+inline void histtail(const T * map, LONGLONG from, LONGLONG to, HistOut * ho) {
+	LONGLONG * s0 = ho->sub[0];
+	LONGLONG * s1 = ho->sub[1];
+	LONGLONG * s2 = ho->sub[2];
+	LONGLONG * s3 = ho->sub[3];
+	const ULONGLONG subsz = ho->subsz;
+	LONGLONG r = from;
+	for (; r < to && (r & 3) != 0; r++) {
+		histone(map, r, ho->sub[r & 3], subsz, ho);
+	}
+	for (; r + 4 <= to; r += 4) {
+		histone(map, r, s0, subsz, ho);
+		histone(map, r + 1, s1, subsz, ho);
+		histone(map, r + 2, s2, subsz, ho);
+		histone(map, r + 3, s3, subsz, ho);
+	}
+	for (; r < to; r++) {
+		histone(map, r, ho->sub[r & 3], subsz, ho);
+	}
+}
+
+//the kernels only look for blocks that are all zero, everything between two zero blocks goes to histtail in one call
+template <typename T>
+void histscalar(const T * map, LONGLONG from, LONGLONG to, HistOut * ho) {
+	const LONGLONG step = 8 / sizeof(T);
+	LONGLONG r = from;
+	LONGLONG run = from;
+	for (; r + step <= to; r += step) {
+		uint64_t w;
+		memcpy(&w, &map[r], sizeof(w));
+		if (w == 0) {
+			if (run < r) {
+				histtail(map, run, r, ho);
+			}
+			run = r + step;
+		}
+	}
+	histtail(map, run, to, ho);
+}
+
+#ifdef BLOCKSTAT_X86
+//the ratios 1 till HISTSMALL are counted with a compare on the whole vector, most clusters on a volume have a low share ratio
+//vectors with a counter above HISTSMALL go through histtail
+#define HISTSMALL 4
+
+//the compares differ per counter width
+template <typename T> struct SimdOps;
+template <> struct SimdOps<uint8_t> {
+	static TARGET_SSE42 inline __m128i eq(__m128i a, __m128i b) { return _mm_cmpeq_epi8(a, b); }
+	static TARGET_SSE42 inline __m128i min(__m128i a, __m128i b) { return _mm_min_epu8(a, b); }
+	static TARGET_SSE42 inline __m128i set(int v) { return _mm_set1_epi8((char)v); }
+	static TARGET_AVX2 inline __m256i eq(__m256i a, __m256i b) { return _mm256_cmpeq_epi8(a, b); }
+	static TARGET_AVX2 inline __m256i min(__m256i a, __m256i b) { return _mm256_min_epu8(a, b); }
+	static TARGET_AVX2 inline __m256i set256(int v) { return _mm256_set1_epi8((char)v); }
+};
+template <> struct SimdOps<uint16_t> {
+	static TARGET_SSE42 inline __m128i eq(__m128i a, __m128i b) { return _mm_cmpeq_epi16(a, b); }
+	static TARGET_SSE42 inline __m128i min(__m128i a, __m128i b) { return _mm_min_epu16(a, b); }
+	static TARGET_SSE42 inline __m128i set(int v) { return _mm_set1_epi16((short)v); }
+	static TARGET_AVX2 inline __m256i eq(__m256i a, __m256i b) { return _mm256_cmpeq_epi16(a, b); }
+	static TARGET_AVX2 inline __m256i min(__m256i a, __m256i b) { return _mm256_min_epu16(a, b); }
+	static TARGET_AVX2 inline __m256i set256(int v) { return _mm256_set1_epi16((short)v); }
+};
+template <> struct SimdOps<uint32_t> {
+	static TARGET_SSE42 inline __m128i eq(__m128i a, __m128i b) { return _mm_cmpeq_epi32(a, b); }
+	static TARGET_SSE42 inline __m128i min(__m128i a, __m128i b) { return _mm_min_epu32(a, b); }
+	static TARGET_SSE42 inline __m128i set(int v) { return _mm_set1_epi32(v); }
+	static TARGET_AVX2 inline __m256i eq(__m256i a, __m256i b) { return _mm256_cmpeq_epi32(a, b); }
+	static TARGET_AVX2 inline __m256i min(__m256i a, __m256i b) { return _mm256_min_epu32(a, b); }
+	static TARGET_AVX2 inline __m256i set256(int v) { return _mm256_set1_epi32(v); }
+};
+
+//a run without zero blocks, movemask gives one bit per byte so the counts are divided by the counter width at the end
+template <typename T>
+TARGET_SSE42 void histrunsse42(const T * map, LONGLONG from, LONGLONG to, HistOut * ho) {
+	const LONGLONG step = 16 / sizeof(T);
+	LONGLONG small[HISTSMALL + 1] = { 0 };
+	__m128i top = SimdOps<T>::set(HISTSMALL);
+	LONGLONG r = from;
+	for (; r + step <= to; r += step) {
+		__m128i x = _mm_loadu_si128((const __m128i*)&map[r]);
+		if (_mm_movemask_epi8(SimdOps<T>::eq(SimdOps<T>::min(x, top), x)) != 0xFFFF) {
+			histtail(map, r, r + step, ho);
+			continue;
+		}
+		for (int k = 1; k <= HISTSMALL; k++) {
+			small[k] += POPCOUNT32((unsigned int)_mm_movemask_epi8(SimdOps<T>::eq(x, SimdOps<T>::set(k))));
+		}
+	}
+	histtail(map, r, to, ho);
+	for (int k = 1; k <= HISTSMALL; k++) {
+		ho->sub[0][k] += small[k] / sizeof(T);
+	}
+}
+
+template <typename T>
+TARGET_AVX2 void histrunavx2(const T * map, LONGLONG from, LONGLONG to, HistOut * ho) {
+	const LONGLONG step = 32 / sizeof(T);
+	LONGLONG small[HISTSMALL + 1] = { 0 };
+	__m256i top = SimdOps<T>::set256(HISTSMALL);
+	LONGLONG r = from;
+	for (; r + step <= to; r += step) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)&map[r]);
+		if (_mm256_movemask_epi8(SimdOps<T>::eq(SimdOps<T>::min(x, top), x)) != -1) {
+			histtail(map, r, r + step, ho);
+			continue;
+		}
+		for (int k = 1; k <= HISTSMALL; k++) {
+			small[k] += POPCOUNT32((unsigned int)_mm256_movemask_epi8(SimdOps<T>::eq(x, SimdOps<T>::set256(k))));
+		}
+	}
+	histtail(map, r, to, ho);
+	for (int k = 1; k <= HISTSMALL; k++) {
+		ho->sub[0][k] += small[k] / sizeof(T);
+	}
+}
+
+template <typename T>
+TARGET_SSE42 void histsse42(const T * map, LONGLONG from, LONGLONG to, HistOut * ho) {
+	const LONGLONG step = 64 / sizeof(T);
+	LONGLONG r = from;
+	LONGLONG run = from;
+	for (; r + step <= to; r += step) {
+		const __m128i * p = (const __m128i*)&map[r];
+		__m128i any = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)), _mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+		if (_mm_testz_si128(any, any)) {
+			if (run < r) {
+				histrunsse42(map, run, r, ho);
+			}
+			run = r + step;
+		}
+	}
+	histrunsse42(map, run, to, ho);
+}
+
+template <typename T>
+TARGET_AVX2 void histavx2(const T * map, LONGLONG from, LONGLONG to, HistOut * ho) {
+	const LONGLONG step = 128 / sizeof(T);
+	LONGLONG r = from;
+	LONGLONG run = from;
+	for (; r + step <= to; r += step) {
+		const __m256i * p = (const __m256i*)&map[r];
+		__m256i any = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256(p), _mm256_loadu_si256(p + 1)), _mm256_or_si256(_mm256_loadu_si256(p + 2), _mm256_loadu_si256(p + 3)));
+		if (_mm256_testz_si256(any, any)) {
+			if (run < r) {
+				histrunavx2(map, run, r, ho);
+			}
+			run = r + step;
+		}
+	}
+	histrunavx2(map, run, to, ho);
+}
+#endif
+
+template <typename T>
+void histrange(int level, const T * map, LONGLONG from, LONGLONG to, HistOut * ho) {
+#ifdef BLOCKSTAT_X86
+	if (level == SIMDAVX2) { histavx2(map, from, to, ho); return; }
+	if (level == SIMDSSE42) { histsse42(map, from, to, ho); return; }
+#else
+	//only the scalar kernel is there without x86
+	(void)level;
+#endif
+	histscalar(map, from, to, ho);
+}
+
+//sub histograms for counters below subsz
+bool histoutinit(HistOut * ho, LONGLONG * shared, int sharedsz, ShareMap * overflow, OverflowMap * overflowmap, ULONGLONG maxcount) {
+	ho->subsz = ((ULONGLONG)sharedsz < maxcount) ? (ULONGLONG)sharedsz : maxcount;
+	//a cache line between the sub histograms, if they are a multiple of 4KB apart the cpu thinks the stores overlap
+	ULONGLONG stride = ((ho->subsz + 7) & ~(ULONGLONG)7) + 8;
+	ho->sub[0] = (LONGLONG*)calloc(4 * stride, sizeof(LONGLONG));
+	if (ho->sub[0] == NULL) {
+		return false;
+	}
+	for (int i = 1; i < 4; i++) {
+		ho->sub[i] = ho->sub[0] + i * stride;
+	}
+	ho->shared = shared;
+	ho->sharedsz = sharedsz;
+	ho->overflow = overflow;
+	ho->overflowmap = overflowmap;
+	ho->maxcount = maxcount;
+	return true;
+}
+
+//add the sub histograms to shared
+void histoutdone(HistOut * ho) {
+	for (ULONGLONG v = 1; v < ho->subsz; v++) {
+		ho->shared[v] += ho->sub[0][v] + ho->sub[1][v] + ho->sub[2][v] + ho->sub[3][v];
+	}
+	free(ho->sub[0]);
+}
+
+typedef struct _denseengine {
+	void * refmap;
+	LONGLONG clusters;
+	int width;
+	LazyMem mem;
+	OverflowMap * overflow;
+	std::mutex * overflowlock;
+} DenseEngine;
+
+//SHARED is the version for multiple compare workers, the counter is only incremented if it did not change since it was read
+template <typename T, bool SHARED>
+bool denseadd(RefEngine * re, LONGLONG lcn, LONGLONG clusters) {
+	DenseEngine * de = (DenseEngine*)re->ctx;
+	LONGLONG lcnend = lcn + clusters;
+
+	if (lcnend > de->clusters) {
+		return false;
+	}
+	if (clusters <= 0) {
+		return true;
+	}
+	if (!lazytouch(&de->mem, lcn * sizeof(T), lcnend * sizeof(T))) {
+		return false;
+	}
+
+	T * refmap = (T*)de->refmap;
+	const T maxcount = (T)~(T)0;
+	for (LONGLONG cl = lcn; cl < lcnend; cl++) {
+		if (SHARED) {
+			T v = atomicload(&refmap[cl]);
+			while (v != maxcount && !atomiccas(&refmap[cl], &v, (T)(v + 1))) {}
+			if (v == maxcount) {
+				std::lock_guard<std::mutex> guard(*de->overflowlock);
+				(*de->overflow)[cl]++;
+			}
+		}
+		else if (refmap[cl] != maxcount) {
+			refmap[cl]++;
+		}
+		else {
+			(*de->overflow)[cl]++;
+		}
+	}
+	return true;
+}
+
+//part p of parts, a contiguous range of chunks
+template <typename T>
+void densehistpart(RefEngine * re, int p, int parts, LONGLONG * shared, int sharedsz, ShareMap * overflow) {
+	DenseEngine * de = (DenseEngine*)re->ctx;
+	const T * refmap = (const T*)de->refmap;
+	const LONGLONG perchunk = LAZYCHUNK / sizeof(T);
+	const int level = simdlevel();
+
+	HistOut ho;
+	if (!histoutinit(&ho, shared, sharedsz, overflow, de->overflow, (T)~(T)0)) {
+		return;
+	}
+
+	LONGLONG cend = de->mem.chunks * (p + 1) / parts;
+	for (LONGLONG c = de->mem.chunks * p / parts; c < cend; c++) {
+		//never written, all zero
+		if (!lazyistouched(&de->mem, c)) {
+			continue;
+		}
+
+		LONGLONG rend = (c + 1) * perchunk;
+		if (rend > de->clusters) { rend = de->clusters; }
+		histrange(level, refmap, c * perchunk, rend, &ho);
+	}
+	histoutdone(&ho);
+}
+
+template <typename T>
+void densehistogram(RefEngine * re, LONGLONG * shared, int sharedsz, ShareMap * overflow, int jobs) {
+	histparallel(re, densehistpart<T>, jobs, shared, sharedsz, overflow);
+}
+
+LONGLONG densecommitted(RefEngine * re) {
+	DenseEngine * de = (DenseEngine*)re->ctx;
+	return lazycommitted(&de->mem);
+}
+
+void densedestroy(RefEngine * re) {
+	DenseEngine * de = (DenseEngine*)re->ctx;
+	lazyrelease(&de->mem);
+	delete de->overflow;
+	delete de->overflowlock;
+	free(de);
+	free(re);
+}
+
+//width 8, 16 or 32 bit
+//shared if multiple compare workers add at the same time
+//memflags is the placement of the map (see LAZY MEMORY)
+RefEngine * newDenseEngine(VINFO * gvinfo, int width, bool shared, int memflags) {
+	//making a very inefficient int array. The size of the array equals the amount of clusters on the volume itself. 
+	//this make it so that the bigger the volume is, the more memory the program could use
+	//there is thus no link with the filesize itself
+	//everytime a cluster is found, the corresponding int is incremented with 1 does indicating how much the block is used
+	//only the parts of the volume where the files are located are really backed by memory (see LAZY MEMORY)
+	DenseEngine * de = (DenseEngine*)malloc(sizeof(DenseEngine));
+	if (!lazyreserve(&de->mem, (width / 8)*gvinfo->Clusters, memflags)) {
+		free(de);
+		return NULL;
+	}
+	de->refmap = de->mem.base;
+	de->clusters = gvinfo->Clusters;
+	de->width = width;
+	de->overflow = new OverflowMap();
+	de->overflowlock = new std::mutex();
+
+	RefEngine * re = (RefEngine*)malloc(sizeof(RefEngine));
+	re->ctx = de;
+	re->threadsafe = true;
+	if (width == 8) {
+		re->add = shared ? denseadd<uint8_t, true> : denseadd<uint8_t, false>;
+		re->histogram = densehistogram<uint8_t>;
+	}
+	else if (width == 32) {
+		re->add = shared ? denseadd<uint32_t, true> : denseadd<uint32_t, false>;
+		re->histogram = densehistogram<uint32_t>;
+	}
+	else {
+		re->add = shared ? denseadd<uint16_t, true> : denseadd<uint16_t, false>;
+		re->histogram = densehistogram<uint16_t>;
+	}
+	re->committed = densecommitted;
+	re->destroy = densedestroy;
+	return re;
+}
+
+//the narrowest counter that will not saturate unless a file references the same cluster multiple times
+int densewidth(int filesc) {
+	if (filesc < 255) {
+		return 8;
+	}
+	else if (filesc < 65535) {
+		return 16;
+	}
+	return 32;
+}
+
+//sparse engine
+//every key starts a range of clusters that all have the same count, the range runs until the next key
+//the last key always has count 0 (nothing is referenced after the last extent)
+/*
+	add lcn 10, 5 clusters then lcn 12, 5 clusters
+	{10:1, 15:0} -> {10:1, 12:2, 15:1, 17:0}
+*/
+typedef std::map<LONGLONG, uint32_t> SparseMap;
+
+//make sure a range starts at lcn, returns the range
+SparseMap::iterator sparsesplit(SparseMap * sm, LONGLONG lcn) {
+	SparseMap::iterator it = sm->lower_bound(lcn);
+	if (it != sm->end() && it->first == lcn) {
+		return it;
+	}
+	//new range inherits the count of the range it is cut from
+	uint32_t count = 0;
+	if (it != sm->begin()) {
+		SparseMap::iterator prev = it;
+		--prev;
+		count = prev->second;
+	}
+	return sm->insert(it, SparseMap::value_type(lcn, count));
+}
+
+//remove the key if the range before it has the same count
+void sparsemerge(SparseMap * sm, SparseMap::iterator it) {
+	if (it != sm->begin()) {
+		SparseMap::iterator prev = it;
+		--prev;
+		if (prev->second == it->second) {
+			sm->erase(it);
+		}
+	}
+	else if (it->second == 0) {
+		sm->erase(it);
+	}
+}
+
+bool sparseadd(RefEngine * re, LONGLONG lcn, LONGLONG clusters) {
+	SparseMap * sm = (SparseMap*)re->ctx;
+	if (clusters <= 0) {
+		return true;
+	}
+
+	SparseMap::iterator first = sparsesplit(sm, lcn);
+	SparseMap::iterator last = sparsesplit(sm, lcn + clusters);
+
+	for (SparseMap::iterator it = first; it != last; ++it) {
+		it->second++;
+	}
+
+	//only the borders can become equal to their neighbour
+	sparsemerge(sm, last);
+	sparsemerge(sm, first);
+	return true;
+}
+
+//jobs is not used, only the dense and delta histograms split the pass over workers
+void sparsehistogram(RefEngine * re, LONGLONG * shared, int sharedsz, ShareMap * overflow, int /*jobs*/) {
+	SparseMap * sm = (SparseMap*)re->ctx;
+
+	SparseMap::iterator it = sm->begin();
+	while (it != sm->end()) {
+		SparseMap::iterator next = it;
+		++next;
+		if (next == sm->end()) {
+			break;
+		}
+
+		uint32_t count = it->second;
+		if (count != 0) {
+			if (count < (uint32_t)sharedsz) {
+				shared[count] += (next->first - it->first);
+			}
+			else {
+				(*overflow)[count] += (next->first - it->first);
+			}
+		}
+		it = next;
+	}
+}
+
+//every range is a node of the tree, the value with 3 pointers and the color
+LONGLONG sparsecommitted(RefEngine * re) {
+	SparseMap * sm = (SparseMap*)re->ctx;
+	return (LONGLONG)sm->size() * (LONGLONG)(sizeof(SparseMap::value_type) + 4 * sizeof(void*));
+}
+
+void sparsedestroy(RefEngine * re) {
+	delete (SparseMap*)re->ctx;
+	free(re);
+}
+
+RefEngine * newSparseEngine() {
+	RefEngine * re = (RefEngine*)malloc(sizeof(RefEngine));
+	re->ctx = new SparseMap();
+	re->add = sparseadd;
+	re->histogram = sparsehistogram;
+	re->committed = sparsecommitted;
+	re->threadsafe = false;
+	re->destroy = sparsedestroy;
+	return re;
+}
+
+//sweep engine
+//does not keep any state per cluster. Every extent is stored as a start and end event
+//at the end both event lists are radix sorted and swept once. Between two events the count (depth) is constant
+/*
+	extents [10,15) [12,17)
+	starts 10 12 | ends 15 17
+	sweep 10 -> depth 1, 12 -> 2 clusters at 1, depth 2, 15 -> 3 clusters at 2, depth 1, 17 -> 2 clusters at 1
+*/
+typedef struct _sweepengine {
+	ULONGLONG * starts;
+	ULONGLONG * ends;
+	LONGLONG used;
+	LONGLONG provisioned;
+} SweepEngine;
+
+bool sweepadd(RefEngine * re, LONGLONG lcn, LONGLONG clusters) {
+	SweepEngine * se = (SweepEngine*)re->ctx;
+	if (clusters <= 0) {
+		return true;
+	}
+
+	//grow 4x like the other stacks
+	if (se->used == se->provisioned) {
+		LONGLONG newsize = se->provisioned * 4;
+		ULONGLONG * ns = (ULONGLONG*)realloc(se->starts, sizeof(ULONGLONG)*newsize);
+		if (ns == NULL) { return false; }
+		se->starts = ns;
+		ULONGLONG * ne = (ULONGLONG*)realloc(se->ends, sizeof(ULONGLONG)*newsize);
+		if (ne == NULL) { return false; }
+		se->ends = ne;
+		se->provisioned = newsize;
+	}
+	se->starts[se->used] = (ULONGLONG)lcn;
+	se->ends[se->used] = (ULONGLONG)(lcn + clusters);
+	se->used++;
+	return true;
+}
+
+//lsd radix sort on 16 bit digits. All digit counts are made in one pass
+//passes where every key has the same digit (e.g the high bits on a small volume) are skipped
+void radixsort64(ULONGLONG * keys, ULONGLONG * tmp, LONGLONG n) {
+	const int digits = 4;
+	const int buckets = 65536;
+	LONGLONG * counts = (LONGLONG*)calloc(digits*buckets, sizeof(LONGLONG));
+
+	for (LONGLONG i = 0; i < n; i++) {
+		ULONGLONG k = keys[i];
+		for (int d = 0; d < digits; d++) {
+			counts[d*buckets + ((k >> (16 * d)) & 0xFFFF)]++;
+		}
+	}
+
+	ULONGLONG * src = keys;
+	ULONGLONG * dst = tmp;
+	for (int d = 0; d < digits; d++) {
+		LONGLONG * c = &counts[d*buckets];
+		if (c[(src[0] >> (16 * d)) & 0xFFFF] == n) {
+			continue;
+		}
+
+		//counts to offsets
+		LONGLONG offset = 0;
+		for (int b = 0; b < buckets; b++) {
+			LONGLONG cnt = c[b];
+			c[b] = offset;
+			offset += cnt;
+		}
+
+		for (LONGLONG i = 0; i < n; i++) {
+			ULONGLONG k = src[i];
+			dst[c[(k >> (16 * d)) & 0xFFFF]++] = k;
+		}
+		ULONGLONG * swap = src;
+		src = dst;
+		dst = swap;
+	}
+
+	//odd amount of passes, result is in tmp
+	if (src != keys) {
+		memcpy(keys, src, sizeof(ULONGLONG)*n);
+	}
+	free(counts);
+}
+
+//jobs is not used, only the dense and delta histograms split the pass over workers
+void sweephistogram(RefEngine * re, LONGLONG * shared, int sharedsz, ShareMap * overflow, int /*jobs*/) {
+	SweepEngine * se = (SweepEngine*)re->ctx;
+	LONGLONG n = se->used;
+	if (n == 0) {
+		return;
+	}
+
+	ULONGLONG * tmp = (ULONGLONG*)malloc(sizeof(ULONGLONG)*n);
+	radixsort64(se->starts, tmp, n);
+	radixsort64(se->ends, tmp, n);
+	free(tmp);
+
+	ULONGLONG * starts = se->starts;
+	ULONGLONG * ends = se->ends;
+
+	//an end is never processed before its own start, so as long as there are starts left there are ends left
+	LONGLONG i = 0;
+	LONGLONG j = 0;
+	LONGLONG depth = 0;
+	ULONGLONG prev = 0;
+	while (j < n) {
+		bool isstart = (i < n && starts[i] < ends[j]);
+		ULONGLONG pos = isstart ? starts[i] : ends[j];
+
+		if (depth > 0) {
+			if (depth < sharedsz) {
+				shared[depth] += (LONGLONG)(pos - prev);
+			}
+			else {
+				(*overflow)[depth] += (LONGLONG)(pos - prev);
+			}
+		}
+		prev = pos;
+
+		if (isstart) { depth++; i++; }
+		else { depth--; j++; }
+	}
+}
+
+LONGLONG sweepcommitted(RefEngine * re) {
+	SweepEngine * se = (SweepEngine*)re->ctx;
+	return 2 * se->provisioned * (LONGLONG)sizeof(ULONGLONG);
+}
+
+void sweepdestroy(RefEngine * re) {
+	SweepEngine * se = (SweepEngine*)re->ctx;
+	free(se->starts);
+	free(se->ends);
+	free(se);
+	free(re);
+}
+
+RefEngine * newSweepEngine() {
+	SweepEngine * se = (SweepEngine*)malloc(sizeof(SweepEngine));
+	se->provisioned = 4096;
+	se->used = 0;
+	se->starts = (ULONGLONG*)malloc(sizeof(ULONGLONG)*se->provisioned);
+	se->ends = (ULONGLONG*)malloc(sizeof(ULONGLONG)*se->provisioned);
+
+	RefEngine * re = (RefEngine*)malloc(sizeof(RefEngine));
+	re->ctx = se;
+	re->add = sweepadd;
+	re->histogram = sweephistogram;
+	re->committed = sweepcommitted;
+	re->threadsafe = false;
+	re->destroy = sweepdestroy;
+	return re;
+}
+
+//delta engine
+//a difference array: an extent only does +1 at its first cluster and -1 right after its last cluster, whatever the size of the extent
+//the count of a cluster is the sum of all deltas before it (prefix sum), which is calculated in the histogram pass
+/*
+	extents [2,5) [3,4)
+	delta  => [ 0 ][ 0 ][+1 ][+1 ][-1 ][-1 ][ 0 ]
+	count  => [ 0 ][ 0 ][ 1 ][ 2 ][ 1 ][ 0 ][ 0 ]
+*/
+//the map is lazy memory. A chunk that was never written has only zero deltas, so the count stays the same over the whole chunk
+//with multiple histogram threads, partstart is the count at the start of every part (sum of all deltas before it)
+typedef struct _deltaengine {
+	int32_t * delta;
+	LONGLONG clusters;
+	LazyMem mem;
+	int32_t * partstart;
+} DeltaEngine;
+
+template <bool SHARED>
+bool deltaadd(RefEngine * re, LONGLONG lcn, LONGLONG clusters) {
+	DeltaEngine * de = (DeltaEngine*)re->ctx;
+	LONGLONG lcnend = lcn + clusters;
+
+	if (lcnend > de->clusters) {
+		return false;
+	}
+	if (clusters <= 0) {
+		return true;
+	}
+	if (!lazytouch(&de->mem, lcn * sizeof(int32_t), (lcn + 1) * sizeof(int32_t)) || !lazytouch(&de->mem, lcnend * sizeof(int32_t), (lcnend + 1) * sizeof(int32_t))) {
+		return false;
+	}
+
+	if (SHARED) {
+		atomicadd32(&de->delta[lcn], 1);
+		atomicadd32(&de->delta[lcnend], -1);
+	}
+	else {
+		de->delta[lcn]++;
+		de->delta[lcnend]--;
+	}
+	return true;
+}
+
+//n clusters all have the same count
+inline void deltarun(LONGLONG * shared, int sharedsz, ShareMap * overflow, LONGLONG count, LONGLONG n) {
+	if (count > 0) {
+		if (count < sharedsz) {
+			shared[count] += n;
+		}
+		else {
+			(*overflow)[count] += n;
+		}
+	}
+}
+
+//part p of parts, a contiguous range of chunks that starts with the count in partstart
+void deltahistpart(RefEngine * re, int p, int parts, LONGLONG * shared, int sharedsz, ShareMap * overflow) {
+	DeltaEngine * de = (DeltaEngine*)re->ctx;
+	int32_t * delta = de->delta;
+	const LONGLONG perchunk = LAZYCHUNK / sizeof(int32_t);
+	int32_t count = de->partstart[p];
+
+	LONGLONG cend = de->mem.chunks * (p + 1) / parts;
+	for (LONGLONG c = de->mem.chunks * p / parts; c < cend; c++) {
+		LONGLONG r = c * perchunk;
+		LONGLONG rend = r + perchunk;
+		if (rend > de->clusters) { rend = de->clusters; }
+		if (r >= rend) {
+			break;
+		}
+
+		if (!lazyistouched(&de->mem, c)) {
+			deltarun(shared, sharedsz, overflow, count, rend - r);
+			continue;
+		}
+
+#ifdef BLOCKSTAT_SSE2
+		//16 deltas at the time, if they are all zero the count does not change
+		//otherwise do the prefix sum inside the register per 4 deltas (shift and add twice), and add the count we carry from the previous ones
+		const __m128i zero = _mm_setzero_si128();
+		for (; r + 16 <= rend; r += 16) {
+			__m128i x0 = _mm_loadu_si128((const __m128i*)&delta[r]);
+			__m128i x1 = _mm_loadu_si128((const __m128i*)&delta[r + 4]);
+			__m128i x2 = _mm_loadu_si128((const __m128i*)&delta[r + 8]);
+			__m128i x3 = _mm_loadu_si128((const __m128i*)&delta[r + 12]);
+			__m128i any = _mm_or_si128(_mm_or_si128(x0, x1), _mm_or_si128(x2, x3));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi32(any, zero)) == 0xFFFF) {
+				deltarun(shared, sharedsz, overflow, count, 16);
+				continue;
+			}
+
+			__m128i xs[4] = { x0, x1, x2, x3 };
+			for (int v = 0; v < 4; v++) {
+				__m128i x = xs[v];
+				if (_mm_movemask_epi8(_mm_cmpeq_epi32(x, zero)) == 0xFFFF) {
+					deltarun(shared, sharedsz, overflow, count, 4);
+					continue;
+				}
+				x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+				x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+				x = _mm_add_epi32(x, _mm_set1_epi32(count));
+
+				int32_t counts[4];
+				_mm_storeu_si128((__m128i*)counts, x);
+				for (int k = 0; k < 4; k++) {
+					deltarun(shared, sharedsz, overflow, counts[k], 1);
+				}
+				count = counts[3];
+			}
+		}
+#endif
+		for (; r < rend; r++) {
+			count += delta[r];
+			deltarun(shared, sharedsz, overflow, count, 1);
+		}
+	}
+}
+
+typedef struct _deltasumctx {
+	DeltaEngine * de;
+	int parts;
+	LONGLONG * sums;
+} DeltaSumCtx;
+
+//sum of all deltas in a part, untouched chunks add nothing
+void deltasumpart(void * arg, int p) {
+	DeltaSumCtx * dsc = (DeltaSumCtx*)arg;
+	DeltaEngine * de = dsc->de;
+	const LONGLONG perchunk = LAZYCHUNK / sizeof(int32_t);
+	LONGLONG sum = 0;
+
+	LONGLONG cend = de->mem.chunks * (p + 1) / dsc->parts;
+	for (LONGLONG c = de->mem.chunks * p / dsc->parts; c < cend; c++) {
+		if (!lazyistouched(&de->mem, c)) {
+			continue;
+		}
+		LONGLONG rend = (c + 1) * perchunk;
+		if (rend > de->clusters) { rend = de->clusters; }
+		for (LONGLONG r = c * perchunk; r < rend; r++) {
+			sum += de->delta[r];
+		}
+	}
+	dsc->sums[p] = sum;
+}
+
+//the prefix sum is split in two passes: first every part sums its deltas (which gives the start count of the next parts), then every part runs its own prefix sum
+void deltahistogram(RefEngine * re, LONGLONG * shared, int sharedsz, ShareMap * overflow, int jobs) {
+	DeltaEngine * de = (DeltaEngine*)re->ctx;
+	int parts = (jobs > 1) ? jobs : 1;
+	de->partstart = (int32_t*)calloc(parts, sizeof(int32_t));
+
+	if (parts > 1) {
+		DeltaSumCtx dsc;
+		dsc.de = de;
+		dsc.parts = parts;
+		dsc.sums = (LONGLONG*)calloc(parts, sizeof(LONGLONG));
+		parallelfor(parts, deltasumpart, &dsc);
+		for (int p = 1; p < parts; p++) {
+			de->partstart[p] = (int32_t)(de->partstart[p - 1] + dsc.sums[p - 1]);
+		}
+		free(dsc.sums);
+	}
+
+	histparallel(re, deltahistpart, parts, shared, sharedsz, overflow);
+	free(de->partstart);
+	de->partstart = NULL;
+}
+
+LONGLONG deltacommitted(RefEngine * re) {
+	DeltaEngine * de = (DeltaEngine*)re->ctx;
+	return lazycommitted(&de->mem);
+}
+
+void deltadestroy(RefEngine * re) {
+	DeltaEngine * de = (DeltaEngine*)re->ctx;
+	lazyrelease(&de->mem);
+	free(de);
+	free(re);
+}
+
+RefEngine * newDeltaEngine(VINFO * gvinfo, bool shared, int memflags) {
+	//one extra delta for the -1 of an extent that ends at the last cluster
+	DeltaEngine * de = (DeltaEngine*)malloc(sizeof(DeltaEngine));
+	if (!lazyreserve(&de->mem, sizeof(int32_t)*(gvinfo->Clusters + 1), memflags)) {
+		free(de);
+		return NULL;
+	}
+	de->delta = (int32_t*)de->mem.base;
+	de->clusters = gvinfo->Clusters;
+	de->partstart = NULL;
+
+	RefEngine * re = (RefEngine*)malloc(sizeof(RefEngine));
+	re->ctx = de;
+	re->threadsafe = true;
+	re->add = shared ? deltaadd<true> : deltaadd<false>;
+	re->histogram = deltahistogram;
+	re->committed = deltacommitted;
+	re->destroy = deltadestroy;
+	return re;
+}
+
+//returns NULL if the engine could not be allocated
+//width is the counter width for the dense engine, 0 picks it based on the amount of files
+//shared if the engine is used by multiple compare workers
+//memflags is the placement of the dense and delta maps (see LAZY MEMORY)
+RefEngine * newRefEngine(int engine, VINFO * gvinfo, int filesc, int width, bool shared, int memflags) {
+	if (engine == REFENGINESPARSE) {
+		return newSparseEngine();
+	}
+	else if (engine == REFENGINESWEEP) {
+		return newSweepEngine();
+	}
+	else if (engine == REFENGINEDELTA) {
+		return newDeltaEngine(gvinfo, shared, memflags);
+	}
+	return newDenseEngine(gvinfo, (width == 0) ? densewidth(filesc) : width, shared, memflags);
+}
+
+//streaming output of a single file, see 1 FILE DUMP FUNCTIONS
+void singleflush(Blockstatflags* bsf, SingleResult * psr);
+
+//the heart of the app
+
+//relock is taken around the updates of the refcount engine if it is shared by multiple compare workers and not threadsafe itself, NULL otherwise
+bool vcnnums(ExtentSource * es, VINFO* vinfo, RefEngine * re, std::mutex * relock, bool singlefiledump, SingleResult * singleresult,CompareResult * compareresult, Blockstatflags * bsf) {
+	bool success = false;
+
+	//what is the clustersize
+	LONGLONG clustersize = vinfo->ClusterSize;
+
+
+	//VCN -> virtual cluster number 
+	//	This reference the cluster number in the file itself. E.g 0 points to the beginning of the file, the last (VCN+The size of the extent)*clustersize should be the size of the file
+	//LCN -> logical cluster number
+	//	Where is the block located on the volume. It makes the mapping from VCN to volume. While the first VCN for every file is 0, the first LCN will of course not be because that would mean that every file starts at location zero on the filesystem
 
-	
 	//while contstatus is 0, we keep quering (means we have more data)
 	int contstatus = 0;
 
@@ -362,55 +3654,42 @@ bool vcnnums(HANDLE * psrchandle, VINFO* vinfo, ShareMemCounterInt * refmap, LON
 	//how much fragments / vcn / extents did we query so far
 	LONGLONG dumpedextents = 0;
 
-	while (contstatus == 0) {
-		//on the file execute get pointers. Watchout they do not refer to the physical volume but rather to the logical volume
-		BOOL s = DeviceIoControl(fhandle,FSCTL_GET_RETRIEVAL_POINTERS,&StartingPointInputBuffer,sizeof(STARTING_VCN_INPUT_BUFFER),lpRetrievalPointersBuffer,iExtentsBufferSize,&dwBytesReturned,NULL);
-
-		//if sucess = true, there is no error. It means all the pointers retrieval fitted into the buffer
-		//basically it means we are at the end of the file
-		if (s) { contstatus = 1; success = true; }
-		//if we have success = false, that doesn't mean there is a real issue. In most cases, it just means the data did not fit completely in the the buffer. Means we need to requery
-		//if however the error does not equal ERROR_MORE_DATA, something else went wrong, and we stop the process
-		else {
-			DWORD error = GetLastError();
+	//the streamed output is measured apart from the extents (see TELEMETRY)
+	PhaseTimer pt;
+	PhaseStat extentstat;
+	PhaseStat outputstat;
+	phasestatinit(&extentstat);
+	phasestatinit(&outputstat);
 
-			if (error == ERROR_HANDLE_EOF) {
-				if (bsf->verbose) { wprintf(L"VERBOSE: is a small file?\n"); }
-				contstatus = 1;
-				success = true;
-			}
-			else if (error != ERROR_MORE_DATA) {
-				contstatus = 2;
-				//printLastError(L"Something went wrong with device io control");
-				resulterradd(singleresult, compareresult, L"Something went wrong with device io control");
-			}
-			
-		}
-		
-		//derefence for easy access (and shorter name)
-		RETRIEVAL_POINTERS_BUFFER rpb = *lpRetrievalPointersBuffer;
+	while (contstatus == 0) {
+		Extent * extents = NULL;
+		LONGLONG got = 0;
 
-		//what is the startvcn
-		LONGLONG startvcn = rpb.StartingVcn.QuadPart;
+		phasestart(bsf->telemetry, &pt);
+		contstatus = es->next(es, &extents, &got);
 
-		//convert the extent array from a pointer to an array
-		PVCNLCNMAP extents = (PVCNLCNMAP)&rpb.Extents;
+		if (contstatus == 2) {
+			//printLastError(L"Something went wrong with device io control");
+			resulterradd(singleresult, compareresult, L"Something went wrong with device io control / fiemap");
+			phasestop(bsf->telemetry, &pt, &extentstat);
+			break;
+		}
+		else if (contstatus == 1) {
+			success = true;
+			if (dumpedextents == 0 && got == 0 && bsf->verbose) { verboseprint(bsf, L"is a small file?\n"); }
+		}
 
 		//count the amount of extents, then go over every extent
-		//although rpb.ExtentCount will always be 1 with extents set to 1, this code should still support it
-		dumpedextents += rpb.ExtentCount;
-		for (DWORD ec = 0; ec < (rpb.ExtentCount); ec++) {
+		//the lock is taken once for the whole batch
+		dumpedextents += got;
+		if (singlefiledump) { reserveVCNStack(singleresult->vcnstack, got); }
+		if (relock != NULL && !singlefiledump) { relock->lock(); }
+		for (LONGLONG ec = 0; ec < got; ec++) {
 			//checking the x extent
-			VCNLCNMAP extent = extents[ec];
-			//location on disk
-			LARGE_INTEGER lcn = extent.Lcn;
-			//what is the nextvcn
-			LARGE_INTEGER nextvcn = extent.NextVcn;
-
-			//the size of this extent is the (nextvcn it's address - the current vcn/startvcn)
-			//startvcn needs to be updated at the end of the for loop
+			Extent extent = extents[ec];
+
 			//this tells basically how big the current extent is in clusters
-			LONGLONG extclusters = (nextvcn.QuadPart - startvcn);
+			LONGLONG extclusters = extent.clusters;
 
 			//count the total amount of clusters
 			clusterstotal += extclusters ;
@@ -428,18 +3707,13 @@ bool vcnnums(HANDLE * psrchandle, VINFO* vinfo, ShareMemCounterInt * refmap, LON
 
 					A filesystem will always try to make a  bigger extent so that the data can be accessed more sequentially
 				*/
-				LONGLONG lcnend = (lcn.QuadPart + extclusters);
-
-				if (lcnend <= refmapsz) {
-					for (LONGLONG cl = lcn.QuadPart; cl < lcnend; cl++) {
-						refmap[cl]++;
-					}
+				LONGLONG lcnend = (extent.lcn + extclusters);
 
-				}
-				else {
+				//an extent without location (sparse) does not take space on the volume, so it can not be shared
+				if (extent.lcn >= 0 && !re->add(re, extent.lcn, extclusters)) {
 					wprintf(L"REFMAP NOT BIG ENOUGH (SHOULD NOT HAPPEN)\n");
-					wprintf(L"LCN END (end of extent) was %lld vs size of map %lld\n", lcnend, refmapsz);
-					wprintf(L"CLUSTERS %lld CSIZE %ld\n",vinfo->Clusters,vinfo->ClusterSize);
+					wprintf(L"LCN END (end of extent) was %lld vs size of map %lld\n", lcnend, vinfo->Clusters);
+					wprintf(L"CLUSTERS %lld CSIZE %ld\n",vinfo->Clusters,(long)vinfo->ClusterSize);
 				}
 				//increment the fragments result so we can see how fragmented a file is
 				compareresult->fragments++;
@@ -447,26 +3721,33 @@ bool vcnnums(HANDLE * psrchandle, VINFO* vinfo, ShareMemCounterInt * refmap, LON
 			else {
 
 				//if it is a single file, we just make a reference
-				VCNRes * vrs = (VCNRes*)(malloc(sizeof(VCNRes)));
-				vrs->startvcn = startvcn;
-				vrs->lcn = lcn.QuadPart;
-				vrs->sizepart = (extclusters*clustersize);
 				//tot size is not the total size of the file itself. It should tell use how much data is already "processed"
-				vrs->totsize = (clusterstotal*clustersize);
-
-				addVCNStack(singleresult->vcnstack, vrs);
+				addVCNStack(singleresult->vcnstack, extent.vcn, extent.lcn, (extclusters*clustersize), (clusterstotal*clustersize));
 			}
-
-			
-			//the new startvcn (cluster number) is set to nextvcn, so that we can do correct calculation on the size of the of the extent
-			startvcn = nextvcn.QuadPart;
-			
 		}
-		//set the startingvcn to the nextvcn of the last extent so we can query more pointers
-		StartingPointInputBuffer.StartingVcn.QuadPart = startvcn;
+		if (relock != NULL && !singlefiledump) { relock->unlock(); }
+		phasestop(bsf->telemetry, &pt, &extentstat);
+
+		//streaming, print the batch right away so memory does not grow with the amount of extents
+		if (singlefiledump && singleresult->headprinted) {
+			phasestart(bsf->telemetry, &pt);
+			singleflush(bsf, singleresult);
+			phasestop(bsf->telemetry, &pt, &outputstat);
+		}
+	}
+
+	//keep track of the syscalls so we can see if batching works
+	if (singleresult != NULL) { singleresult->ioctls += es->ioctls; }
+	if (compareresult != NULL) { compareresult->ioctls += es->ioctls; }
+	extentstat.files = 1;
+	extentstat.extents = dumpedextents;
+	extentstat.ioctls = es->ioctls;
+	telemetryadd(bsf->telemetry, PHASEEXTENTS, &extentstat);
+	if (outputstat.busy > 0) {
+		telemetryadd(bsf->telemetry, PHASEOUTPUT, &outputstat);
 	}
+	if (bsf->verbose) { verboseprint(bsf, L"%lld extents in %lld ioctl calls\n", dumpedextents, es->ioctls); }
 
-	free(lpRetrievalPointersBuffer);
 	return success;
 }
 
@@ -478,48 +3759,239 @@ Shows where the file is logically located on the file system
 
 //should be fairly easy to understand
 //just prints out the info from the structs in human readable format
-void printsingle(Blockstatflags* bsf, SingleResult * psr) {
-	fwprintf(bsf->printer, L"Single Mode\n");
-	fwprintf(bsf->printer, L"Fsinfo %ls clustersize %lld clusters %lld\n", psr->gvinfo->Volume, psr->gvinfo->ClusterSize, psr->gvinfo->Clusters);
-	fwprintf(bsf->printer, L"File: %ls\n",psr->file);
-	for (int i = 0; i < psr->vcnstack->used; i++) {
-		VCNRes *vrs = psr->vcnstack->vs[i];
-		fwprintf(bsf->printer, L"%20lld LCN %20lld SZ %20lld TSZ %20lld \n", vrs->startvcn,vrs->lcn,vrs->sizepart,vrs->totsize);
+//split in head, extents and tail so the extents can be streamed per batch (-S)
+void printsinglehead(Writer* w, SingleResult * psr) {
+	writestr(w, L"Single Mode\nFsinfo ");
+	writestr(w, psr->gvinfo->Volume);
+	writestr(w, L" clustersize ");
+	writeint(w, (LONGLONG)psr->gvinfo->ClusterSize);
+	writestr(w, L" clusters ");
+	writeint(w, psr->gvinfo->Clusters);
+	writestr(w, L"\nFile: ");
+	writestr(w, psr->file);
+	writechar(w, L'\n');
+}
+void printsingle(Writer* w, SingleResult * psr) {
+	VCNStack * vs = psr->vcnstack;
+	for (long i = 0; i < vs->used; i++) {
+		writeintpad(w, vs->startvcn[i], 20);
+		writestr(w, L" LCN ");
+		writeintpad(w, vs->lcn[i], 20);
+		writestr(w, L" SZ ");
+		writeintpad(w, vs->sizepart[i], 20);
+		writestr(w, L" TSZ ");
+		writeintpad(w, vs->totsize[i], 20);
+		writestr(w, L" \n");
 	}
-	fwprintf(bsf->printer, L"Total Extents : %lld",psr->vcnstack->used);
+}
+void printsingletail(Writer* w, SingleResult * psr) {
+	writestr(w, L"Total Extents : ");
+	writeint(w, psr->vcnstack->flushed + psr->vcnstack->used);
+	writestr(w, L"\nIoctl Calls : ");
+	writeint(w, psr->ioctls);
 }
 //should be fairly easy to understand
 //just prints out the info from the structs in xml
-
-void xmlprintsingle(Blockstatflags* bsf, SingleResult * psr) {
-	fwprintf(bsf->printer, L"<result type='single'>\n");
-
-	fwprintf(bsf->printer, L" <fsinfo volume='%ls' clustersize='%lld' clusters='%lld'/>\n", psr->gvinfo->Volume, psr->gvinfo->ClusterSize, psr->gvinfo->Clusters);
-	fwprintf(bsf->printer, L" <files>\n");
-	fwprintf(bsf->printer, L"\t<file>%ls</file>\n", psr->file);
-	fwprintf(bsf->printer, L" </files>\n");
-
-
-	if (psr->errors->c > 0) {
-		fwprintf(bsf->printer, L" <errors>\n");
-		for (int i = 0; i < psr->errors->c; i++) {
-			fwprintf(bsf->printer, L"\t<error>%ls</error>\n", psr->errors->ss[i]);
+//errors found after the head is streamed are added in a second errors element after the vcns
+void xmlprintsingleerrors(Writer* w, SingleResult * psr) {
+	if (psr->errors->c > psr->errorsprinted) {
+		writestr(w, L" <errors>\n");
+		for (int i = psr->errorsprinted; i < psr->errors->c; i++) {
+			writestr(w, L"\t<error>");
+			writexml(w, strstackget(psr->errors, i));
+			writestr(w, L"</error>\n");
 		}
-		fwprintf(bsf->printer, L" </errors>\n");
+		writestr(w, L" </errors>\n");
+		psr->errorsprinted = psr->errors->c;
 	}
-
-	fwprintf(bsf->printer, L" <vcns>\n");
-	for (int i = 0; i < psr->vcnstack->used; i++) {
-		VCNRes *vrs = psr->vcnstack->vs[i];
-		fwprintf(bsf->printer, L"\t<vcn start='%lld' lcn='%lld' sz='%lld' totalsz='%lld' />\n", vrs->startvcn, vrs->lcn, vrs->sizepart, vrs->totsize);
+}
+void xmlprintsinglehead(Writer* w, SingleResult * psr) {
+	writestr(w, L"<result type='single'>\n");
+
+	writestr(w, L" <fsinfo volume='");
+	writexml(w, psr->gvinfo->Volume);
+	writestr(w, L"' clustersize='");
+	writeint(w, (LONGLONG)psr->gvinfo->ClusterSize);
+	writestr(w, L"' clusters='");
+	writeint(w, psr->gvinfo->Clusters);
+	writestr(w, L"'/>\n <files>\n\t<file>");
+	writexml(w, psr->file);
+	writestr(w, L"</file>\n </files>\n");
+
+	xmlprintsingleerrors(w, psr);
+
+	writestr(w, L" <vcns>\n");
+}
+void xmlprintsingle(Writer* w, SingleResult * psr) {
+	VCNStack * vs = psr->vcnstack;
+	for (long i = 0; i < vs->used; i++) {
+		writestr(w, L"\t<vcn start='");
+		writeint(w, vs->startvcn[i]);
+		writestr(w, L"' lcn='");
+		writeint(w, vs->lcn[i]);
+		writestr(w, L"' sz='");
+		writeint(w, vs->sizepart[i]);
+		writestr(w, L"' totalsz='");
+		writeint(w, vs->totsize[i]);
+		writestr(w, L"' />\n");
+	}
+}
+void xmlprintsingletail(Writer* w, SingleResult * psr) {
+	writestr(w, L" </vcns>\n");
+	xmlprintsingleerrors(w, psr);
+	writestr(w, L" <totalextents>");
+	writeint(w, psr->vcnstack->flushed + psr->vcnstack->used);
+	writestr(w, L"</totalextents>\n <ioctls count='");
+	writeint(w, psr->ioctls);
+	writestr(w, L"'/>\n</result>\n");
+}
+//one compact json object, the errors are at the end so streaming does not need a second list
+void jsonprintsinglehead(Writer* w, SingleResult * psr) {
+	writestr(w, L"{\"type\":\"single\",\"fsinfo\":{\"volume\":");
+	writejson(w, psr->gvinfo->Volume);
+	writestr(w, L",\"clustersize\":");
+	writeint(w, (LONGLONG)psr->gvinfo->ClusterSize);
+	writestr(w, L",\"clusters\":");
+	writeint(w, psr->gvinfo->Clusters);
+	writestr(w, L"},\"file\":");
+	writejson(w, psr->file);
+	writestr(w, L",\"vcns\":[");
+}
+void jsonprintsingle(Writer* w, SingleResult * psr) {
+	VCNStack * vs = psr->vcnstack;
+	for (long i = 0; i < vs->used; i++) {
+		writestr(w, (vs->flushed + i > 0) ? L",{\"start\":" : L"{\"start\":");
+		writeint(w, vs->startvcn[i]);
+		writestr(w, L",\"lcn\":");
+		writeint(w, vs->lcn[i]);
+		writestr(w, L",\"sz\":");
+		writeint(w, vs->sizepart[i]);
+		writestr(w, L",\"totalsz\":");
+		writeint(w, vs->totsize[i]);
+		writechar(w, L'}');
+	}
+}
+void jsonprintsingletail(Writer* w, SingleResult * psr) {
+	writestr(w, L"],");
+	writejsonstrings(w, L"errors", psr->errors);
+	writestr(w, L",\"totalextents\":");
+	writeint(w, psr->vcnstack->flushed + psr->vcnstack->used);
+	writestr(w, L",\"ioctls\":");
+	writeint(w, psr->ioctls);
+	writestr(w, L"}\n");
+}
+//csv, see OUTPUT for the records
+void csvprintsinglehead(Writer* w, SingleResult * psr) {
+	writestr(w, L"kind,text,v1,v2,v3,v4\nfsinfo,");
+	writecsv(w, psr->gvinfo->Volume);
+	writechar(w, L',');
+	writeint(w, (LONGLONG)psr->gvinfo->ClusterSize);
+	writechar(w, L',');
+	writeint(w, psr->gvinfo->Clusters);
+	writestr(w, L",,\nfile,");
+	writecsv(w, psr->file);
+	writestr(w, L",,,,\n");
+}
+void csvprintsingle(Writer* w, SingleResult * psr) {
+	VCNStack * vs = psr->vcnstack;
+	for (long i = 0; i < vs->used; i++) {
+		writestr(w, L"vcn,,");
+		writeint(w, vs->startvcn[i]);
+		writechar(w, L',');
+		writeint(w, vs->lcn[i]);
+		writechar(w, L',');
+		writeint(w, vs->sizepart[i]);
+		writechar(w, L',');
+		writeint(w, vs->totsize[i]);
+		writechar(w, L'\n');
+	}
+}
+void csvprintsingletail(Writer* w, SingleResult * psr) {
+	for (int i = 0; i < psr->errors->c; i++) {
+		writestr(w, L"error,");
+		writecsv(w, strstackget(psr->errors, i));
+		writestr(w, L",,,,\n");
 	}
-	fwprintf(bsf->printer, L" </vcns>\n");
-	fwprintf(bsf->printer, L" <totalextents>%lld</totalextents>\n", psr->vcnstack->used);
+	writestr(w, L"total,,");
+	writeint(w, psr->vcnstack->flushed + psr->vcnstack->used);
+	writechar(w, L',');
+	writeint(w, psr->ioctls);
+	writestr(w, L",,\n");
+}
+//binary dump, see BINARY DUMP
+//every batch is a run of its own so streaming needs no count upfront
+void binprintsinglehead(Writer* w, SingleResult * psr) {
+	writebinheader(w, psr->gvinfo);
+	psr->binrecord = writeroffset(w);
+	writebinstr(w, psr->file);
+}
+void binprintsingle(Writer* w, SingleResult * psr) {
+	VCNStack * vs = psr->vcnstack;
+	if (vs->used == 0) { return; }
+	LONGLONG clustersize = psr->gvinfo->ClusterSize;
+	ExtentLog log;
+	extentloginit(&log);
+	for (long i = 0; i < vs->used; i++) {
+		extentlogadd(&log, vs->startvcn[i], vs->lcn[i], vs->sizepart[i] / clustersize);
+	}
+	writebinrun(w, log.count, log.buf, log.used);
+	extentlogfree(&log);
+}
+void binprintsingletail(Writer* w, SingleResult * psr) {
+	LONGLONG extents = psr->vcnstack->flushed + psr->vcnstack->used;
+	writevarint(w, 0);
+
+	LONGLONG summary = writeroffset(w);
+	writevarint(w, 0);
+	writevarint(w, extents);
+	writevarint(w, psr->ioctls);
+	writevarint(w, 0);
+	writebinerrors(w, psr->errors);
+
+	LONGLONG index = writeroffset(w);
+	writefixed(w, psr->binrecord);
+	writefixed(w, extents);
+	writefixed(w, (psr->errors->c > 0) ? 1 : 0);
+	writebintrailer(w, index, summary, 1);
+}
 
-	fwprintf(bsf->printer, L"</result>\n");
+//pick the printer for the format (-f or -x)
+void singlehead(Blockstatflags* bsf, SingleResult * psr) {
+	switch (bsf->format) {
+	case OUTXML: xmlprintsinglehead(bsf->out, psr); break;
+	case OUTJSON: jsonprintsinglehead(bsf->out, psr); break;
+	case OUTCSV: csvprintsinglehead(bsf->out, psr); break;
+	case OUTBIN: binprintsinglehead(bsf->out, psr); break;
+	default: printsinglehead(bsf->out, psr); break;
+	}
+	psr->headprinted = true;
+}
+//prints the extents collected so far and drops them
+void singleflush(Blockstatflags* bsf, SingleResult * psr) {
+	switch (bsf->format) {
+	case OUTXML: xmlprintsingle(bsf->out, psr); break;
+	case OUTJSON: jsonprintsingle(bsf->out, psr); break;
+	case OUTCSV: csvprintsingle(bsf->out, psr); break;
+	case OUTBIN: binprintsingle(bsf->out, psr); break;
+	default: printsingle(bsf->out, psr); break;
+	}
+	flushVCNStack(psr->vcnstack);
+	writerflush(bsf->out);
+	fflush(bsf->printer);
+}
+void singletail(Blockstatflags* bsf, SingleResult * psr) {
+	switch (bsf->format) {
+	case OUTXML: xmlprintsingletail(bsf->out, psr); break;
+	case OUTJSON: jsonprintsingletail(bsf->out, psr); break;
+	case OUTCSV: csvprintsingletail(bsf->out, psr); break;
+	case OUTBIN: binprintsingletail(bsf->out, psr); break;
+	default: printsingletail(bsf->out, psr); break;
+	}
+	writerflush(bsf->out);
 }
 
-//function for one file processing, will call xmlprintsingle or printsingle depending on the user request (-x vs nothing specified)
+//function for one file processing, will call the single printers for the format the user requested (-f or -x, text otherwise)
+//with -S the head is printed as soon as the file is opened and the extents are printed per retrieval batch
 int dumpfile(Blockstatflags* bsf,wchar_t* src) {
 	int retvalue = 0;
 
@@ -531,6 +4003,10 @@ int dumpfile(Blockstatflags* bsf,wchar_t* src) {
 	sr.vcnstack = newVCNStack();
 	sr.errors = newStringStack();
 	sr.file = src;
+	sr.ioctls = 0;
+	sr.headprinted = false;
+	sr.errorsprinted = 0;
+	sr.binrecord = 0;
 
 
 	//get the volume info struct in place (used to query volume size, cluster size, etc.)
@@ -538,28 +4014,34 @@ int dumpfile(Blockstatflags* bsf,wchar_t* src) {
 	(vinfo->Volume)[0] = 0;
 	sr.gvinfo = vinfo;
 
+	PhaseTimer pt;
+	phasestart(bsf->telemetry, &pt);
+
 	//if the file exists, we can do something
 	//should already be checked by main
-	if (PathFileExists(src)) {
+	if (sourceexists(bsf, src)) {
 
 
 		//get the volume info by referencing the file
-		if (GetVolInfo(src, vinfo)) {
+		if (sourcevolinfo(bsf, src, vinfo)) {
+			phasedone(bsf->telemetry, PHASEVOLUME, &pt, 1, 0, 0);
 			
 			//if we can get the vol info, we try to open the file in read/shared modus
-			HANDLE srchandle = CreateFile(src, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-			if (srchandle != INVALID_HANDLE_VALUE) {
+			ExtentSource es;
+			if (sourceopen(bsf, src, vinfo, &es)) {
+
+				if (bsf->stream) { singlehead(bsf, &sr); }
 
 				//if we can open the file, we can query the the cluster information
 				//vcnnums will update the singleresult so it can be used by the printing functions
-				if (!vcnnums(&srchandle, vinfo, NULL, 0, true,&sr,NULL,bsf)) {
+				if (!vcnnums(&es, vinfo, NULL, NULL, true,&sr,NULL,bsf)) {
 					retvalue = 4;
 					
 					addStringStackError(sr.errors, L"No success vcnnums");
 				}
 
 
-				CloseHandle(srchandle);
+				es.close(&es);
 			}
 			else {
 				retvalue = 3;
@@ -574,440 +4056,2393 @@ int dumpfile(Blockstatflags* bsf,wchar_t* src) {
 			addStringStackError(sr.errors, L"Error getting vol info for file");
 
 		}
-		
+		
+
+	} else {
+		addStrStack(sr.errors, L"File does not exists");
+	}
+	//the single functions pick the printer for the format
+	phasestart(bsf->telemetry, &pt);
+	if (!sr.headprinted) {
+		singlehead(bsf, &sr);
+	}
+	singleflush(bsf, &sr);
+	singletail(bsf, &sr);
+	phasedone(bsf->telemetry, PHASEOUTPUT, &pt, 1, 0, 0);
+
+	//cleanup some stuff
+	free(vinfo);
+
+	freeVCNStack(sr.vcnstack);
+
+	freeStringStack(sr.errors);
+	
+	return retvalue;
+}
+
+
+
+
+/*
+SHARING MATRIX
+
+-g, which files, directories or user defined groups share clusters with each other
+file	-> every compared file is a group (N x N)
+dir	-> the files are grouped by the directory they are in (one folder per backup job)
+other	-> a file with one path prefix per line (a job folder, a repository, ...), a file belongs to the longest prefix that matches, files that match none are left out
+
+Computed in one pass over the extents instead of a compare per pair
+- every extent is a start and an end event with the group of its file, the events are sorted on lcn
+- the sweep keeps the set of groups that refer the clusters between two events, the set is identified by a key
+  that is updated on every event: a bitset of the groups when there are up to 64 of them, a 64 bit hash of the set (sum of a random value per group) otherwise
+  two sets can have the same hash, so a hit is checked against the members and a collision moves on to the next key
+- the clusters are added up per distinct set, only at the end every set is spread over its groups and pairs
+  so a range of clusters shared by k groups does not cost k^2 on every event, there are few distinct sets compared to the amount of extents
+
+	group a [0,10) group b [5,15)
+	0 -> {a}, 5 -> 5 clusters {a}, {a,b}, 10 -> 5 clusters {a,b}, {b}, 15 -> 5 clusters {b}
+	a 10 clusters, b 10 clusters, a x b 5 clusters
+
+-u, the space that is freed when a file is deleted, the same sweep with a group per file
+- a range of clusters is exclusive to a file if no other file refers to it (the file itself can refer to it more then once)
+- only the size of the set is needed, so there are no sets and pairs (pairs = false), the cost does not depend on how many files share a range
+  one counter per file instead of a refmap per file, so it scales to thousands of files
+	a exclusive 5 clusters, b exclusive 5 clusters
+The groups of -g get the same exclusive bytes (the space that is freed when the whole job is deleted)
+*/
+#define MATRIXNONE 0
+#define MATRIXFILE 1
+#define MATRIXDIR 2
+#define MATRIXGROUPS 3
+#define MATRIXBITSET 64
+
+//bytes is everything the group refers to (shared clusters counted once), shared is the part that is also referred to by another group
+//exclusive is the part that is only referred to by this group, size the logical size of the files (only filled in for -u)
+typedef struct _matrixgroup {
+	const wchar_t * name;
+	LONGLONG bytes;
+	LONGLONG shared;
+	LONGLONG exclusive;
+	LONGLONG size;
+} MatrixGroup;
+
+//bytes shared by group a and group b (a < b), only the pairs that share something are in it
+typedef std::map<std::pair<int, int>, LONGLONG> MatrixPairs;
+
+typedef struct _matrixevent {
+	ULONGLONG lcn;
+	int group;
+	int delta;
+} MatrixEvent;
+
+//clusters referred to by exactly the groups in members
+typedef struct _matrixset {
+	LONGLONG clusters;
+	int * members;
+	int membersc;
+} MatrixSet;
+typedef std::unordered_map<ULONGLONG, MatrixSet> MatrixSets;
+
+typedef struct _sharingmatrix {
+	MatrixGroup * groups;
+	int groupsc;
+	MatrixPairs * pairs;
+	Arena arena;
+	//collected by matrixadd, gone after matrixsweep
+	MatrixEvent * events;
+	LONGLONG eventsc;
+	LONGLONG eventsl;
+} SharingMatrix;
+
+SharingMatrix * newSharingMatrix() {
+	SharingMatrix * sm = (SharingMatrix*)malloc(sizeof(SharingMatrix));
+	sm->groups = NULL;
+	sm->groupsc = 0;
+	sm->pairs = new MatrixPairs();
+	arenainit(&sm->arena);
+	sm->eventsl = 4096;
+	sm->eventsc = 0;
+	sm->events = (MatrixEvent*)malloc(sizeof(MatrixEvent) * sm->eventsl);
+	return sm;
+}
+
+void freeSharingMatrix(SharingMatrix * sm) {
+	free(sm->groups);
+	delete sm->pairs;
+	arenafree(&sm->arena);
+	free(sm->events);
+	free(sm);
+}
+
+//a new group, the name is copied
+int matrixgroup(SharingMatrix * sm, const wchar_t * name) {
+	if ((sm->groupsc & (sm->groupsc - 1)) == 0) {
+		sm->groups = (MatrixGroup*)realloc(sm->groups, sizeof(MatrixGroup) * (sm->groupsc > 0 ? sm->groupsc * 2 : 1));
+	}
+	MatrixGroup * g = &sm->groups[sm->groupsc];
+	g->name = arenawcsdup(&sm->arena, name, wcslen(name));
+	g->bytes = 0;
+	g->shared = 0;
+	g->exclusive = 0;
+	g->size = 0;
+	return sm->groupsc++;
+}
+
+//the clusters [lcn, lcn + clusters) are referred to by group
+bool matrixadd(SharingMatrix * sm, int group, LONGLONG lcn, LONGLONG clusters) {
+	if (clusters <= 0 || lcn < 0) {
+		return true;
+	}
+	//grow 4x like the other stacks
+	if (sm->eventsc + 2 > sm->eventsl) {
+		MatrixEvent * ne = (MatrixEvent*)realloc(sm->events, sizeof(MatrixEvent) * sm->eventsl * 4);
+		if (ne == NULL) { return false; }
+		sm->events = ne;
+		sm->eventsl *= 4;
+	}
+	MatrixEvent * e = &sm->events[sm->eventsc];
+	e[0].lcn = (ULONGLONG)lcn;
+	e[0].group = group;
+	e[0].delta = 1;
+	e[1].lcn = (ULONGLONG)(lcn + clusters);
+	e[1].group = group;
+	e[1].delta = -1;
+	sm->eventsc += 2;
+	return true;
+}
+
+bool matrixeventless(const MatrixEvent & a, const MatrixEvent & b) {
+	return a.lcn < b.lcn;
+}
+
+//splitmix64, the random value of a group for the set hash
+inline ULONGLONG matrixhash(ULONGLONG g) {
+	ULONGLONG z = (g + 1) * 0x9E3779B97F4A7C15ULL;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+//true if the members of s are the active groups (counts above 0), the members are distinct so the same amount is enough
+bool matrixsame(MatrixSet * s, int * counts, int activec) {
+	if (s->membersc != activec) {
+		return false;
+	}
+	for (int m = 0; m < s->membersc; m++) {
+		if (counts[s->members[m]] <= 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+//the sweep (see SHARING MATRIX), fills exclusive of the groups and if pairs is set also bytes, shared and the pairs
+void matrixsweep(SharingMatrix * sm, LONGLONG clustersize, bool pairs) {
+	int gc = sm->groupsc;
+	bool bitset = (gc <= MATRIXBITSET);
+	ULONGLONG * keys = (ULONGLONG*)malloc(sizeof(ULONGLONG) * (gc + 1));
+	int * counts = (int*)calloc(gc + 1, sizeof(int));
+	//the groups in the current set, where is the position of a group in it
+	int * active = (int*)malloc(sizeof(int) * (gc + 1));
+	int * where = (int*)malloc(sizeof(int) * (gc + 1));
+	int activec = 0;
+	for (int g = 0; g < gc; g++) {
+		keys[g] = bitset ? (1ULL << g) : matrixhash(g);
+	}
+
+	std::sort(sm->events, sm->events + sm->eventsc, matrixeventless);
+
+	MatrixSets sets;
+	ULONGLONG key = 0;
+	ULONGLONG prev = 0;
+	for (LONGLONG i = 0; i < sm->eventsc; i++) {
+		MatrixEvent * e = &sm->events[i];
+		if (activec == 1) {
+			sm->groups[active[0]].exclusive += (LONGLONG)(e->lcn - prev);
+		}
+		if (pairs && activec > 0 && e->lcn > prev) {
+			//sets are never removed, so probing from the hash always finds the set before a free key
+			ULONGLONG probe = key;
+			MatrixSets::iterator it = sets.find(probe);
+			while (!bitset && it != sets.end() && !matrixsame(&it->second, counts, activec)) {
+				it = sets.find(++probe);
+			}
+			if (it == sets.end()) {
+				MatrixSet s;
+				s.clusters = 0;
+				s.membersc = activec;
+				s.members = (int*)arenaalloc(&sm->arena, sizeof(int) * activec);
+				memcpy(s.members, active, sizeof(int) * activec);
+				it = sets.insert(MatrixSets::value_type(probe, s)).first;
+			}
+			it->second.clusters += (LONGLONG)(e->lcn - prev);
+		}
+		prev = e->lcn;
+
+		int g = e->group;
+		counts[g] += e->delta;
+		if (e->delta > 0 && counts[g] == 1) {
+			key += keys[g];
+			where[g] = activec;
+			active[activec++] = g;
+		}
+		else if (e->delta < 0 && counts[g] == 0) {
+			key -= keys[g];
+			int last = active[--activec];
+			active[where[g]] = last;
+			where[last] = where[g];
+		}
+	}
+
+	//spread every set over its groups and pairs
+	for (MatrixSets::iterator it = sets.begin(); it != sets.end(); ++it) {
+		MatrixSet * s = &it->second;
+		LONGLONG bytes = s->clusters * clustersize;
+		for (int a = 0; a < s->membersc; a++) {
+			MatrixGroup * g = &sm->groups[s->members[a]];
+			g->bytes += bytes;
+			if (s->membersc > 1) {
+				g->shared += bytes;
+			}
+			for (int b = a + 1; b < s->membersc; b++) {
+				int x = s->members[a];
+				int y = s->members[b];
+				(*sm->pairs)[(x < y) ? std::make_pair(x, y) : std::make_pair(y, x)] += bytes;
+			}
+		}
+	}
+	for (int g = 0; g < gc; g++) {
+		sm->groups[g].exclusive *= clustersize;
+	}
+
+	free(sm->events);
+	sm->events = NULL;
+	sm->eventsc = 0;
+	sm->eventsl = 0;
+	free(keys);
+	free(counts);
+	free(active);
+	free(where);
+}
+
+//the groups of -g, one per file (-1 if the file is in no group)
+int * matrixgroups(SharingMatrix * sm, PathList * files, int mode, StringStack * prefixes) {
+	int * filegroup = (int*)malloc(sizeof(int) * (files->c + 1));
+	wchar_t * path = (wchar_t*)malloc(sizeof(wchar_t)*SUPERMAXPATH);
+	if (mode == MATRIXGROUPS) {
+		for (int p = 0; p < prefixes->c; p++) {
+			matrixgroup(sm, strstackget(prefixes, p));
+		}
+	}
+	//the directories are interned in the path list, the pointer is enough
+	std::unordered_map<const wchar_t*, int> dirs;
+	for (int f = 0; f < files->c; f++) {
+		PathRef ref = pathlistget(files, f);
+		if (mode == MATRIXFILE) {
+			filegroup[f] = matrixgroup(sm, pathformat(ref, path));
+		}
+		else if (mode == MATRIXDIR) {
+			std::unordered_map<const wchar_t*, int>::iterator it = dirs.find(ref.dir);
+			if (it == dirs.end()) {
+				it = dirs.insert(std::make_pair(ref.dir, matrixgroup(sm, ref.dir))).first;
+			}
+			filegroup[f] = it->second;
+		}
+		else {
+			pathformat(ref, path);
+			filegroup[f] = -1;
+			size_t best = 0;
+			for (int p = 0; p < prefixes->c; p++) {
+				wchar_t * prefix = strstackget(prefixes, p);
+				size_t len = wcslen(prefix);
+				if (len > best && wcsncmp(path, prefix, len) == 0) {
+					best = len;
+					filegroup[f] = p;
+				}
+			}
+		}
+	}
+	free(path);
+	return filegroup;
+}
+
+//-g file with one prefix per line (same encoding as -i), false if it can not be read
+bool matrixprefixes(const char * file, StringStack * prefixes) {
+	FILE * input;
+	wchar_t buf[SUPERMAXPATH];
+	if (fopen_s(&input, file, "r, ccs=UTF-16LE") != 0) {
+		return false;
+	}
+	while (fgetws(buf, SUPERMAXPATH, input) != NULL) {
+		size_t len = wcscspn(buf, L"\r\n");
+		buf[len] = 0;
+		if (len > 0) {
+			addStrStack(prefixes, buf);
+		}
+	}
+	fclose(input);
+	return true;
+}
+
+/*
+
+COMPARING FUNCTIONS
+
+*/
+//should be fairly easy to understand
+//just prints out the info from the structs in human readable format
+void printcompare(Writer* w,CompareResult * compareresult) {
+	writestr(w, L"Comparing Mode\nFsinfo ");
+	writestr(w, compareresult->gvinfo->Volume);
+	writestr(w, L" clustersize ");
+	writeint(w, (LONGLONG)compareresult->gvinfo->ClusterSize);
+	writestr(w, L" clusters ");
+	writeint(w, compareresult->gvinfo->Clusters);
+	writestr(w, L"\nFiles:\n");
+	for (int i = 0; i < compareresult->files->c; i++) {
+		PathRef ref = pathlistget(compareresult->files, i);
+		writestr(w, L"\t- ");
+		writestr(w, ref.dir);
+		writestr(w, ref.leaf);
+		writechar(w, L'\n');
+	}
+	writechar(w, L'\n');
+	
+
+	if (compareresult->errors->c > 0) {
+		writestr(w, L"Errors:\n");
+		for (int i = 0; i < compareresult->errors->c; i++) {
+			writestr(w, L"\t-");
+			writestr(w, strstackget(compareresult->errors, i));
+			writechar(w, L'\n');
+		}
+		writechar(w, L'\n');
+	}
+
+	writestr(w, L"Sharing:\n");
+	for (int i = 0; i < compareresult->sharelinesc; i++) {
+		writestr(w, L"\t- ");
+		writeint(w, compareresult->sharelines[i].shareratio);
+		writestr(w, L" x \t ");
+		writeint(w, compareresult->sharelines[i].savingsbytes);
+		writestr(w, L" bytes ");
+		writeint(w, compareresult->sharelines[i].savingsmb);
+		writestr(w, L" mb\n");
+	}
+
+	SharingMatrix * sm = compareresult->matrix;
+	if (sm != NULL) {
+		writestr(w, L"\nGroups:\n");
+		for (int g = 0; g < sm->groupsc; g++) {
+			writestr(w, L"\t- ");
+			writeint(w, g);
+			writechar(w, L' ');
+			writestr(w, sm->groups[g].name);
+			writestr(w, L" \t ");
+			writeint(w, sm->groups[g].bytes);
+			writestr(w, L" bytes ");
+			writeint(w, sm->groups[g].bytes / 1024 / 1024);
+			writestr(w, L" mb, shared ");
+			writeint(w, sm->groups[g].shared);
+			writestr(w, L" bytes ");
+			writeint(w, sm->groups[g].shared / 1024 / 1024);
+			writestr(w, L" mb, exclusive ");
+			writeint(w, sm->groups[g].exclusive);
+			writestr(w, L" bytes ");
+			writeint(w, sm->groups[g].exclusive / 1024 / 1024);
+			writestr(w, L" mb\n");
+		}
+		writestr(w, L"Sharing Matrix:\n");
+		for (MatrixPairs::iterator it = sm->pairs->begin(); it != sm->pairs->end(); ++it) {
+			writestr(w, L"\t- ");
+			writeint(w, it->first.first);
+			writestr(w, L" x ");
+			writeint(w, it->first.second);
+			writestr(w, L" \t ");
+			writeint(w, it->second);
+			writestr(w, L" bytes ");
+			writeint(w, it->second / 1024 / 1024);
+			writestr(w, L" mb\n");
+		}
+	}
+	SharingMatrix * ex = compareresult->exclusive;
+	if (ex != NULL) {
+		writestr(w, L"\nExclusive (freed when the file is deleted):\n");
+		for (int g = 0; g < ex->groupsc; g++) {
+			writestr(w, L"\t- ");
+			writestr(w, ex->groups[g].name);
+			writestr(w, L" \t size ");
+			writeint(w, ex->groups[g].size);
+			writestr(w, L" bytes ");
+			writeint(w, ex->groups[g].size / 1024 / 1024);
+			writestr(w, L" mb, exclusive ");
+			writeint(w, ex->groups[g].exclusive);
+			writestr(w, L" bytes ");
+			writeint(w, ex->groups[g].exclusive / 1024 / 1024);
+			writestr(w, L" mb\n");
+		}
+	}
+
+	writestr(w, L"\n\nTotal Savings ");
+	writeint(w, compareresult->savings);
+	writestr(w, L" (");
+	writeint(w, ((compareresult->savings) / 1024 / 1024));
+	writestr(w, L" mb)\nTotal Fragments Over All Files ");
+	writeint(w, compareresult->fragments);
+	writestr(w, L"\nTotal Ioctl Calls ");
+	writeint(w, compareresult->ioctls);
+	writechar(w, L'\n');
+
+}
+
+//should be fairly easy to understand
+//just prints out the info from the structs in xml
+void xmlprintcompare(Writer* w,CompareResult * compareresult) {
+	
+	
+	writestr(w, L"<result type='compare'>\n");
+	
+	writestr(w, L" <fsinfo volume='");
+	writexml(w, compareresult->gvinfo->Volume);
+	writestr(w, L"' clustersize='");
+	writeint(w, (LONGLONG)compareresult->gvinfo->ClusterSize);
+	writestr(w, L"' clusters='");
+	writeint(w, compareresult->gvinfo->Clusters);
+	writestr(w, L"'/>\n <files>\n");
+	for (int i=0; i < compareresult->files->c; i++) {
+		PathRef ref = pathlistget(compareresult->files, i);
+		writestr(w, L"\t<file>");
+		writexml(w, ref.dir);
+		writexml(w, ref.leaf);
+		writestr(w, L"</file>\n");
+	}
+	writestr(w, L" </files>\n");
+
+
+	if (compareresult->errors->c > 0) {
+		writestr(w, L" <errors>\n");
+		for (int i = 0; i < compareresult->errors->c; i++) {
+			writestr(w, L"\t<error>");
+			writexml(w, strstackget(compareresult->errors, i));
+			writestr(w, L"</error>\n");
+		}
+		writestr(w, L" </errors>\n");
+	}
+
+	writestr(w, L" <shares>\n");
+	for (int i = 0; i < compareresult->sharelinesc; i++) {
+		writestr(w, L"\t<share ratio='");
+		writeint(w, compareresult->sharelines[i].shareratio);
+		writestr(w, L"' bytes='");
+		writeint(w, compareresult->sharelines[i].savingsbytes);
+		writestr(w, L"' mb='");
+		writeint(w, compareresult->sharelines[i].savingsmb);
+		writestr(w, L"'/>\n");
+	}
+	writestr(w, L" </shares>\n");
+	SharingMatrix * sm = compareresult->matrix;
+	if (sm != NULL) {
+		writestr(w, L" <groups>\n");
+		for (int g = 0; g < sm->groupsc; g++) {
+			writestr(w, L"\t<group id='");
+			writeint(w, g);
+			writestr(w, L"' name='");
+			writexml(w, sm->groups[g].name);
+			writestr(w, L"' bytes='");
+			writeint(w, sm->groups[g].bytes);
+			writestr(w, L"' mb='");
+			writeint(w, sm->groups[g].bytes / 1024 / 1024);
+			writestr(w, L"' sharedbytes='");
+			writeint(w, sm->groups[g].shared);
+			writestr(w, L"' sharedmb='");
+			writeint(w, sm->groups[g].shared / 1024 / 1024);
+			writestr(w, L"' exclusivebytes='");
+			writeint(w, sm->groups[g].exclusive);
+			writestr(w, L"' exclusivemb='");
+			writeint(w, sm->groups[g].exclusive / 1024 / 1024);
+			writestr(w, L"'/>\n");
+		}
+		writestr(w, L" </groups>\n <matrix>\n");
+		for (MatrixPairs::iterator it = sm->pairs->begin(); it != sm->pairs->end(); ++it) {
+			writestr(w, L"\t<pair a='");
+			writeint(w, it->first.first);
+			writestr(w, L"' b='");
+			writeint(w, it->first.second);
+			writestr(w, L"' bytes='");
+			writeint(w, it->second);
+			writestr(w, L"' mb='");
+			writeint(w, it->second / 1024 / 1024);
+			writestr(w, L"'/>\n");
+		}
+		writestr(w, L" </matrix>\n");
+	}
+	SharingMatrix * ex = compareresult->exclusive;
+	if (ex != NULL) {
+		writestr(w, L" <exclusive>\n");
+		for (int g = 0; g < ex->groupsc; g++) {
+			writestr(w, L"\t<file size='");
+			writeint(w, ex->groups[g].size);
+			writestr(w, L"' sizemb='");
+			writeint(w, ex->groups[g].size / 1024 / 1024);
+			writestr(w, L"' bytes='");
+			writeint(w, ex->groups[g].exclusive);
+			writestr(w, L"' mb='");
+			writeint(w, ex->groups[g].exclusive / 1024 / 1024);
+			writestr(w, L"'>");
+			writexml(w, ex->groups[g].name);
+			writestr(w, L"</file>\n");
+		}
+		writestr(w, L" </exclusive>\n");
+	}
+	writestr(w, L" <totalshare bytes='");
+	writeint(w, compareresult->savings);
+	writestr(w, L"' mb='");
+	writeint(w, ((compareresult->savings) / 1024 / 1024));
+	writestr(w, L"'/>\n <fragments count='");
+	writeint(w, compareresult->fragments);
+	writestr(w, L"'/>\n <ioctls count='");
+	writeint(w, compareresult->ioctls);
+	writestr(w, L"'/>\n</result>\n");
+}
+
+//one compact json object with the same fields as the xml
+void jsonprintcompare(Writer* w, CompareResult * compareresult) {
+	writestr(w, L"{\"type\":\"compare\",\"fsinfo\":{\"volume\":");
+	writejson(w, compareresult->gvinfo->Volume);
+	writestr(w, L",\"clustersize\":");
+	writeint(w, (LONGLONG)compareresult->gvinfo->ClusterSize);
+	writestr(w, L",\"clusters\":");
+	writeint(w, compareresult->gvinfo->Clusters);
+	writestr(w, L"},\"files\":[");
+	for (int i = 0; i < compareresult->files->c; i++) {
+		PathRef ref = pathlistget(compareresult->files, i);
+		wchar_t path[SUPERMAXPATH];
+		pathformat(ref, path);
+		if (i > 0) { writechar(w, L','); }
+		writejson(w, path);
+	}
+	writestr(w, L"],");
+	writejsonstrings(w, L"errors", compareresult->errors);
+	writestr(w, L",\"shares\":[");
+	for (int i = 0; i < compareresult->sharelinesc; i++) {
+		writestr(w, (i > 0) ? L",{\"ratio\":" : L"{\"ratio\":");
+		writeint(w, compareresult->sharelines[i].shareratio);
+		writestr(w, L",\"bytes\":");
+		writeint(w, compareresult->sharelines[i].savingsbytes);
+		writestr(w, L",\"mb\":");
+		writeint(w, compareresult->sharelines[i].savingsmb);
+		writechar(w, L'}');
+	}
+	writechar(w, L']');
+	SharingMatrix * sm = compareresult->matrix;
+	if (sm != NULL) {
+		writestr(w, L",\"groups\":[");
+		for (int g = 0; g < sm->groupsc; g++) {
+			writestr(w, (g > 0) ? L",{\"id\":" : L"{\"id\":");
+			writeint(w, g);
+			writestr(w, L",\"name\":");
+			writejson(w, sm->groups[g].name);
+			writestr(w, L",\"bytes\":");
+			writeint(w, sm->groups[g].bytes);
+			writestr(w, L",\"mb\":");
+			writeint(w, sm->groups[g].bytes / 1024 / 1024);
+			writestr(w, L",\"sharedbytes\":");
+			writeint(w, sm->groups[g].shared);
+			writestr(w, L",\"sharedmb\":");
+			writeint(w, sm->groups[g].shared / 1024 / 1024);
+			writestr(w, L",\"exclusivebytes\":");
+			writeint(w, sm->groups[g].exclusive);
+			writestr(w, L",\"exclusivemb\":");
+			writeint(w, sm->groups[g].exclusive / 1024 / 1024);
+			writechar(w, L'}');
+		}
+		writestr(w, L"],\"matrix\":[");
+		for (MatrixPairs::iterator it = sm->pairs->begin(); it != sm->pairs->end(); ++it) {
+			writestr(w, (it != sm->pairs->begin()) ? L",{\"a\":" : L"{\"a\":");
+			writeint(w, it->first.first);
+			writestr(w, L",\"b\":");
+			writeint(w, it->first.second);
+			writestr(w, L",\"bytes\":");
+			writeint(w, it->second);
+			writestr(w, L",\"mb\":");
+			writeint(w, it->second / 1024 / 1024);
+			writechar(w, L'}');
+		}
+		writechar(w, L']');
+	}
+	SharingMatrix * ex = compareresult->exclusive;
+	if (ex != NULL) {
+		writestr(w, L",\"exclusive\":[");
+		for (int g = 0; g < ex->groupsc; g++) {
+			writestr(w, (g > 0) ? L",{\"file\":" : L"{\"file\":");
+			writejson(w, ex->groups[g].name);
+			writestr(w, L",\"size\":");
+			writeint(w, ex->groups[g].size);
+			writestr(w, L",\"sizemb\":");
+			writeint(w, ex->groups[g].size / 1024 / 1024);
+			writestr(w, L",\"bytes\":");
+			writeint(w, ex->groups[g].exclusive);
+			writestr(w, L",\"mb\":");
+			writeint(w, ex->groups[g].exclusive / 1024 / 1024);
+			writechar(w, L'}');
+		}
+		writechar(w, L']');
+	}
+	writestr(w, L",\"totalshare\":{\"bytes\":");
+	writeint(w, compareresult->savings);
+	writestr(w, L",\"mb\":");
+	writeint(w, ((compareresult->savings) / 1024 / 1024));
+	writestr(w, L"},\"fragments\":");
+	writeint(w, compareresult->fragments);
+	writestr(w, L",\"ioctls\":");
+	writeint(w, compareresult->ioctls);
+	writestr(w, L"}\n");
+}
+
+//csv, see OUTPUT for the records
+void csvprintcompare(Writer* w, CompareResult * compareresult) {
+	writestr(w, L"kind,text,v1,v2,v3,v4\nfsinfo,");
+	writecsv(w, compareresult->gvinfo->Volume);
+	writechar(w, L',');
+	writeint(w, (LONGLONG)compareresult->gvinfo->ClusterSize);
+	writechar(w, L',');
+	writeint(w, compareresult->gvinfo->Clusters);
+	writestr(w, L",,\n");
+	for (int i = 0; i < compareresult->files->c; i++) {
+		PathRef ref = pathlistget(compareresult->files, i);
+		wchar_t path[SUPERMAXPATH];
+		pathformat(ref, path);
+		writestr(w, L"file,");
+		writecsv(w, path);
+		writestr(w, L",,,,\n");
+	}
+	for (int i = 0; i < compareresult->errors->c; i++) {
+		writestr(w, L"error,");
+		writecsv(w, strstackget(compareresult->errors, i));
+		writestr(w, L",,,,\n");
+	}
+	for (int i = 0; i < compareresult->sharelinesc; i++) {
+		writestr(w, L"share,,");
+		writeint(w, compareresult->sharelines[i].shareratio);
+		writechar(w, L',');
+		writeint(w, compareresult->sharelines[i].savingsbytes);
+		writechar(w, L',');
+		writeint(w, compareresult->sharelines[i].savingsmb);
+		writestr(w, L",\n");
+	}
+	SharingMatrix * sm = compareresult->matrix;
+	if (sm != NULL) {
+		for (int g = 0; g < sm->groupsc; g++) {
+			writestr(w, L"group,");
+			writecsv(w, sm->groups[g].name);
+			writechar(w, L',');
+			writeint(w, g);
+			writechar(w, L',');
+			writeint(w, sm->groups[g].bytes);
+			writechar(w, L',');
+			writeint(w, sm->groups[g].shared);
+			writechar(w, L',');
+			writeint(w, sm->groups[g].exclusive);
+			writechar(w, L'\n');
+		}
+		for (MatrixPairs::iterator it = sm->pairs->begin(); it != sm->pairs->end(); ++it) {
+			writestr(w, L"pair,,");
+			writeint(w, it->first.first);
+			writechar(w, L',');
+			writeint(w, it->first.second);
+			writechar(w, L',');
+			writeint(w, it->second);
+			writechar(w, L',');
+			writeint(w, it->second / 1024 / 1024);
+			writechar(w, L'\n');
+		}
+	}
+	SharingMatrix * ex = compareresult->exclusive;
+	if (ex != NULL) {
+		for (int g = 0; g < ex->groupsc; g++) {
+			writestr(w, L"exclusive,");
+			writecsv(w, ex->groups[g].name);
+			writechar(w, L',');
+			writeint(w, ex->groups[g].size);
+			writechar(w, L',');
+			writeint(w, ex->groups[g].exclusive);
+			writechar(w, L',');
+			writeint(w, ex->groups[g].exclusive / 1024 / 1024);
+			writestr(w, L",\n");
+		}
+	}
+	writestr(w, L"total,,");
+	writeint(w, compareresult->savings);
+	writechar(w, L',');
+	writeint(w, ((compareresult->savings) / 1024 / 1024));
+	writechar(w, L',');
+	writeint(w, compareresult->fragments);
+	writechar(w, L',');
+	writeint(w, compareresult->ioctls);
+	writechar(w, L'\n');
+}
+
+/*
+PIPELINE
+
+Discovery, validation and extent retrieval run at the same time, so the first extents are counted while the directories are still walked
+main			-> discovery thread (file arguments, -m, -d, -t, -i and stdin in that order) pushes the paths it finds in a PathQueue
+comparefiles	-> validation thread pops the paths, checks the volume and appends the good files to the validated list
+				-> compare workers take the good files as soon as they are there and add their extents to the refcount engine
+Both queues are bounded (PIPELINEQUEUE), a stage that runs ahead waits for the next one
+*/
+#define PIPELINEQUEUE 256
+
+//bounded queue of paths
+//push waits while the queue is full, pop waits while it is empty and returns NULL once it is closed and empty
+typedef struct _pathqueue {
+	wchar_t ** items;
+	int cap;
+	int head;
+	int count;
+	bool closed;
+	std::mutex * lock;
+	std::condition_variable * notfull;
+	std::condition_variable * notempty;
+} PathQueue;
+
+PathQueue * newPathQueue(int cap) {
+	PathQueue * pq = (PathQueue*)malloc(sizeof(PathQueue));
+	pq->items = (wchar_t**)malloc(sizeof(wchar_t*)*cap);
+	pq->cap = cap;
+	pq->head = 0;
+	pq->count = 0;
+	pq->closed = false;
+	pq->lock = new std::mutex();
+	pq->notfull = new std::condition_variable();
+	pq->notempty = new std::condition_variable();
+	return pq;
+}
+
+void freePathQueue(PathQueue * pq) {
+	delete pq->lock;
+	delete pq->notfull;
+	delete pq->notempty;
+	free(pq->items);
+	free(pq);
+}
+
+void pathqueuepush(PathQueue * pq, wchar_t * path) {
+	std::unique_lock<std::mutex> guard(*pq->lock);
+	while (pq->count == pq->cap) {
+		pq->notfull->wait(guard);
+	}
+	pq->items[(pq->head + pq->count) % pq->cap] = path;
+	pq->count++;
+	pq->notempty->notify_all();
+}
+
+wchar_t * pathqueuepop(PathQueue * pq) {
+	std::unique_lock<std::mutex> guard(*pq->lock);
+	while (pq->count == 0 && !pq->closed) {
+		pq->notempty->wait(guard);
+	}
+	if (pq->count == 0) {
+		return NULL;
+	}
+	wchar_t * path = pq->items[pq->head];
+	pq->head = (pq->head + 1) % pq->cap;
+	pq->count--;
+	pq->notfull->notify_all();
+	return path;
+}
+
+//the producer is done
+void pathqueueclose(PathQueue * pq) {
+	std::lock_guard<std::mutex> guard(*pq->lock);
+	pq->closed = true;
+	pq->notempty->notify_all();
+}
+
+//waits till there are n paths in the queue or it is closed, returns how many there are (max n)
+//main uses this to know if it should compare or dump without waiting for the whole discovery
+int pathqueuewait(PathQueue * pq, int n) {
+	std::unique_lock<std::mutex> guard(*pq->lock);
+	while (pq->count < n && !pq->closed) {
+		pq->notempty->wait(guard);
+	}
+	return (pq->count < n) ? pq->count : n;
+}
+
+/*
+COMPARE WORKERS
+
+The compare workers (-j, default 1) take the validated files and add their extents to the refcount engine
+Most of the time goes to waiting on the ioctls, so with multiple workers they are spread over the workers
+- every worker takes the next validated file and works on it as one range of vcns [0, size of the file)
+- when there is no file waiting, an idle worker steals the second half of the biggest range that is still in progress (work stealing)
+  so one huge fragmented file next to a few small ones is still queried by all workers
+- the owner of a range announces how far it got (cur) after every batch, the range is only split after cur
+- an extent that crosses the border of a range is clipped, it is counted as a fragment by the range it starts in
+
+Results are kept per file and merged in file order, so the output is the same for every amount of workers (except for the amount of ioctls)
+The validated list and the per file results grow under poollock, the workers keep the path of their range in the slot so they never read the list without the lock
+*/
+//ranges smaller then this are not split, a steal costs an open and a query
+#define RANGEMINSTEAL 4096
+
+typedef struct _rangeslot {
+	bool active;
+	int file;
+	PathRef path;
+	LONGLONG vcns;
+	LONGLONG start;
+	LONGLONG cur;
+	LONGLONG end;
+} RangeSlot;
+
+//per file result of the compare workers, kept small because there is one per validated file
+//the errors are rare, they are kept aside by file index
+typedef struct _filestat {
+	LONGLONG fragments;
+	LONGLONG ioctls;
+	int ret;
+	//only with -c, id is 0 otherwise
+	FileId fid;
+	//size of the file in clusters (for -u)
+	LONGLONG vcns;
+} FileStat;
+typedef std::multimap<int, const wchar_t*> FileErrors;
+//extents of a range for the binary dump (-f bin) and the extent cache (-c), kept aside by file index and start vcn so they come out in order
+//the runs of a cached file are numbered instead (they are in order in the cache)
+typedef struct _binrun {
+	LONGLONG count;
+	unsigned char * data;
+	size_t len;
+} BinRun;
+typedef std::map<std::pair<int, LONGLONG>, BinRun> BinRuns;
+
+//everything below is protected by poollock (except the engine and the immutable flags)
+typedef struct _compareworkctx {
+	Blockstatflags * bsf;
+	VINFO * gvinfo;
+	RefEngine * re;
+	std::mutex * relock;
+	std::mutex * poollock;
+
+	//input of the validation thread, filled by the discovery thread
+	PathQueue * paths;
+	CompareResult * compareresult;
+
+	//validated list (compareresult->files): files on the same volume as the first file, taken is how many of them are picked up by a worker
+	int filesc;
+	int taken;
+	bool validated;
+	//the workers will not come (no engine), validation should not wait for them
+	bool stopping;
+	std::condition_variable * filesready;
+	std::condition_variable * filestaken;
+
+	//per file results, merged after the workers are done
+	FileStat * perfile;
+	int perfilel;
+	FileErrors * fileerrors;
+	Arena * errorarena;
+	//only for the binary dump and the extent cache, NULL otherwise
+	BinRuns * binruns;
+	Arena * binarena;
+	//files that came out of the cache (-c)
+	int cachehits;
+
+	//the ranges in progress, one slot per worker
+	RangeSlot * slots;
+	int jobs;
+	//extents retrieved so far, for the progress lines (-p)
+	LONGLONG extents;
+} CompareWorkCtx;
+
+//validation stage: make sure all files are on the same volume as the first path
+void validatefiles(CompareWorkCtx * cwc) {
+	Blockstatflags * bsf = cwc->bsf;
+	CompareResult * compareresult = cwc->compareresult;
+	wchar_t * src;
+
+	//waiting for the workers is not part of the phase
+	PhaseTimer pt;
+	PhaseStat volumestat;
+	phasestatinit(&volumestat);
+
+	if (bsf->verbose) { verboseprint(bsf, L"Checking if files are on the same volume\n"); }
+	while ((src = pathqueuepop(cwc->paths)) != NULL) {
+		phasestart(bsf->telemetry, &pt);
+		volumestat.files++;
+		//if path exists (should already be done by discovery but just to make sure)
+		if (!sourceexists(bsf, src)) {
+			//should not happen because already checked by discovery
+			addStrStack(compareresult->errors, L"File does not exist");
+			free(src);
+			phasestop(bsf->telemetry, &pt, &volumestat);
+			continue;
+		}
+
+		//get volume info for a file
+		VINFO* vinfo = (VINFO*)malloc(sizeof(VINFO));
+		(vinfo->Volume)[0] = 0;
+		bool gotvinfo = sourcevolinfo(bsf, src, vinfo);
+		//the identity for the cache, a file without one is always queried
+		FileId fid;
+		if (bsf->cache == NULL || !fileidentity(src, &fid)) {
+			fid.id = 0;
+		}
+		phasestop(bsf->telemetry, &pt, &volumestat);
+		if (gotvinfo) {
+			std::unique_lock<std::mutex> guard(*cwc->poollock);
+			//if we didn't check any files or the volume is the same for the next file, we add it to the list of goodfiles
+			if (cwc->filesc == 0 || samevolume(cwc->gvinfo, vinfo)) {
+				//first file is always a goodfile, we use it as the baseline for the volume (clustersize etc.)
+				//next files will be checked against it to see if the files are on the same path
+				if (cwc->filesc == 0) {
+					*cwc->gvinfo = *vinfo;
+					compareresult->gvinfo = cwc->gvinfo;
+				}
+
+				//bounded, wait till the workers catch up
+				while (!cwc->stopping && cwc->filesc - cwc->taken >= PIPELINEQUEUE) {
+					cwc->filestaken->wait(guard);
+				}
+
+				//adding file to the list of good files (the output stack) and making room for its result
+				if (cwc->filesc == cwc->perfilel) {
+					cwc->perfilel = (cwc->perfilel > 0) ? cwc->perfilel * 2 : 1024;
+					cwc->perfile = (FileStat*)realloc(cwc->perfile, sizeof(FileStat) * cwc->perfilel);
+				}
+				memset(&cwc->perfile[cwc->filesc], 0, sizeof(FileStat));
+				cwc->perfile[cwc->filesc].fid = fid;
+				addPathList(compareresult->files, src);
+				cwc->filesc++;
+				cwc->filesready->notify_all();
+
+				if (bsf->verbose) { verboseprint(bsf, L"File %ls is good\n", src); }
+				free(src);
+			}
+			else {
+				//if file 2 and subsequent files are not on the same vol, we can not look for shared clusters because there is 0% chance of finding any
+				addStrStack(compareresult->errors, L"Not on same vol");
+				free(src);
+			}
+		}
+		else {
+			//could not query vol info for a file
+			addStringStackError(compareresult->errors, L"Error getting file vol info");
+			free(src);
+		}
+		free(vinfo);
+	}
+	telemetryadd(bsf->telemetry, PHASEVOLUME, &volumestat);
+
+	std::lock_guard<std::mutex> guard(*cwc->poollock);
+	cwc->validated = true;
+	cwc->filesready->notify_all();
+}
+
+//add the extents of the range in slot w to the refcount engine
+//and to log if the extents are dumped (-f bin)
+//the time of the queries and of the engine is added to extentstat and refmapstat (see TELEMETRY)
+bool vcnrange(CompareWorkCtx * cwc, int w, ExtentSource * es, LONGLONG * fragments, ExtentLog * log, PhaseStat * extentstat, PhaseStat * refmapstat) {
+	RangeSlot * slot = &cwc->slots[w];
+	Telemetry * tm = cwc->bsf->telemetry;
+	PhaseTimer pt;
+	int contstatus = 0;
+	LONGLONG dumpedextents = 0;
+
+	if (log != NULL) { extentlogreset(log); }
+
+	es->seek(es, slot->start);
+	while (contstatus == 0) {
+		Extent * extents = NULL;
+		LONGLONG got = 0;
+
+		//the end can move down while we are querying if somebody steals the rest
+		cwc->poollock->lock();
+		es->vcnend = (slot->end >= slot->vcns) ? -1 : slot->end;
+		cwc->poollock->unlock();
+
+		phasestart(tm, &pt);
+		contstatus = es->next(es, &extents, &got);
+		phasestop(tm, &pt, extentstat);
+		if (contstatus == 2) {
+			return false;
+		}
+
+		//claim what we got, from now on the range can only be split after cur
+		//the last range of a file has no end, extents can be allocated past the size of the file
+		cwc->poollock->lock();
+		LONGLONG end = (slot->end >= slot->vcns) ? LLONG_MAX : slot->end;
+		LONGLONG cur = end;
+		if (contstatus == 0 && got > 0 && extents[got - 1].vcn + extents[got - 1].clusters < end) {
+			cur = extents[got - 1].vcn + extents[got - 1].clusters;
+		}
+		if (cur > slot->cur) { slot->cur = (cur < slot->end) ? cur : slot->end; }
+		if (cur >= end) { contstatus = 1; }
+		cwc->extents += got;
+		cwc->poollock->unlock();
+
+		dumpedextents += got;
+		phasestart(tm, &pt);
+		if (cwc->relock != NULL) { cwc->relock->lock(); }
+		for (LONGLONG ec = 0; ec < got; ec++) {
+			Extent extent = extents[ec];
+			LONGLONG from = (extent.vcn < slot->start) ? slot->start : extent.vcn;
+			LONGLONG to = (extent.vcn + extent.clusters > end) ? end : extent.vcn + extent.clusters;
+			if (from >= to) {
+				continue;
+			}
 
-	} else {
-		addStrStack(sr.errors, L"File does not exists");
+			if (extent.lcn >= 0 && !cwc->re->add(cwc->re, extent.lcn + (from - extent.vcn), to - from)) {
+				wprintf(L"REFMAP NOT BIG ENOUGH (SHOULD NOT HAPPEN)\n");
+				wprintf(L"LCN END (end of extent) was %lld vs size of map %lld\n", extent.lcn + (to - extent.vcn), cwc->gvinfo->Clusters);
+			}
+			if (extent.vcn >= slot->start) {
+				(*fragments)++;
+			}
+			if (log != NULL) {
+				extentlogadd(log, from, (extent.lcn >= 0) ? extent.lcn + (from - extent.vcn) : -1, to - from);
+			}
+		}
+		if (cwc->relock != NULL) { cwc->relock->unlock(); }
+		phasestop(tm, &pt, refmapstat);
 	}
-	//if xml, use the corresponding function
-	if (bsf->xmlout) {
-		xmlprintsingle(bsf, &sr);
+	extentstat->extents += dumpedextents;
+	refmapstat->extents += dumpedextents;
+	if (cwc->bsf->verbose) { verboseprint(cwc->bsf, L"%lld extents in %lld ioctl calls for vcn %lld till %lld of %ls%ls\n", dumpedextents, es->ioctls, slot->start, slot->end, slot->path.dir, slot->path.leaf); }
+	return true;
+}
+
+//take the second half of the biggest range in progress, returns false if there is nothing worth stealing
+//the new range is published in slot w while the lock is held so it can be stolen from right away
+//poollock has to be held by the caller
+bool rangesteal(CompareWorkCtx * cwc, int w) {
+	int victim = -1;
+	LONGLONG biggest = 2 * RANGEMINSTEAL - 1;
+	for (int v = 0; v < cwc->jobs; v++) {
+		RangeSlot * slot = &cwc->slots[v];
+		if (slot->active && slot->end - slot->cur > biggest) {
+			biggest = slot->end - slot->cur;
+			victim = v;
+		}
 	}
-	else {
-		printsingle(bsf, &sr);
+	if (victim < 0) {
+		return false;
 	}
-	//cleanup some stuff
-	free(vinfo);
 
-	for (int i=0; i < sr.vcnstack->used; i++) {
-		free(sr.vcnstack->vs[i]);
+	RangeSlot * from = &cwc->slots[victim];
+	LONGLONG mid = from->cur + (from->end - from->cur) / 2;
+	RangeSlot * slot = &cwc->slots[w];
+	slot->active = true;
+	slot->file = from->file;
+	slot->path = from->path;
+	slot->vcns = from->vcns;
+	slot->start = mid;
+	slot->cur = mid;
+	slot->end = from->end;
+	from->end = mid;
+	return true;
+}
+
+#define COMPARENEXTDONE -1
+#define COMPARENEXTSTOLEN -2
+
+//the next validated file (and its path), a stolen range if there is no file waiting (COMPARENEXTSTOLEN), or COMPARENEXTDONE if there is no work left
+//waits if validation is still busy and nothing can be stolen
+int comparenext(CompareWorkCtx * cwc, int w, PathRef * path) {
+	std::unique_lock<std::mutex> guard(*cwc->poollock);
+	while (true) {
+		if (cwc->taken < cwc->filesc) {
+			cwc->filestaken->notify_all();
+			*path = pathlistget(cwc->compareresult->files, cwc->taken);
+			return cwc->taken++;
+		}
+		if (rangesteal(cwc, w)) {
+			return COMPARENEXTSTOLEN;
+		}
+		if (cwc->validated) {
+			return COMPARENEXTDONE;
+		}
+		//woken up by a new file or a new range
+		cwc->filesready->wait(guard);
 	}
-	free(sr.vcnstack->vs);
+}
 
-	free(sr.vcnstack);
+//adds the cached extents of file f to the refcount engine, false if the file is not in the cache (see EXTENT CACHE)
+//the runs are kept as they are for the new cache (and the binary dump)
+bool comparecached(CompareWorkCtx * cwc, int f, PhaseStat * refmapstat) {
+	cwc->poollock->lock();
+	FileId fid = cwc->perfile[f].fid;
+	cwc->poollock->unlock();
+	const CacheEntry * ce = (fid.id != 0) ? cachefind(cwc->bsf->cache, &fid) : NULL;
+	if (ce == NULL) {
+		return false;
+	}
 
-	free(sr.errors);
-	
-	return retvalue;
+	PhaseTimer pt;
+	phasestart(cwc->bsf->telemetry, &pt);
+	const unsigned char * p = ce->runs;
+	unsigned long long count;
+	LONGLONG extents = 0;
+	LONGLONG run = 0;
+	//the runs were checked when the cache was loaded
+	while (varintdecode(&p, ce->end, &count) && count > 0) {
+		const unsigned char * start = p;
+		LONGLONG nextvcn = 0;
+		LONGLONG nextlcn = 0;
+		if (cwc->relock != NULL) { cwc->relock->lock(); }
+		for (unsigned long long i = 0; i < count; i++) {
+			Extent e;
+			extentdecode(&p, ce->end, &nextvcn, &nextlcn, &e);
+			if (e.lcn >= 0 && !cwc->re->add(cwc->re, e.lcn, e.clusters)) {
+				wprintf(L"REFMAP NOT BIG ENOUGH (SHOULD NOT HAPPEN)\n");
+				wprintf(L"LCN END (end of extent) was %lld vs size of map %lld\n", e.lcn + e.clusters, cwc->gvinfo->Clusters);
+			}
+		}
+		if (cwc->relock != NULL) { cwc->relock->unlock(); }
+		extents += count;
+
+		BinRun br;
+		br.count = count;
+		br.data = (unsigned char*)start;
+		br.len = p - start;
+		std::lock_guard<std::mutex> guard(*cwc->poollock);
+		(*cwc->binruns)[std::make_pair(f, run++)] = br;
+	}
+	phasestop(cwc->bsf->telemetry, &pt, refmapstat);
+	refmapstat->files++;
+	refmapstat->extents += extents;
+
+	std::lock_guard<std::mutex> guard(*cwc->poollock);
+	cwc->perfile[f].fragments = ce->fragments;
+	cwc->perfile[f].vcns = ((LONGLONG)fid.size + cwc->gvinfo->ClusterSize - 1) / cwc->gvinfo->ClusterSize;
+	cwc->cachehits++;
+	return true;
 }
 
+void compareworker(CompareWorkCtx * cwc, int w) {
+	RangeSlot * slot = &cwc->slots[w];
+	int f;
+	PathRef path;
+	wchar_t * pathbuf = (wchar_t*)malloc(sizeof(wchar_t)*SUPERMAXPATH);
+	wchar_t * linebuf = (wchar_t*)malloc(sizeof(wchar_t)*ERRORLINEWIDTH);
+	ExtentLog log;
+	if (cwc->binruns != NULL) { extentloginit(&log); }
+	//added to the telemetry after every range
+	PhaseTimer pt;
+	PhaseStat extentstat;
+	PhaseStat refmapstat;
+	phasestatinit(&extentstat);
+	phasestatinit(&refmapstat);
+	while ((f = comparenext(cwc, w, &path)) != COMPARENEXTDONE) {
+		ExtentSource es;
+		bool opened = false;
+
+		//a cached file is done right away, there is nothing to steal from it
+		if (f != COMPARENEXTSTOLEN && cwc->bsf->cache != NULL && comparecached(cwc, f, &refmapstat)) {
+			if (cwc->bsf->verbose) { verboseprint(cwc->bsf, L"Cached %ls\n", pathformat(path, pathbuf)); }
+			telemetryadd(cwc->bsf->telemetry, PHASEREFMAP, &refmapstat);
+			continue;
+		}
+
+		if (f != COMPARENEXTSTOLEN) {
+			phasestart(cwc->bsf->telemetry, &pt);
+			opened = sourceopen(cwc->bsf, pathformat(path, pathbuf), cwc->gvinfo, &es);
+			phasestop(cwc->bsf->telemetry, &pt, &extentstat);
+			extentstat.files++;
+			refmapstat.files++;
+			if (opened) {
+				if (cwc->bsf->verbose) { verboseprint(cwc->bsf, L"Comparing %ls\n", pathbuf); }
+				std::lock_guard<std::mutex> guard(*cwc->poollock);
+				cwc->perfile[f].vcns = es.vcns;
+				slot->file = f;
+				slot->path = path;
+				slot->vcns = es.vcns;
+				slot->start = 0;
+				slot->cur = 0;
+				slot->end = es.vcns;
+				slot->active = true;
+				//waiting workers can help with this one
+				cwc->filesready->notify_all();
+			}
+		}
+		else {
+			f = slot->file;
+			opened = sourceopen(cwc->bsf, pathformat(slot->path, pathbuf), cwc->gvinfo, &es);
+			if (cwc->bsf->verbose) { verboseprint(cwc->bsf, L"Stealing vcn %lld till %lld of %ls\n", slot->start, slot->end, pathbuf); }
+		}
 
+		int ret = 0;
+		LONGLONG fragments = 0;
+		if (!opened) {
+			ret = 3;
+		}
+		else if (!vcnrange(cwc, w, &es, &fragments, (cwc->binruns != NULL) ? &log : NULL, &extentstat, &refmapstat)) {
+			ret = 4;
+		}
 
+		//the error is added before closing so the last error is still the one of the query
+		//a stolen range that could not be queried is also marked as done, nobody else will do it
+		cwc->poollock->lock();
+		slot->active = false;
+		cwc->perfile[f].fragments += fragments;
+		if (opened) {
+			cwc->perfile[f].ioctls += es.ioctls;
+		}
+		if (ret != 0) {
+			cwc->perfile[f].ret = ret;
+			formatLastError(linebuf, (ret == 3) ? L"Error opening file (in use?)" : L"No success vcnnums on file");
+			cwc->fileerrors->insert(FileErrors::value_type(f, arenawcsdup(cwc->errorarena, linebuf, wcslen(linebuf))));
+		}
+		if (cwc->binruns != NULL && opened && log.count > 0) {
+			BinRun run;
+			run.count = log.count;
+			run.len = log.used;
+			run.data = (unsigned char*)arenaalloc(cwc->binarena, log.used);
+			memcpy(run.data, log.buf, log.used);
+			(*cwc->binruns)[std::make_pair(f, slot->start)] = run;
+		}
+		cwc->poollock->unlock();
 
-/*
+		if (opened) {
+			extentstat.ioctls += es.ioctls;
+			es.close(&es);
+		}
+		telemetryadd(cwc->bsf->telemetry, PHASEEXTENTS, &extentstat);
+		telemetryadd(cwc->bsf->telemetry, PHASEREFMAP, &refmapstat);
+	}
+	if (cwc->binruns != NULL) { extentlogfree(&log); }
+	free(pathbuf);
+	free(linebuf);
+}
 
-COMPARING FUNCTIONS
+//-p, a line on stderr every bsf->progress seconds until done is set
+//the eta is based on the files that were picked up by a worker, it is only known once all files are validated
+void compareprogress(CompareWorkCtx * cwc, bool * done, std::condition_variable * wake) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::unique_lock<std::mutex> guard(*cwc->poollock);
+	while (!*done) {
+		wake->wait_for(guard, std::chrono::seconds(cwc->bsf->progress));
+		if (*done) {
+			break;
+		}
+		int taken = cwc->taken;
+		int filesc = cwc->filesc;
+		bool validated = cwc->validated;
+		LONGLONG extents = cwc->extents;
+		guard.unlock();
+
+		double took = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (validated && taken > 0) {
+			fwprintf(stderr, L"PROGRESS: %d/%d files, %lld extents, %.0f extents/s, %.0f s, ETA %.0f s\n", taken, filesc, extents, extents / took, took, took * (filesc - taken) / taken);
+		}
+		else {
+			fwprintf(stderr, L"PROGRESS: %d/%d+ files, %lld extents, %.0f extents/s, %.0f s, ETA ? (still looking for files)\n", taken, filesc, extents, extents / took, took);
+		}
+		guard.lock();
+	}
+}
 
-*/
-//should be fairly easy to understand
-//just prints out the info from the structs in human readable format
-void printcompare(Blockstatflags* bsf,CompareResult * compareresult) {
-	fwprintf(bsf->printer,L"Comparing Mode\n");
-	fwprintf(bsf->printer, L"Fsinfo %ls clustersize %lld clusters %lld\n", compareresult->gvinfo->Volume, compareresult->gvinfo->ClusterSize, compareresult->gvinfo->Clusters);
-	fwprintf(bsf->printer, L"Files:\n");
-	for (int i = 0; i < compareresult->files->c; i++) {
-		fwprintf(bsf->printer, L"\t- %ls\n", compareresult->files->ss[i]);
+//the shared array holds the ratios up to the amount of files, with a minimum so the histogram kernels always have their small ratios in it
+//and a maximum so a huge file list does not blow up the per thread histograms (the rest goes to the overflow map)
+#define SHAREDMIN 64
+#define SHAREDMAX 65536
+int sharedsize(int filesc) {
+	if (filesc + 1 < SHAREDMIN) {
+		return SHAREDMIN;
 	}
-	fwprintf(bsf->printer, L"\n");
-	
+	return (filesc + 1 < SHAREDMAX) ? filesc + 1 : SHAREDMAX;
+}
 
-	if (compareresult->errors->c > 0) {
-		fwprintf(bsf->printer, L"Errors:\n");
-		for (int i = 0; i < compareresult->errors->c; i++) {
-			fwprintf(bsf->printer, L"\t-%ls\n", compareresult->errors->ss[i]);
+//add a line for clusters that are shared ratio times, returns how much is saved by them
+LONGLONG addshareline(CompareResult * compareresult, LONGLONG ratio, LONGLONG clusters, LONGLONG clustersize) {
+	//how much data is really shared (ratio multiplied by clustersize
+	LONGLONG bytesshr = clusters * clustersize;
+	ShareLine * line = &compareresult->sharelines[compareresult->sharelinesc];
+	line->savingsbytes = bytesshr;
+	//convert to MB
+	line->savingsmb = bytesshr / 1024 / 1024;
+	//ratio is independently given
+	//cannot use array index as 1x for example will not occure
+	//this is easier on the post/printing side
+	line->shareratio = ratio;
+	compareresult->sharelinesc++;
+
+	//how much is saved
+	//if a data is shared 1 time, it means it is uniquely used thus there is no gain
+	//if a data is shared 2 time, it needs to be stored 1 time, and is reused 1 time
+	//if a data is shared 3 time, it needs to be stored 1 time, and is reused 2 time
+	//etc.. (i-1) reuse
+	return (ratio > 1) ? (ratio - 1) * bytesshr : 0;
+}
+
+//binary dump of the compare, see BINARY DUMP
+//the runs are ordered by file and vcn, perfile tells which files failed
+void binprintcompare(Writer* w, CompareResult * compareresult, BinRuns * binruns, FileStat * perfile) {
+	int files = compareresult->files->c;
+	LONGLONG * records = (LONGLONG*)malloc(sizeof(LONGLONG) * (files + 1));
+	LONGLONG * extents = (LONGLONG*)calloc(files + 1, sizeof(LONGLONG));
+	wchar_t * path = (wchar_t*)malloc(sizeof(wchar_t)*SUPERMAXPATH);
+	BinRuns::iterator it = binruns->begin();
+
+	writebinheader(w, compareresult->gvinfo);
+	for (int f = 0; f < files; f++) {
+		records[f] = writeroffset(w);
+		writebinstr(w, pathformat(pathlistget(compareresult->files, f), path));
+
+		for (; it != binruns->end() && it->first.first == f; ++it) {
+			writebinrun(w, it->second.count, it->second.data, it->second.len);
+			extents[f] += it->second.count;
 		}
-		fwprintf(bsf->printer, L"\n");
+		writevarint(w, 0);
 	}
 
-	fwprintf(bsf->printer, L"Sharing:\n");
+	LONGLONG summary = writeroffset(w);
+	writevarint(w, compareresult->savings);
+	writevarint(w, compareresult->fragments);
+	writevarint(w, compareresult->ioctls);
+	writevarint(w, compareresult->sharelinesc);
 	for (int i = 0; i < compareresult->sharelinesc; i++) {
-		fwprintf(bsf->printer, L"\t- %ld x \t %lld bytes %lld mb\n", compareresult->sharelines[i].shareratio, compareresult->sharelines[i].savingsbytes, compareresult->sharelines[i].savingsmb);
+		writevarint(w, compareresult->sharelines[i].shareratio);
+		writevarint(w, compareresult->sharelines[i].savingsbytes / compareresult->gvinfo->ClusterSize);
 	}
+	writebinerrors(w, compareresult->errors);
 
-	fwprintf(bsf->printer, L"\n\nTotal Savings %lld (%lld mb)\n", compareresult->savings, ((compareresult->savings) / 1024 / 1024));
-	fwprintf(bsf->printer, L"Total Fragments Over All Files %lld\n", compareresult->fragments);
+	LONGLONG index = writeroffset(w);
+	for (int f = 0; f < files; f++) {
+		writefixed(w, records[f]);
+		writefixed(w, extents[f]);
+		writefixed(w, (perfile != NULL && perfile[f].ret != 0) ? 1 : 0);
+	}
+	writebintrailer(w, index, summary, files);
 
+	free(path);
+	free(extents);
+	free(records);
 }
 
-//should be fairly easy to understand
-//just prints out the info from the structs in xml
-void xmlprintcompare(Blockstatflags* bsf,CompareResult * compareresult) {
-	
-	
-	fwprintf(bsf->printer,L"<result type='compare'>\n");
-	
-	fwprintf(bsf->printer, L" <fsinfo volume='%ls' clustersize='%lld' clusters='%lld'/>\n", compareresult->gvinfo->Volume, compareresult->gvinfo->ClusterSize, compareresult->gvinfo->Clusters);
-	fwprintf(bsf->printer, L" <files>\n");
-	for (int i=0; i < compareresult->files->c; i++) {
-		fwprintf(bsf->printer, L"\t<file>%ls</file>\n", compareresult->files->ss[i]);
+//writes the new extent cache (see EXTENT CACHE), files that failed or have no identity are left out
+bool cachesave(ExtentCache * ec, int files, FileStat * perfile, BinRuns * binruns) {
+	size_t len = strlen(ec->file);
+	char * tmp = (char*)malloc(len + 5);
+	snprintf(tmp, len + 5, "%s.tmp", ec->file);
+	FILE * f = NULL;
+	if (fopen_s(&f, tmp, "wb") != 0) {
+		free(tmp);
+		return false;
 	}
-	fwprintf(bsf->printer, L" </files>\n");
-
 
-	if (compareresult->errors->c > 0) {
-		fwprintf(bsf->printer, L" <errors>\n");
-		for (int i = 0; i < compareresult->errors->c; i++) {
-			fwprintf(bsf->printer, L"\t<error>%ls</error>\n", compareresult->errors->ss[i]);
+	Writer * w = newWriter(f);
+	writebytes(w, CACHEMAGIC, 4);
+	unsigned char version = CACHEVERSION;
+	writebytes(w, &version, 1);
+	BinRuns::iterator it = binruns->begin();
+	for (int fi = 0; fi < files; fi++) {
+		BinRuns::iterator first = it;
+		unsigned long long runslen = 1;
+		unsigned char buf[10];
+		for (; it != binruns->end() && it->first.first == fi; ++it) {
+			runslen += varintencode(buf, (unsigned long long)it->second.count) + it->second.len;
+		}
+		FileId * fid = &perfile[fi].fid;
+		if (perfile[fi].ret != 0 || fid->id == 0) {
+			continue;
+		}
+		writevarint(w, fid->dev);
+		writevarint(w, fid->id);
+		writevarint(w, fid->size);
+		writevarint(w, fid->mtime);
+		writevarint(w, fid->ctime);
+		writevarint(w, (unsigned long long)perfile[fi].fragments);
+		writevarint(w, runslen);
+		for (BinRuns::iterator r = first; r != it; ++r) {
+			writebinrun(w, r->second.count, r->second.data, r->second.len);
 		}
-		fwprintf(bsf->printer, L" </errors>\n");
+		writevarint(w, 0);
 	}
+	writerflush(w);
+	//a cache that was cut short is not renamed over the previous one
+	bool ok = !w->failed;
+	freeWriter(w);
+	ok = (fclose(f) == 0) && ok;
+	if (ok) {
+#ifdef _WIN32
+		ok = MoveFileExA(tmp, ec->file, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+		ok = rename(tmp, ec->file) == 0;
+#endif
+	}
+	else {
+		remove(tmp);
+	}
+	free(tmp);
+	return ok;
+}
 
-	fwprintf(bsf->printer, L" <shares>\n");
-	for (int i = 0; i < compareresult->sharelinesc; i++) {
-		fwprintf(bsf->printer, L"\t<share ratio='%ld' bytes='%lld' mb='%lld'/>\n", compareresult->sharelines[i].shareratio, compareresult->sharelines[i].savingsbytes, compareresult->sharelines[i].savingsmb);
+//the sharing matrix of -g (mode is bsf->matrix, pairs) or the exclusive bytes of -u (MATRIXFILE, no pairs) from the extents that were kept for it (see SHARING MATRIX)
+//NULL if the events do not fit in memory
+SharingMatrix * comparematrix(Blockstatflags * bsf, CompareResult * compareresult, BinRuns * binruns, FileStat * perfile, int mode, bool pairs) {
+	SharingMatrix * sm = newSharingMatrix();
+	int * filegroup = matrixgroups(sm, compareresult->files, mode, bsf->groups);
+	for (int f = 0; f < compareresult->files->c; f++) {
+		if (filegroup[f] >= 0) {
+			sm->groups[filegroup[f]].size += perfile[f].vcns * compareresult->gvinfo->ClusterSize;
+		}
+	}
+	bool ok = true;
+	for (BinRuns::iterator it = binruns->begin(); ok && it != binruns->end(); ++it) {
+		int g = filegroup[it->first.first];
+		if (g < 0) {
+			continue;
+		}
+		const unsigned char * p = it->second.data;
+		const unsigned char * end = p + it->second.len;
+		LONGLONG nextvcn = 0;
+		LONGLONG nextlcn = 0;
+		for (LONGLONG i = 0; ok && i < it->second.count; i++) {
+			Extent e;
+			extentdecode(&p, end, &nextvcn, &nextlcn, &e);
+			ok = matrixadd(sm, g, e.lcn, e.clusters);
+		}
+	}
+	free(filegroup);
+	if (!ok) {
+		freeSharingMatrix(sm);
+		return NULL;
 	}
-	fwprintf(bsf->printer, L" </shares>\n");
-	fwprintf(bsf->printer, L" <totalshare bytes='%lld' mb='%lld'/>\n",compareresult->savings,((compareresult->savings)/1024/1024));
-	fwprintf(bsf->printer, L" <fragments count='%lld'/>\n", compareresult->fragments);
-	fwprintf(bsf->printer, L"</result>\n");
+	matrixsweep(sm, compareresult->gvinfo->ClusterSize, pairs);
+	return sm;
 }
 
 //compare files will do the comparisson and built a CompareResult
 //this can be passed to xmlprint or print depending if the output should be xml or not
+//paths is filled by the discovery thread, the files are validated and compared while it is still running (see PIPELINE)
 
-int comparefiles(Blockstatflags* bsf,wchar_t* filesa[],int filesc) {
+int comparefiles(Blockstatflags* bsf, PathQueue * paths) {
 	//retvalue = 0 return value 0 means all was ok
 	int retvalue = 0;
 
-	//how many goodfiles do we have
-	//for block comparisson, they need to be on the same volume
-	//this is checked against the very first file
-	int goodfiles = 0;
-	wchar_t ** files = (wchar_t**)malloc(sizeof(wchar_t*) * MAXCOMPAREFILES);
-
 	//VINFO struct is requried to check the volume name, cluster size &volume size for a file
+	//filled by the validation thread with the info of the first file
 	VINFO* gvinfo = (VINFO*)malloc(sizeof(VINFO));
 	(gvinfo->Volume)[0] = 0;
 
 	//init the compareresult
 	CompareResult compareresult = { };
 	compareresult.errors = newStringStack();
-	compareresult.files = newStringStack();
+	compareresult.files = newPathList();
 	//sharelines is a special struct that tells how many mb is x amount shared
 	compareresult.sharelines = nullptr;
 	compareresult.savings = 0;
 	compareresult.fragments = 0;
+	compareresult.ioctls = 0;
+	compareresult.matrix = NULL;
+	compareresult.exclusive = NULL;
+
+	std::mutex relock;
+	std::mutex poollock;
+	std::condition_variable filesready;
+	std::condition_variable filestaken;
+	CompareWorkCtx cwc;
+	cwc.bsf = bsf;
+	cwc.gvinfo = gvinfo;
+	cwc.re = NULL;
+	cwc.relock = NULL;
+	cwc.poollock = &poollock;
+	cwc.paths = paths;
+	cwc.compareresult = &compareresult;
+	cwc.filesc = 0;
+	cwc.taken = 0;
+	cwc.validated = false;
+	cwc.stopping = false;
+	cwc.filesready = &filesready;
+	cwc.filestaken = &filestaken;
+	//every file gets its own result, they are merged in file order so the output is the same with any amount of workers
+	FileErrors fileerrors;
+	Arena errorarena;
+	arenainit(&errorarena);
+	cwc.perfile = NULL;
+	cwc.perfilel = 0;
+	cwc.fileerrors = &fileerrors;
+	cwc.errorarena = &errorarena;
+	//the extents are only kept if they are dumped, cached or needed for the sharing matrix or the exclusive bytes
+	BinRuns binruns;
+	Arena binarena;
+	arenainit(&binarena);
+	cwc.binruns = (bsf->format == OUTBIN || bsf->cache != NULL || bsf->matrix != MATRIXNONE || bsf->exclusive) ? &binruns : NULL;
+	cwc.cachehits = 0;
+	cwc.binarena = &binarena;
+	cwc.jobs = (bsf->jobs > 1) ? bsf->jobs : 1;
+	cwc.slots = (RangeSlot*)calloc(cwc.jobs, sizeof(RangeSlot));
+	cwc.extents = 0;
+
+	std::thread validation(validatefiles, &cwc);
+	bool compared = false;
+	std::condition_variable progresswake;
+	std::thread * progress = NULL;
+	if (bsf->progress > 0) {
+		progress = new std::thread(compareprogress, &cwc, &compared, &progresswake);
+	}
+	PhaseTimer pt;
+
+	//the engine needs the volume info, so wait for the first 2 good files (or the end of the validation)
+	int goodfiles;
+	bool validated;
+	{
+		std::unique_lock<std::mutex> guard(poollock);
+		while (cwc.filesc < 2 && !cwc.validated) {
+			filesready.wait(guard);
+		}
+		goodfiles = cwc.filesc;
+		validated = cwc.validated;
+	}
 
+	//no point in having more workers then files (if we know how many there will be)
+	if (validated && cwc.jobs > goodfiles) { cwc.jobs = (goodfiles > 1) ? goodfiles : 1; }
+	int jobs = cwc.jobs;
 
+	//the amount of files is not known yet if validation is still running, then the counters are sized for a guess (see densewidth)
+	//more files are no problem, a counter that saturates continues in the overflow table
+	int widthfiles = validated ? goodfiles : GUESSCOMPAREFILES;
 
-	if (bsf->verbose) { wprintf(L"VERBOSE: Checking if files are on the same volume\n"); }
-	
+	//with multiple workers the map is interleaved over the numa nodes, they all write all over it
+	int memflags = (bsf->hugepages ? LAZYHUGE : 0) | ((jobs > 1) ? LAZYINTERLEAVE : 0);
 
-	//make sure all files are on the same volume as first path
-	for (int f = 0; f < filesc && f < MAXCOMPAREFILES; f++) {
-		wchar_t * src = filesa[f];
-
-		//if path exists (should already be done by main but just to make sure)
-		if (PathFileExists(src)) {
-
-			VINFO* vinfo = (VINFO*)malloc(sizeof(VINFO));
-			(vinfo->Volume)[0] = 0;
-
-			//get volume info for a file
-			if (GetVolInfo(src, vinfo)) {
-				//if we didn't check any files or the volume is the same for the next file, we add it to the array of goodfiles
-				if (goodfiles == 0 || _wcsicmp(gvinfo->Volume, vinfo->Volume) == 0) {
-					//first file is always a goodfile, we use it as the baseline for the volume (clustersize etc.)
-					//next files will be checked against it to see if the files are on the same path
-					if (goodfiles == 0) {
-						gvinfo = vinfo;
-						compareresult.gvinfo = gvinfo;
-					}
-					//we don't need to keep the same info for each file
-					else { free(vinfo); }
+	//if more then 1 goodfile (more then 1 file on the same vol), we can compare
+	//the refcount engine keeps track of how many times a cluster is used (dense map or sparse ranges, see REFCOUNT ENGINES)
+	RefEngine * re = NULL;
+	if (goodfiles > 1 && (re = newRefEngine(bsf->engine, gvinfo, widthfiles, bsf->width, jobs > 1, memflags)) != NULL) {
+		if (bsf->verbose) { verboseprint(bsf, L"Got enough files, starting to compare with %d workers\n", jobs); }
+		cwc.re = re;
+		cwc.relock = re->threadsafe ? NULL : &relock;
+
+		//for every file, open it and check the used clusters
+		std::thread ** workers = (std::thread**)malloc(sizeof(std::thread*) * jobs);
+		for (int w = 0; w < jobs; w++) {
+			workers[w] = new std::thread(compareworker, &cwc, w);
+		}
+		for (int w = 0; w < jobs; w++) {
+			workers[w]->join();
+			delete workers[w];
+		}
+		free(workers);
+		validation.join();
+		goodfiles = cwc.filesc;
 
-					//adding file to the array of good files and to the output stack
-					//could be optimized by using the stringstack of compareresult
-					files[goodfiles] = src;
-					addStrStack(compareresult.files, src);
-					goodfiles++;
+		for (int f = 0; f < goodfiles; f++) {
+			if (cwc.perfile[f].ret != 0) {
+				retvalue = cwc.perfile[f].ret;
+			}
+			compareresult.fragments += cwc.perfile[f].fragments;
+			compareresult.ioctls += cwc.perfile[f].ioctls;
+		}
+		if (bsf->cache != NULL) {
+			if (bsf->verbose) { verboseprint(bsf, L"%d of %d files from the cache\n", cwc.cachehits, goodfiles); }
+			if (!cachesave(bsf->cache, goodfiles, cwc.perfile, &binruns)) {
+				addStringStackError(compareresult.errors, L"Could not write the extent cache");
+			}
+		}
+		//the error strings move to the main result, in file order
+		for (FileErrors::iterator it = fileerrors.begin(); it != fileerrors.end(); ++it) {
+			addStrStack(compareresult.errors, it->second);
+		}
 
-					if (bsf->verbose) { wprintf(L"VERBOSE: File %ls is good\n",src); }
-				}
-				else {
-					//if file 2 and subsequent files are not on the same vol, we can not look for shared clusters because there is 0% chance of finding any
-					addStrStack(compareresult.errors, L"Not on same vol");
-				}
+		/*
+			we now have a map with has the share ratio per cluster
+			lets make a new shared array that counts per ratio the amount of bytes share
+			Imagine
+
+			refsmap => [ 1 ][ 1 ][ 1 ][ 3 ][ 1 ][ 1 ][ 2 ][ 3 ]
+			this represents 8 cluster. Of those clusters:
+			5 are shared only 1 time (they are actually unique)
+			1 is shared 2 times (means that savings is (2-1)*1 = 1
+			2 are shared 3 times (means that savings is (3-1)*2 = 4
+			shared => [5] [1] [2]
+
+		*/
+
+		if (bsf->verbose) { verboseprint(bsf, L"Files compared, building up share array for final stats\n"); }
+		//making the array as show above
+		//the array covers the ratios up to the amount of files (normally a cluster is not shared by more files then there are)
+		//higher ratios are possible if a file refers the same data block multiple times, they end up in the overflow map
+		if (bsf->telemetry != NULL) { bsf->telemetry->committed = re->committed(re); }
+		phasestart(bsf->telemetry, &pt);
+		int sharedsz = sharedsize(goodfiles);
+		LONGLONG * shared = (LONGLONG*)calloc(sharedsz, sizeof(LONGLONG));
+		ShareMap overflow;
+		re->histogram(re, shared, sharedsz, &overflow, (bsf->jobs > 1) ? bsf->jobs : 1);
+
+		if (bsf->verbose) { verboseprint(bsf, L"Building up output, get ready to process\n"); }
+		//theoretically the share ratio map is enough to pass the info
+		//however, this does the precalculations so that the print function do not have to implement it individually (e.g sharelines)
+		int lines = (int)overflow.size();
+		for (int i = 0; i < sharedsz; i++) {
+			if (shared[i] > 0) {
+				lines++;
 			}
-			else {
-				//could not query vol info for a file
-				addStringStackError(compareresult.errors, L"Error getting file vol info");
+		}
+		compareresult.sharelines = (ShareLine*)malloc(sizeof(ShareLine)*(lines + 1));
+		compareresult.sharelinesc = 0;
+
+		LONGLONG savings = 0;
+		for (int i = 0; i < sharedsz; i++) {
+			//if shared ratio is bigger then 0
+			if (shared[i] > 0) {
+				savings += addshareline(&compareresult, i, shared[i], gvinfo->ClusterSize);
+			}
+		}
+		for (ShareMap::iterator it = overflow.begin(); it != overflow.end(); ++it) {
+			savings += addshareline(&compareresult, it->first, it->second, gvinfo->ClusterSize);
+		}
+		compareresult.savings = savings;
+		free(shared);
 
+		if (bsf->matrix != MATRIXNONE) {
+			if (bsf->verbose) { verboseprint(bsf, L"Building up the sharing matrix\n"); }
+			compareresult.matrix = comparematrix(bsf, &compareresult, &binruns, cwc.perfile, bsf->matrix, true);
+			if (compareresult.matrix == NULL) {
+				addStrStack(compareresult.errors, L"Could not allocate the sharing matrix");
+			}
+		}
+		if (bsf->exclusive) {
+			if (bsf->verbose) { verboseprint(bsf, L"Counting the exclusive bytes per file\n"); }
+			compareresult.exclusive = comparematrix(bsf, &compareresult, &binruns, cwc.perfile, MATRIXFILE, false);
+			if (compareresult.exclusive == NULL) {
+				addStrStack(compareresult.errors, L"Could not allocate the exclusive bytes");
 			}
 		}
+		phasedone(bsf->telemetry, PHASEHISTOGRAM, &pt, goodfiles, 0, 0);
+
+		
+
+
+
+		re->destroy(re);
+	}
+	else {
+		//nobody will take the files, let validation finish so all errors are there
+		{
+			std::lock_guard<std::mutex> guard(poollock);
+			cwc.stopping = true;
+			filestaken.notify_all();
+		}
+		validation.join();
+
+		if (goodfiles > 1) {
+			retvalue = 5;
+			addStringStackError(compareresult.errors, L"Could not allocate the refmap (try the sparse engine with -e sparse)");
+		}
 		else {
-			//should not happen because already checked by main
-			addStrStack(compareresult.errors, L"File does not exist");
+			retvalue = 2;
+			addStrStack(compareresult.errors, L"Make sure that files are on the same volume as the first file");
 		}
 	}
 
-	//if more then 1 goodfile (more then 1 file on the same vol), we can compare
-	if (goodfiles > 1) {
-		if (bsf->verbose) { wprintf(L"VERBOSE: Got enough files, starting to compare\n"); }
-		//making a very inefficient int array. The size of the array equals the amount of clusters on the volume itself. 
-		//this make it so that the bigger the volume is, the more memory the program uses
-		//there is thus no link with the filesize itself
-		//everytime a cluster is found, the corresponding int is incremented with 1 does indicating how much the block is used
+	if (progress != NULL) {
+		{
+			std::lock_guard<std::mutex> guard(poollock);
+			compared = true;
+			progresswake.notify_all();
+		}
+		progress->join();
+		delete progress;
+	}
+
+	//depending on the output, printing
+	phasestart(bsf->telemetry, &pt);
+	switch (bsf->format) {
+	case OUTXML: xmlprintcompare(bsf->out, &compareresult); break;
+	case OUTJSON: jsonprintcompare(bsf->out, &compareresult); break;
+	case OUTCSV: csvprintcompare(bsf->out, &compareresult); break;
+	case OUTBIN: binprintcompare(bsf->out, &compareresult, &binruns, cwc.perfile); break;
+	default: printcompare(bsf->out, &compareresult); break;
+	}
+	writerflush(bsf->out);
+	phasedone(bsf->telemetry, PHASEOUTPUT, &pt, compareresult.files->c, 0, 0);
+	if (bsf->verbose) { verboseprint(bsf, L"Done, %d files in %lld MB of path storage (%d directories), peak memory %lld MB\n", compareresult.files->c, compareresult.files->arena.bytes / 1024 / 1024, (int)compareresult.files->dirs->size(), peakmemory() / 1024 / 1024); }
+	free(cwc.perfile);
+	free(cwc.slots);
+	arenafree(&errorarena);
+	arenafree(&binarena);
+	freePathList(compareresult.files);
+	freeStringStack(compareresult.errors);
+	
+	if (compareresult.sharelines != NULL) {
+		free(compareresult.sharelines);
+	}
+	if (compareresult.matrix != NULL) {
+		freeSharingMatrix(compareresult.matrix);
+	}
+	if (compareresult.exclusive != NULL) {
+		freeSharingMatrix(compareresult.exclusive);
+	}
 
+	free(gvinfo);
 
-		LONGLONG refmapsz = sizeof(ShareMemCounterInt)*gvinfo->Clusters;
-		ShareMemCounterInt* refmap = (ShareMemCounterInt*)malloc(refmapsz);
+	return retvalue;
+}
+/*
+DISCOVERY
 
+Finds the files to compare and pushes them in a PathQueue (see PIPELINE), runs on its own thread
+The sources are handled in the order they were given on the cli, then the -i file, then stdin
+Only paths that exist are pushed, they are allocated with their exact size because there can be millions of them
+*/
+#define DISCOVERFILE 0
+#define DISCOVERMASK 1
+#define DISCOVERDIR 2
+#define DISCOVERTREE 3
+//all files of the recording (-r without other sources)
+#define DISCOVERREPLAY 4
+
+typedef struct _discoversource {
+	int type;
+	wchar_t * arg;
+} DiscoverSource;
+
+typedef struct _discoveryctx {
+	DiscoverSource * sources;
+	int sourcesc;
+	//-i file, empty if not given
+	char * readfromfile;
+	PathQueue * out;
+	int pushed;
+	//amount of tree walkers (-j)
+	int jobs;
+	//with -r the paths are looked up in the recording instead of the filesystem
+	Replay * replay;
+	//-T, NULL if not measured
+	Telemetry * telemetry;
+} DiscoveryCtx;
+
+//takes ownership of path, for paths that are known to exist (just listed or checked)
+//without an output queue (benchmark) the paths are only counted
+void discoverpushfound(DiscoveryCtx * dc, wchar_t * path) {
+	if (dc->out == NULL) {
+		free(path);
+	}
+	else {
+		pathqueuepush(dc->out, path);
+	}
+	dc->pushed++;
+}
 
-		
-		//zeroing the array
-		for (LONGLONG r = 0; r < gvinfo->Clusters; r++) {
-			refmap[r] = 0;
-		}
+//exact size copy of a path
+wchar_t * discovercopy(const wchar_t * path) {
+	size_t len = wcslen(path) + 1;
+	wchar_t * cp = (wchar_t*)malloc(sizeof(wchar_t)*len);
+	wmemcpy(cp, path, len);
+	return cp;
+}
 
-		
-		//for every file, open it and check the used clusters
-		for (int f = 0; f < goodfiles; f++) {
-			//open file in read (shared) mode
-			HANDLE srchandle = CreateFile(files[f], GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+//does the path exist (in the recording with -r)
+bool discoverexists(DiscoveryCtx * dc, wchar_t * path) {
+	return (dc->replay != NULL) ? replayfind(dc->replay, path) >= 0 : PathFileExists(path) == TRUE;
+}
 
+//takes ownership of path
+void discoverpush(DiscoveryCtx * dc, wchar_t * path) {
+	if (discoverexists(dc, path)) {
+		discoverpushfound(dc, path);
+	}
+	else {
+		free(path);
+	}
+}
+
+bool isdir(bool * isdir, wchar_t * dir) {
+	WIN32_FIND_DATA ffd;
+	HANDLE hFind = INVALID_HANDLE_VALUE;
+	bool ok = true;
+	(*isdir) = false;
 
-			//if we can open the file, all is good
-			if (srchandle != INVALID_HANDLE_VALUE) {
-				if (bsf->verbose) { wprintf(L"VERBOSE: Comparing %ls\n", files[f]); }
+	int len = wcslen(dir);
 
-				//call the vcn num function who updates the refmap with the amount of clusters
-				if (!vcnnums(&srchandle, gvinfo, refmap, refmapsz, false,NULL,&compareresult,bsf)) {
-					retvalue = 4;
-					
-					addStringStackError(compareresult.errors, L"No success vcnnums on file");
-					
-				}
-				//closing
-				CloseHandle(srchandle);
+	hFind = FindFirstFile(dir, &ffd);
+	if (INVALID_HANDLE_VALUE != hFind) {
+		(*isdir) = (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY );
+		FindClose(hFind);
+	}
+	else if (len > 1 && len < 4 && dir[1] == L':' && PathFileExists(dir)) {
+			(*isdir) = true;
+	} 
+	else {
+		ok = false;
+	}
+	return ok;
+}
+
+/*
+TREE WALKER
+
+-t walks the tree on the same amount of threads as the compare workers (-j)
+- every walker has its own deque of directories, it takes the one it pushed last (depth first) and an idle walker steals the oldest one of another walker (normally the biggest subtree)
+- on linux the directory is read with getdents64 and opened relative to its parent (openat), the parent stays open while it has children waiting in a deque
+- the path and dirent buffers are per walker, only the paths that leave the walker (files and queued directories) are allocated, with their exact size
+- the files are not checked again with PathFileExists, the listing just returned them
+With one walker the order is the same every run: the files of a directory, then its subdirectories in the order of the listing
+*/
+//more open parents then this and the children are opened with their full path
+#define WALKMAXFDS 256
+#define WALKDENTS (64*1024)
+
+#ifndef _WIN32
+//a directory that is kept open for openat of its children, refs is the amount of children that still have to be read (protected by walklock)
+typedef struct _walkparent {
+	int fd;
+	int refs;
+} WalkParent;
+
+//the layout the kernel uses for getdents64
+typedef struct _walkdent {
+	uint64_t ino;
+	int64_t off;
+	unsigned short reclen;
+	unsigned char type;
+	char name[1];
+} WalkDent;
+#endif
+
+typedef struct _walkdir {
+	//full path without a separator at the end and the start of the last part
+	wchar_t * path;
+	int len;
+	int leaf;
+#ifndef _WIN32
+	//NULL if it should be opened with the full path
+	WalkParent * parent;
+#endif
+} WalkDir;
+
+//ring buffer, the owner works at the back and thieves take from the front
+typedef struct _walkdeque {
+	WalkDir * items;
+	int head;
+	int count;
+	int cap;
+} WalkDeque;
+
+//per walker buffers
+typedef struct _walkbuf {
+	wchar_t path[SUPERMAXPATH];
+	char mb[SUPERMAXPATH * 4];
+	//subdirectories of the directory that is being read, pushed all at once at the end
+	WalkDir * subs;
+	int subsc;
+	int subsl;
+#ifndef _WIN32
+	char dents[WALKDENTS];
+#endif
+} WalkBuf;
+
+typedef struct _walkctx {
+	DiscoveryCtx * dc;
+	int walkers;
+	WalkDeque * deques;
+	std::mutex * dequelocks;
+
+	//everything below is protected by walklock
+	//pending is the amount of directories that are queued or being read, the walk is done when it hits 0
+	//pushes goes up after every push so an idle walker knows it might have missed something during its search
+	std::mutex * walklock;
+	std::condition_variable * walkwake;
+	LONGLONG pending;
+	LONGLONG pushes;
+	int openfds;
+
+	//discoverpush is not thread safe
+	std::mutex * pushlock;
+} WalkCtx;
+
+void walkdequepush(WalkDeque * dq, WalkDir * d) {
+	if (dq->count == dq->cap) {
+		int newcap = (dq->cap > 0) ? dq->cap * 4 : 64;
+		WalkDir * items = (WalkDir*)malloc(sizeof(WalkDir) * newcap);
+		for (int i = 0; i < dq->count; i++) {
+			items[i] = dq->items[(dq->head + i) % dq->cap];
+		}
+		free(dq->items);
+		dq->items = items;
+		dq->head = 0;
+		dq->cap = newcap;
+	}
+	dq->items[(dq->head + dq->count) % dq->cap] = *d;
+	dq->count++;
+}
+
+//the owner takes the back, a thief the front
+bool walkpop(WalkCtx * wc, int v, bool owner, WalkDir * d) {
+	std::lock_guard<std::mutex> guard(wc->dequelocks[v]);
+	WalkDeque * dq = &wc->deques[v];
+	if (dq->count == 0) {
+		return false;
+	}
+	if (owner) {
+		*d = dq->items[(dq->head + dq->count - 1) % dq->cap];
+	}
+	else {
+		*d = dq->items[dq->head];
+		dq->head = (dq->head + 1) % dq->cap;
+	}
+	dq->count--;
+	return true;
+}
+
+//the next directory to read, false if the walk is done
+bool walknext(WalkCtx * wc, int w, WalkDir * d) {
+	if (walkpop(wc, w, true, d)) {
+		return true;
+	}
+	while (true) {
+		LONGLONG seen;
+		{
+			std::lock_guard<std::mutex> guard(*wc->walklock);
+			if (wc->pending == 0) {
+				return false;
 			}
-			else {
-				retvalue = 3;
-				addStringStackError(compareresult.errors, L"Error opening file (in use?)");
+			seen = wc->pushes;
+		}
+		for (int v = 0; v < wc->walkers; v++) {
+			if (walkpop(wc, (w + v) % wc->walkers, v == 0, d)) {
+				return true;
 			}
 		}
+		std::unique_lock<std::mutex> guard(*wc->walklock);
+		while (wc->pending > 0 && wc->pushes == seen) {
+			wc->walkwake->wait(guard);
+		}
+	}
+}
 
-		/*
-			we now have a map with has the share ratio per cluster
-			lets make a new shared array that counts per ratio the amount of bytes share
-			Imagine
+//the last part of the path is in wb->path at len, copies the path and sends it on its way
+void walkfound(WalkCtx * wc, WalkBuf * wb, int len, bool isdir) {
+	int full = (int)wcslen(wb->path);
+	wchar_t * path = (wchar_t*)malloc(sizeof(wchar_t) * (full + 1));
+	wmemcpy(path, wb->path, full + 1);
 
-			refsmap => [ 1 ][ 1 ][ 1 ][ 3 ][ 1 ][ 1 ][ 2 ][ 3 ]
-			this represents 8 cluster. Of those clusters:
-			5 are shared only 1 time (they are actually unique)
-			1 is shared 2 times (means that savings is (2-1)*1 = 1
-			2 are shared 3 times (means that savings is (3-1)*2 = 4
-			shared => [5] [1] [2]
+	if (!isdir) {
+		std::lock_guard<std::mutex> guard(*wc->pushlock);
+		discoverpushfound(wc->dc, path);
+		return;
+	}
+	if (wb->subsc == wb->subsl) {
+		wb->subsl = (wb->subsl > 0) ? wb->subsl * 4 : 64;
+		wb->subs = (WalkDir*)realloc(wb->subs, sizeof(WalkDir) * wb->subsl);
+	}
+	WalkDir * sub = &wb->subs[wb->subsc++];
+	sub->path = path;
+	sub->len = full;
+	sub->leaf = len;
+}
+
+//hands the subdirectories of the directory that was read to the deque of walker w
+//fd is the open directory on linux (-1 on windows), it is kept open for its children if there are not too many open already
+void walkpublish(WalkCtx * wc, WalkBuf * wb, int w, int fd) {
+	if (wb->subsc == 0) {
+#ifndef _WIN32
+		close(fd);
+#endif
+		return;
+	}
+#ifndef _WIN32
+	WalkParent * parent = NULL;
+#endif
+	{
+		//pending goes up before the children can be taken, otherwise a fast thief can bring it to 0 while there is still work
+		std::lock_guard<std::mutex> guard(*wc->walklock);
+		wc->pending += wb->subsc;
+#ifndef _WIN32
+		if (wc->openfds < WALKMAXFDS) {
+			parent = (WalkParent*)malloc(sizeof(WalkParent));
+			parent->fd = fd;
+			parent->refs = wb->subsc;
+			wc->openfds++;
+		}
+#endif
+	}
+#ifndef _WIN32
+	if (parent == NULL) {
+		close(fd);
+	}
+#endif
+	{
+		//reverse so the owner reads them in the order of the listing
+		std::lock_guard<std::mutex> guard(wc->dequelocks[w]);
+		for (int s = wb->subsc - 1; s >= 0; s--) {
+#ifndef _WIN32
+			wb->subs[s].parent = parent;
+#endif
+			walkdequepush(&wc->deques[w], &wb->subs[s]);
+		}
+	}
+	wb->subsc = 0;
+
+	std::lock_guard<std::mutex> guard(*wc->walklock);
+	wc->pushes++;
+	wc->walkwake->notify_all();
+}
 
-		*/
+//read one directory, the files go to discovery, the subdirectories to the deque of walker w
+void walkdir(WalkCtx * wc, WalkBuf * wb, int w, WalkDir * d) {
+	wcscpy_s(wb->path, SUPERMAXPATH, d->path);
+	int len = d->len;
+	if (len == 0 || wb->path[len - 1] != PATHSEP) {
+		wb->path[len++] = PATHSEP;
+		wb->path[len] = 0;
+	}
+	wb->subsc = 0;
+
+#ifdef _WIN32
+	if (len + 2 >= SUPERMAXPATH) {
+		return;
+	}
+	wcscpy_s(wb->path + len, SUPERMAXPATH - len, L"*");
 
-		if (bsf->verbose) { wprintf(L"VERBOSE: Files compared, building up share array for final stats\n"); }
-		LONGLONG shared[MAXCOMPAREFILES];
-		for (int i = 0; i < MAXCOMPAREFILES; i++) {
-			shared[i] = 0;
+	WIN32_FIND_DATA ffd;
+	HANDLE hFind = FindFirstFileEx(wb->path, FindExInfoBasic, &ffd, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+	if (INVALID_HANDLE_VALUE == hFind) {
+		return;
+	}
+	do {
+		bool isdir = (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+		if (isdir && (wcscmp(ffd.cFileName, L".") == 0 || wcscmp(ffd.cFileName, L"..") == 0)) {
+			continue;
+		}
+		//junctions and directory symlinks are not followed, they can point to a parent and loop
+		if (isdir && (ffd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0) {
+			continue;
+		}
+		if (wcscpy_s(wb->path + len, SUPERMAXPATH - len, ffd.cFileName) == 0) {
+			walkfound(wc, wb, len, isdir);
 		}
+	} while (FindNextFile(hFind, &ffd) != 0);
+	FindClose(hFind);
+	walkpublish(wc, wb, w, -1);
+#else
+	int fd = -1;
+	if (d->parent != NULL) {
+		if (tombpath(d->path + d->leaf, wb->mb, sizeof(wb->mb))) {
+			fd = openat(d->parent->fd, wb->mb, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		}
+	}
+	else if (tombpath(d->path, wb->mb, sizeof(wb->mb))) {
+		fd = open(wb->mb, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+	if (fd < 0) {
+		return;
+	}
 
-		//what is the highest share ratio (topshare)
-		int topshare = 1;
+	long got;
+	while ((got = syscall(SYS_getdents64, fd, wb->dents, WALKDENTS)) > 0) {
+		for (long pos = 0; pos < got; ) {
+			WalkDent * de = (WalkDent*)(wb->dents + pos);
+			pos += de->reclen;
 
-		//making the array as show above
-		for (LONGLONG r = 0; r < gvinfo->Clusters; r++) {
-			//if a cluster was flagged (used by one of the files)
-			if (refmap[r] != 0) {
-				//if the sharing ratio is smaller then the amount of files
-				//theoretically, this might be possible if one files is refering the same data block but would be strange
-				//could break the array because it is based on MAXCOMPAREFILEs
-				//in this case the result should not be correct
-				if (refmap[r] < MAXCOMPAREFILES) {
-					//updating the share map
-					shared[refmap[r]]++;
-					if (topshare < refmap[r]) {
-						topshare = refmap[r];
-					}
+			if (de->name[0] == '.' && (de->name[1] == 0 || (de->name[1] == '.' && de->name[2] == 0))) {
+				continue;
+			}
+			//only stat when the filesystem does not tell us the type
+			//a symlink to a file is found like the file, dangling ones and links to directories are skipped (they can point to a parent and loop)
+			bool isdir = (de->type == DT_DIR);
+			if (de->type == DT_UNKNOWN || de->type == DT_LNK) {
+				struct stat st;
+				if (fstatat(fd, de->name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+					continue;
 				}
-				else {
-					addStrStack(compareresult.errors, L"More shared then files, seems impossible?");
+				if (S_ISLNK(st.st_mode) && (fstatat(fd, de->name, &st, 0) != 0 || S_ISDIR(st.st_mode))) {
+					continue;
 				}
+				isdir = S_ISDIR(st.st_mode);
 			}
-		}
-		if (bsf->verbose) { wprintf(L"VERBOSE: Building up output, get ready to process\n"); }
-		//theoretically the share ratio map is enough to pass the info
-		//however, this does the precalculations so that the print function do not have to implement it individually (e.g sharelines)
-		LONGLONG savings = 0;
-		//allocating at the highest share ratio. Might be too much if for example all blocks are share 2x but no 1x (2 duplicate files)
-		compareresult.sharelines = (ShareLine*)malloc(sizeof(ShareLine)*(topshare));
-		compareresult.sharelinesc = 0;
-
-		for (int i = 0; i < MAXCOMPAREFILES; i++) {
-			//if shared ratio is bigger then 0
-			if (shared[i] > 0) {
-				//how much data is really shared (ratio multiplied by clustersize
-				LONGLONG bytesshr = (shared[i] * gvinfo->ClusterSize);
-
-				compareresult.sharelines[compareresult.sharelinesc].savingsbytes = bytesshr;
-				//convert to MB
-				compareresult.sharelines[compareresult.sharelinesc].savingsmb = bytesshr / 1024 / 1024;
-				//ratio is independently given
-				//cannot use array index as 1x for example will not occure
-				//this is easier on the post/printing side
-				compareresult.sharelines[compareresult.sharelinesc].shareratio = i;
-				compareresult.sharelinesc++;
-
-				//how much is saved
-				//if a data is shared 1 time, it means it is uniquely used thus there is no gain
-				//if a data is shared 2 time, it needs to be stored 1 time, and is reused 1 time
-				//if a data is shared 3 time, it needs to be stored 1 time, and is reused 2 time
-				//etc.. (i-1) reuse
-				if (i > 1) {
-					savings += (i - 1)*bytesshr;
-				}
+			size_t r = mbstowcs(wb->path + len, de->name, SUPERMAXPATH - len);
+			if (r == (size_t)-1 || r >= (size_t)(SUPERMAXPATH - len)) {
+				continue;
 			}
+			walkfound(wc, wb, len, isdir);
 		}
-		compareresult.savings = savings;
+	}
+	walkpublish(wc, wb, w, fd);
+#endif
+}
 
-		
+void walkdone(WalkCtx * wc, WalkDir * d) {
+	std::lock_guard<std::mutex> guard(*wc->walklock);
+#ifndef _WIN32
+	if (d->parent != NULL && --d->parent->refs == 0) {
+		close(d->parent->fd);
+		free(d->parent);
+		wc->openfds--;
+	}
+#endif
+	free(d->path);
+	wc->pending--;
+	if (wc->pending == 0) {
+		wc->walkwake->notify_all();
+	}
+}
 
+void walker(WalkCtx * wc, int w) {
+	WalkBuf * wb = (WalkBuf*)malloc(sizeof(WalkBuf));
+	wb->subs = NULL;
+	wb->subsc = 0;
+	wb->subsl = 0;
+
+	WalkDir d;
+	while (walknext(wc, w, &d)) {
+		walkdir(wc, wb, w, &d);
+		walkdone(wc, &d);
+	}
+	for (int s = 0; s < wb->subsc; s++) {
+		free(wb->subs[s].path);
+	}
+	free(wb->subs);
+	free(wb);
+}
 
+//walk the tree under basedir with dc->jobs walkers, the calling thread is one of them
+void walktree(wchar_t * basedir, DiscoveryCtx * dc) {
+	std::mutex walklock;
+	std::condition_variable walkwake;
+	std::mutex pushlock;
+
+	WalkCtx wc;
+	wc.dc = dc;
+	wc.walkers = (dc->jobs > 1) ? dc->jobs : 1;
+	wc.deques = (WalkDeque*)calloc(wc.walkers, sizeof(WalkDeque));
+	wc.dequelocks = new std::mutex[wc.walkers];
+	wc.walklock = &walklock;
+	wc.walkwake = &walkwake;
+	wc.pending = 1;
+	wc.pushes = 0;
+	wc.openfds = 0;
+	wc.pushlock = &pushlock;
+
+	WalkDir root;
+	root.len = (int)wcslen(basedir);
+	root.leaf = 0;
+	root.path = (wchar_t*)malloc(sizeof(wchar_t) * (root.len + 1));
+	wmemcpy(root.path, basedir, root.len + 1);
+#ifndef _WIN32
+	root.parent = NULL;
+#endif
+	walkdequepush(&wc.deques[0], &root);
 
-		free(refmap);
+	std::thread ** walkers = (std::thread**)malloc(sizeof(std::thread*) * wc.walkers);
+	for (int w = 1; w < wc.walkers; w++) {
+		walkers[w] = new std::thread(walker, &wc, w);
 	}
-	else {
-		retvalue = 2;
-		addStrStack(compareresult.errors, L"Make sure that files are on the same volume as the first file");
+	walker(&wc, 0);
+	for (int w = 1; w < wc.walkers; w++) {
+		walkers[w]->join();
+		delete walkers[w];
 	}
+	free(walkers);
 
-	//depending on the output, printing
-	if (bsf->xmlout) {
-		xmlprintcompare(bsf, &compareresult);
+	for (int w = 0; w < wc.walkers; w++) {
+		free(wc.deques[w].items);
 	}
-	else {
-		printcompare(bsf, &compareresult);
+	free(wc.deques);
+	delete[] wc.dequelocks;
+}
+
+//all files (not directories) matching a mask e.g c:\d\file*.vbk
+//-d is the same with dir\*
+void discovermask(wchar_t * mask, DiscoveryCtx * dc) {
+	WIN32_FIND_DATA ffd;
+	HANDLE hFind = FindFirstFile(mask, &ffd);
+	if (INVALID_HANDLE_VALUE == hFind) {
+		return;
 	}
-	if (bsf->verbose) { wprintf(L"VERBOSE: Done"); }
-	free(files);
-	free(compareresult.files->ss);
-	
-	free(compareresult.files);
-	free(compareresult.errors);
-	
-	if (compareresult.sharelines != NULL) {
-		free(compareresult.sharelines);
+
+	//the directory part of the mask
+	wchar_t * dir = (wchar_t*)malloc(sizeof(wchar_t)*SUPERMAXPATH);
+	wcscpy_s(dir, SUPERMAXPATH, mask);
+	size_t ll = wcslen(dir) - 1;
+	while (ll > 0 && dir[ll] != PATHSEP) {
+		dir[ll--] = L'\0';
 	}
+	size_t dirlen = wcslen(dir);
 
-	free(gvinfo);
+	do
+	{
+		if (!(ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+		{
+			if (wcscpy_s(dir + dirlen, SUPERMAXPATH - dirlen, ffd.cFileName) == 0) {
+				discoverpushfound(dc, discovercopy(dir));
+			}
+		}
+	} while (FindNextFile(hFind, &ffd) != 0);
 
-	return retvalue;
+	FindClose(hFind);
+	free(dir);
 }
-bool isdir(bool * isdir, wchar_t * dir) {
-	WIN32_FIND_DATA ffd;
-	HANDLE hFind = INVALID_HANDLE_VALUE;
-	bool ok = true;
-	(*isdir) = false;
 
-	int len = wcslen(dir);
+//each line in the -i file will be added as a file for comparisson
+void discoverlist(char * readfromfile, DiscoveryCtx * dc) {
+	FILE *input;
+	wchar_t buf[SUPERMAXPATH];
+	buf[0] = 0;
 
-	hFind = FindFirstFile(dir, &ffd);
-	if (INVALID_HANDLE_VALUE != hFind) {
-		(*isdir) = (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY );
-		FindClose(hFind);
-	}
-	else if (len > 1 && len < 4 && dir[1] == L':' && PathFileExists(dir)) {
-			(*isdir) = true;
-	} 
-	else {
-		ok = false;
+	//open the file as UTF-16LE aka Unicode. This is done for easy "integration" with powershell.
+	if ((fopen_s(&input,readfromfile, "r, ccs=UTF-16LE")) == 0) {
+		//while we can read a line from the file
+		while (fgetws(buf, SUPERMAXPATH, input) != NULL) {
+			bool nlq = false;
+			//looking for end of the line char. If we find it, replace it with end of string (\0) char so the newline char is removed. winapi do not like new lines
+			for (int i = 0; i < SUPERMAXPATH && !nlq; i++) {
+				if (buf[i] == '\n' || buf[i] == '\r') {
+					buf[i] = 0;
+					nlq = true;
+				}
+			}
+			//if the file exists copy it to another location (reusing buf in the while loop)
+			if (discoverexists(dc, buf)) {
+				int cplen = wcslen(buf)+1;
+				wchar_t * pcp = (wchar_t*)malloc(sizeof(wchar_t)*cplen);
+				//safe copy
+				wcscpy_s(pcp, cplen, buf);
+
+				//add to queue
+				discoverpushfound(dc, pcp);
+			}
+			else {
+				wprintf(L"%ls does not exit\n", buf);
+			}
+			buf[0] = 0;
+		}
+		fclose(input);
 	}
-	return ok;
 }
 
-void recursiveadddir(wchar_t* basedir, int* count, wchar_t** files) {
-	WIN32_FIND_DATA ffd;
-	HANDLE hFind = INVALID_HANDLE_VALUE;
-	wchar_t * qdir = (wchar_t*)(malloc(sizeof(wchar_t)*SUPERMAXPATH));
-
-	if ((*count) < MAXCOMPAREFILES && wcslen(basedir)+3 < SUPERMAXPATH) {
-		wcscat_s(basedir, SUPERMAXPATH, L"\\");
-		wcscpy_s(qdir, SUPERMAXPATH, basedir);
-		wcscat_s(qdir, SUPERMAXPATH,L"*");
-		hFind = FindFirstFile(qdir, &ffd);
+//check if there is content in stdin (aka somebody used the pipeline)
+//go to the end of the pipeline to tell the the size, then seek back to the beginning
+//this doesn't work at all with powershell since it sends unicode through the pipe, better use -i
+void discoverstdin(DiscoveryCtx * dc) {
+	fseek(stdin, 0, SEEK_END);
+	long fsize = ftell(stdin);
+	fseek(stdin, 0, SEEK_SET);
 
-		
-		if (INVALID_HANDLE_VALUE != hFind)
-		{
-			do {
-				wchar_t * nextpath = (wchar_t*)(malloc(sizeof(wchar_t)*SUPERMAXPATH));
-				nextpath[0] = L'\0';
-				wcscpy_s(nextpath, SUPERMAXPATH, basedir);
-				wcscat_s(nextpath, SUPERMAXPATH, ffd.cFileName);
-
-				if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-					if (!(wcscmp(ffd.cFileName, L".") == 0 || wcscmp(ffd.cFileName, L"..") == 0)) {
-						//wprintf(L"-%ls\n", nextpath);
-						recursiveadddir(nextpath, count, files);
-						free(nextpath);
-					}
-				}
-				else {
-					if (PathFileExists(nextpath)) {
-						files[(*count)] = nextpath;
-						(*count) = (*count) + 1;
-					}
-					//wprintf(L"%5ld %ls\n",(*count),nextpath);
+	char * buffer = (char*)malloc(sizeof(char)*SUPERMAXPATH);
+	wchar_t * filealloc = (wchar_t*)malloc(sizeof(wchar_t)*SUPERMAXPATH);
+	//if there is stuff in the pipeline, get line per line
+	if (fsize > 0) {
+		//printf("getting from pipeline");
+		while (fgets(buffer, SUPERMAXPATH, stdin) != NULL) {
+			bool nlq = false;
+			//again search for the newline char and replacing it with 0 so that there is no new line in the string
+			for (int i = 0; i < SUPERMAXPATH && !nlq; i++) {
+				if (buffer[i] == '\n' || buffer[i] == '\r') {
+					buffer[i] = 0;
+					nlq = true;
 				}
-			} while ((*count) < MAXCOMPAREFILES && FindNextFile(hFind, &ffd) != 0);
-			FindClose(hFind);
+			}
+			//using mbstowcs to convert to a widechar
+			size_t conv = { 0 };
+			mbstowcs_s(&conv, filealloc, SUPERMAXPATH, buffer, strlen(buffer));
+
+
+			//if file exists, add to the queue
+			if (discoverexists(dc, filealloc)) {
+				discoverpushfound(dc, discovercopy(filealloc));
+			}
+			else {
+				wprintf(L"Path does not exist for file %ls\n", filealloc);
+			}
+			buffer[0] = 0;
 		}
-		//else { wprintf(L"invalid handle %ls\n",qdir); }
 	}
-	//else { wprintf(L"path too big\n"); }
+	free(filealloc);
+	free(buffer);
+}
 
-	free(qdir);
-	
+//the discovery thread
+void discoverfiles(DiscoveryCtx * dc) {
+	PhaseTimer pt;
+	phasestart(dc->telemetry, &pt);
+	for (int s = 0; s < dc->sourcesc; s++) {
+		DiscoverSource * src = &dc->sources[s];
+		if (src->type == DISCOVERFILE) {
+			discoverpush(dc, discovercopy(src->arg));
+		}
+		else if (src->type == DISCOVERTREE) {
+			walktree(src->arg, dc);
+		}
+		else if (src->type == DISCOVERREPLAY) {
+			for (int f = 0; f < dc->replay->filesc; f++) {
+				discoverpushfound(dc, discovercopy(dc->replay->files[f].path));
+			}
+		}
+		else {
+			discovermask(src->arg, dc);
+		}
+	}
+	if (strlen(dc->readfromfile) > 0) {
+		discoverlist(dc->readfromfile, dc);
+	}
+	discoverstdin(dc);
+	phasedone(dc->telemetry, PHASEDISCOVERY, &pt, dc->pushed, 0, 0);
+	pathqueueclose(dc->out);
 }
 
+//blockstatbench includes this file without its main
+#ifndef BLOCKSTAT_NOMAIN
 int main(int argc, char* argv[])
 {
 	int retvalue = 0;
 
-	
+#ifndef _WIN32
+	//use the locale of the environment so paths convert correctly from/to utf8
+	setlocale(LC_ALL, "");
+#endif
 
 	//General options to pass through to all the functions
-	//xmlout -> should we output human readable vs xml
+	//format -> should we output human readable, xml, json or csv
 	//printer -> define the stream where to write to. Default stdout is screen (printerisfile needs to be set to true if not stdout so that the file is flushed and closed)
+	//out -> the buffered writer on top of printer, made once the options are parsed
 	Blockstatflags * bsf = (Blockstatflags*)(malloc(sizeof(Blockstatflags)));
-	bsf->xmlout = false;
+	bsf->format = OUTTEXT;
 	bsf->printer = stdout;
+	bsf->out = NULL;
 	bsf->printerisfile = false;
 	bsf->verbose = false;
+	bsf->engine = REFENGINEDENSE;
+	bsf->width = 0;
+	bsf->jobs = 1;
+	bsf->hugepages = false;
+	bsf->stream = false;
+	bsf->replay = NULL;
+	bsf->telemetry = NULL;
+	bsf->progress = 0;
+	bsf->cache = NULL;
+	bsf->matrix = MATRIXNONE;
+	bsf->groups = newStringStack();
+	bsf->exclusive = false;
 	
 	
 	//Read from file defines an empty buffer to write to if the -i parameter is given (e.g a file that contains a filename per line)
 	char* readfromfile = (char*)malloc(sizeof(char)*SUPERMAXPATH);
 	readfromfile[0] = 0;
 	
-	//An array of file names used to compare. If there is only one file, there won't be any comparission, just a dump of the extents
-	wchar_t** files = (wchar_t**)malloc(sizeof(wchar_t*)*MAXCOMPAREFILES);
-	int filesc = 0;
+	//Where to look for the files to compare (file arguments, -m, -d, -t), listed by the discovery thread. If there is only one file, there won't be any comparission, just a dump of the extents
+	DiscoverSource * sources = (DiscoverSource*)malloc(sizeof(DiscoverSource)*argc);
+	int sourcesc = 0;
+	PathQueue * paths = newPathQueue(PIPELINEQUEUE);
+	//(declared without initializer, -h jumps over the start of the discovery to CLEANUP)
+	DiscoveryCtx dc;
+	std::thread * discovery;
+	int filesc;
+	//-T file
+	char * telemetryfile = NULL;
 
 	//process all the arguments given. Argument without dash is considered a file if the previous arg was not an arg specifier
-	for (int i = 1; i < argc && filesc < MAXCOMPAREFILES; i++) {
+	for (int i = 1; i < argc; i++) {
 		//check if the file is an argument specifier
 		if (strlen(argv[i]) > 1 && argv[i][0] == '-') {
 			switch (argv[i][1]) {
 			//-x means we need to output xml
 			case 's':
-				printf("\nHidden option: sizeof refmap is %d",sizeof(ShareMemCounterInt));
-				printf("\nHidden option: sizeof maxcomparefiles is %d\n", MAXCOMPAREFILES);
+				wprintf(L"\nHidden option: refmap counters are %d bit for 2 files, %d bit for %d files (also used while the amount of files is not known yet)",densewidth(2),densewidth(GUESSCOMPAREFILES),GUESSCOMPAREFILES);
+				wprintf(L"\nHidden option: the share array holds ratios up to %d, higher ones are kept in a map\n", SHAREDMAX);
 
 				if ((i + 1) < argc) {
 					wchar_t * filealloc = (wchar_t*)malloc(sizeof(wchar_t)*SUPERMAXPATH); filealloc[0] = 0;
@@ -1020,7 +6455,7 @@ int main(int argc, char* argv[])
 						VINFO* vinfo = (VINFO*)malloc(sizeof(VINFO));
 						(vinfo->Volume)[0] = 0;
 						if (GetVolInfo(filealloc, vinfo)) {
-							wprintf(L"%lld * %lld\n", vinfo->Clusters, vinfo->ClusterSize);
+							wprintf(L"%lld * %lld\n", vinfo->Clusters, (LONGLONG)vinfo->ClusterSize);
 							wprintf(L"Volsize: %lld GB", ((vinfo->Clusters* vinfo->ClusterSize)/1024/1024/1024));
 						}
 						free(vinfo);
@@ -1033,15 +6468,108 @@ int main(int argc, char* argv[])
 				return 2001;
 				break;
 			case 'x':
-				bsf->xmlout = true;
+				bsf->format = OUTXML;
+				break;
+			//-f output format
+			case 'f':
+				if ((i + 1) < argc) {
+					i++;
+					if (strcmp(argv[i], "text") == 0) {
+						bsf->format = OUTTEXT;
+					}
+					else if (strcmp(argv[i], "xml") == 0) {
+						bsf->format = OUTXML;
+					}
+					else if (strcmp(argv[i], "json") == 0) {
+						bsf->format = OUTJSON;
+					}
+					else if (strcmp(argv[i], "csv") == 0) {
+						bsf->format = OUTCSV;
+					}
+					else if (strcmp(argv[i], "bin") == 0) {
+						bsf->format = OUTBIN;
+					}
+					else {
+						wprintf(L"Unknown format %hs\n", argv[i]);
+						goto CLEANUP;
+					}
+				}
+				break;
+			//-r replay a recording (-f bin or -f csv) instead of querying the filesystem
+			case 'r':
+				if ((i + 1) < argc) {
+					i++;
+					if (bsf->replay != NULL) {
+						freeReplay(bsf->replay);
+					}
+					bsf->replay = openreplay(argv[i]);
+					if (bsf->replay == NULL) {
+						wprintf(L"DIE: UNABLE TO READ RECORDING\n");
+						return 1005;
+					}
+				}
+				break;
+			//-T measure the phases and write them to a file when done
+			case 'T':
+				if ((i + 1) < argc) {
+					i++;
+					if (bsf->telemetry == NULL) {
+						bsf->telemetry = newTelemetry();
+					}
+					telemetryfile = argv[i];
+				}
+				break;
+			//-p progress every n seconds
+			case 'p':
+				if ((i + 1) < argc) {
+					i++;
+					bsf->progress = atoi(argv[i]);
+				}
+				break;
+			//-c extent cache, only the files that changed since the last run are queried
+			case 'c':
+				if ((i + 1) < argc) {
+					i++;
+					if (bsf->cache != NULL) {
+						freeExtentCache(bsf->cache);
+					}
+					bsf->cache = openextentcache(argv[i]);
+				}
+				break;
+			//-g sharing matrix per file, per directory or per group of a groups file
+			case 'g':
+				if ((i + 1) < argc) {
+					i++;
+					if (strcmp(argv[i], "file") == 0) {
+						bsf->matrix = MATRIXFILE;
+					}
+					else if (strcmp(argv[i], "dir") == 0) {
+						bsf->matrix = MATRIXDIR;
+					}
+					else if (matrixprefixes(argv[i], bsf->groups)) {
+						bsf->matrix = MATRIXGROUPS;
+					}
+					else {
+						wprintf(L"Unable to read groups file %hs\n", argv[i]);
+						retvalue = 1;
+						goto CLEANUP;
+					}
+				}
+				break;
+			//-u exclusive bytes per file, what deleting it would free
+			case 'u':
+				bsf->exclusive = true;
+				break;
+			//-S stream the extents of a single file per batch instead of collecting them first
+			case 'S':
+				bsf->stream = true;
 				break;
 			//-o we need to output to a file
 			case 'o':
 				//need at least an extra argument after -o that specifies the file
 				if ((i + 1) < argc) {
 
-					//allocating the file
-					FILE* ff = (FILE*)(malloc(sizeof(FILE)));
+					FILE* ff = NULL;
 
 					//open the file for writing
 					if (!fopen_s(&ff, argv[i + 1], "w+")) {
@@ -1077,40 +6605,19 @@ int main(int argc, char* argv[])
 					//copy compare
 					mbstowcs_s(&conv, filealloc, SUPERMAXPATH, argv[i], strlen(argv[i]));
 
+					//only check if the mask finds anything, the discovery thread does the listing
 					hFind = FindFirstFile(filealloc, &ffd);
 					if (INVALID_HANDLE_VALUE != hFind)
 					{
-						size_t ll = wcslen(filealloc) - 1;
-						while (ll > 0 && filealloc[ll] != L'\\') {
-							filealloc[ll--] = L'\0';
-						}
-
-						
-						do
-						{
-							if (!(ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
-							{
-								wchar_t *fpath = (wchar_t*)malloc(sizeof(wchar_t)*SUPERMAXPATH); fpath[0] = L'\0';
-								wcscat_s(fpath, SUPERMAXPATH, filealloc);
-								wcscat_s(fpath, SUPERMAXPATH, ffd.cFileName);
-
-								//wprintf(L"%ls\n",fpath);
-								if (PathFileExists(fpath)) {
-
-									files[filesc] = fpath;
-									filesc++;
-								}
-							}
-
-						} while (FindNextFile(hFind, &ffd) != 0);
-
 						FindClose(hFind);
+						sources[sourcesc].type = DISCOVERMASK;
+						sources[sourcesc].arg = filealloc;
+						sourcesc++;
 					}
 					else {
 						wprintf(L"DIE: UNABLE TO OPEN DIRECTORY\n");
 						return 1002;
 					}
-					free(filealloc);
 				}
 				//return 0;
 				break;
@@ -1122,12 +6629,14 @@ int main(int argc, char* argv[])
 					mbstowcs_s(&conv, filealloc, SUPERMAXPATH, argv[i], strlen(argv[i]));
 
 					
-					if (filealloc[wcslen(filealloc) - 1] == L'\\') {
+					if (wcslen(filealloc) > 1 && filealloc[wcslen(filealloc) - 1] == PATHSEP) {
 						filealloc[wcslen(filealloc) - 1] = L'\0';
 					}
 					bool isdirb = false;
 					if (isdir(&isdirb, filealloc) && isdirb) {
-						recursiveadddir(filealloc, &filesc, files);
+						sources[sourcesc].type = DISCOVERTREE;
+						sources[sourcesc].arg = filealloc;
+						sourcesc++;
 					}
 					else {
 						wprintf(L"DIE: UNABLE TO OPEN DIRECTORY OR IS NOT DIR\n");
@@ -1147,66 +6656,132 @@ int main(int argc, char* argv[])
 					size_t conv = { 0 };
 					//copy compare
 					mbstowcs_s(&conv, filealloc, SUPERMAXPATH, argv[i], strlen(argv[i]));
-					if (filealloc[wcslen(filealloc) - 1] == L'\\') {
+					if (filealloc[wcslen(filealloc) - 1] == PATHSEP) {
 						wcscat_s(filealloc, SUPERMAXPATH, L"*");
 					}
 					else {
-						wcscat_s(filealloc, SUPERMAXPATH, L"\\*");
+						wcscat_s(filealloc, SUPERMAXPATH, PATHSEPSTR L"*");
 					}
+					//only check if the directory can be listed, the discovery thread does the listing
 					hFind = FindFirstFile(filealloc, &ffd);
 					if (INVALID_HANDLE_VALUE != hFind)
 					{
-						filealloc[wcslen(filealloc) - 1] = L'\0';
-						do
-						{
-							if (!(ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
-							{
-								wchar_t *fpath = (wchar_t*)malloc(sizeof(wchar_t)*SUPERMAXPATH); fpath[0] = L'\0';
-								wcscat_s(fpath, SUPERMAXPATH, filealloc);
-								wcscat_s(fpath, SUPERMAXPATH, ffd.cFileName);
-
-								if (PathFileExists(fpath)) {
-									files[filesc] = fpath;
-									filesc++;
-								}
-							}
-							
-						} while (FindNextFile(hFind, &ffd) != 0);
-
 						FindClose(hFind);
+						sources[sourcesc].type = DISCOVERDIR;
+						sources[sourcesc].arg = filealloc;
+						sourcesc++;
 					}
 					else {
 						wprintf(L"DIE: UNABLE TO OPEN DIRECTORY\n");
 						return 1002;
 					}
-					free(filealloc);
 				}
 				
 				break;
 			//-h, we don't do anything
 			case 'h':
-				printf("-v be verbose during compare mode so you can track process\n");
-				printf("-x dump as xml\n");
-				printf("-i input file with file list in unicode (utf16 le)\n");
-				printf("-o output file (utf16le)\n");
-				printf("-d use directory supplied as input\n");
-				printf("-t use directory supplied as input recursive\n");
-				printf("-m mask e.g c:\\d\\file*.vbk\n");
+				wprintf(L"-v be verbose during compare mode so you can track process (on stderr if -o is used)\n");
+				wprintf(L"-x dump as xml\n");
+				wprintf(L"-f output format text (default), xml, json, csv or bin (extents of every file, delta + varint encoded)\n");
+				wprintf(L"-S stream the extents when dumping a single file (constant memory for very fragmented files)\n");
+				wprintf(L"-r replay the extents recorded with -f bin or -f csv instead of querying the filesystem (all files in it unless files are given), only single file csv dumps have extents, a compare is recorded with -f bin\n");
+				wprintf(L"-i input file with file list in unicode (utf16 le, utf8 on linux)\n");
+				wprintf(L"-o output file (utf8)\n");
+				wprintf(L"-d use directory supplied as input\n");
+				wprintf(L"-t use directory supplied as input recursive\n");
+				wprintf(L"-m mask e.g c:\\d\\file*.vbk\n");
+				wprintf(L"-e refcount engine for compare mode\n");
+				wprintf(L"   dense (default) one counter per cluster on the volume\n");
+				wprintf(L"   sparse ranges of clusters, memory depends on the amount of extents instead of the volume size\n");
+				wprintf(L"   sweep sorts extent start/end events, does not keep any state per cluster\n");
+				wprintf(L"   delta +1/-1 per extent instead of per cluster, best for big contiguous extents (32 bit per cluster)\n");
+				wprintf(L"-w counter width of the dense engine 8, 16 or 32 (default depends on the amount of files)\n");
+				wprintf(L"-j amount of compare workers (default 1, 0 is one per cpu), idle workers help with the rest of big files\n");
+				wprintf(L"-H back the refmap with huge pages (large pages on windows need the lock pages in memory right)\n");
+				wprintf(L"-T write the time, throughput and memory of every phase to a file, json or a node_exporter textfile if it ends with .prom\n");
+				wprintf(L"-p print progress and an eta on stderr every n seconds during compare mode\n");
+				wprintf(L"-c extent cache file, files that did not change since the last compare are not queried again (created if it does not exist)\n");
+				wprintf(L"-g sharing matrix, bytes shared by every pair of files (file), directories (dir) or groups (a file with one path prefix per line)\n");
+				wprintf(L"-u exclusive bytes of every file (referred to by no other file, freed when it is deleted) next to its size\n");
 				goto CLEANUP;
 				break;
 			case 'v':
 				bsf->verbose = true;
 				break;
+			//-w force the counter width of the dense engine
+			case 'w':
+				if ((i + 1) < argc) {
+					i++;
+					bsf->width = atoi(argv[i]);
+					if (bsf->width != 8 && bsf->width != 16 && bsf->width != 32) {
+						wprintf(L"Width should be 8, 16 or 32\n");
+						goto CLEANUP;
+					}
+				}
+				break;
+			//-H huge pages for the refmap
+			case 'H':
+				bsf->hugepages = true;
+				break;
+			//-j compare workers, 0 is one per cpu
+			case 'j':
+				if ((i + 1) < argc) {
+					i++;
+					bsf->jobs = atoi(argv[i]);
+					if (bsf->jobs <= 0) {
+						bsf->jobs = (int)std::thread::hardware_concurrency();
+						if (bsf->jobs <= 0) { bsf->jobs = 1; }
+					}
+				}
+				break;
+			//-e refcount engine for compare mode
+			case 'e':
+				if ((i + 1) < argc) {
+					i++;
+					if (strcmp(argv[i], "dense") == 0) {
+						bsf->engine = REFENGINEDENSE;
+					}
+					else if (strcmp(argv[i], "sparse") == 0) {
+						bsf->engine = REFENGINESPARSE;
+					}
+					else if (strcmp(argv[i], "sweep") == 0) {
+						bsf->engine = REFENGINESWEEP;
+					}
+					else if (strcmp(argv[i], "delta") == 0) {
+						bsf->engine = REFENGINEDELTA;
+					}
+					else {
+						wprintf(L"Unknown engine %hs\n", argv[i]);
+						goto CLEANUP;
+					}
+				}
+				break;
 			default:
-				printf("Unknown option -%c\n\n",argv[i][1]);
-
-				printf("-v be verbose during compare mode so you can track process\n");
-				printf("-x dump as xml\n");
-				printf("-i input file with file list in unicode (utf16 le)\n");
-				printf("-o output file (utf16le)\n");
-				printf("-d use directory supplied as input\n");
-				printf("-t use directory supplied as input recursive\n");
-				printf("-m mask e.g c:\\d\\file*.vbk\n");
+				wprintf(L"Unknown option -%hc\n\n",argv[i][1]);
+
+				wprintf(L"-v be verbose during compare mode so you can track process (on stderr if -o is used)\n");
+				wprintf(L"-x dump as xml\n");
+				wprintf(L"-f output format text (default), xml, json, csv or bin (extents of every file, delta + varint encoded)\n");
+				wprintf(L"-S stream the extents when dumping a single file (constant memory for very fragmented files)\n");
+				wprintf(L"-r replay the extents recorded with -f bin or -f csv instead of querying the filesystem (all files in it unless files are given), only single file csv dumps have extents, a compare is recorded with -f bin\n");
+				wprintf(L"-i input file with file list in unicode (utf16 le, utf8 on linux)\n");
+				wprintf(L"-o output file (utf8)\n");
+				wprintf(L"-d use directory supplied as input\n");
+				wprintf(L"-t use directory supplied as input recursive\n");
+				wprintf(L"-m mask e.g c:\\d\\file*.vbk\n");
+				wprintf(L"-e refcount engine for compare mode\n");
+				wprintf(L"   dense (default) one counter per cluster on the volume\n");
+				wprintf(L"   sparse ranges of clusters, memory depends on the amount of extents instead of the volume size\n");
+				wprintf(L"   sweep sorts extent start/end events, does not keep any state per cluster\n");
+				wprintf(L"   delta +1/-1 per extent instead of per cluster, best for big contiguous extents (32 bit per cluster)\n");
+				wprintf(L"-w counter width of the dense engine 8, 16 or 32 (default depends on the amount of files)\n");
+				wprintf(L"-j amount of compare workers (default 1, 0 is one per cpu), idle workers help with the rest of big files\n");
+				wprintf(L"-H back the refmap with huge pages (large pages on windows need the lock pages in memory right)\n");
+				wprintf(L"-T write the time, throughput and memory of every phase to a file, json or a node_exporter textfile if it ends with .prom\n");
+				wprintf(L"-p print progress and an eta on stderr every n seconds during compare mode\n");
+				wprintf(L"-c extent cache file, files that did not change since the last compare are not queried again (created if it does not exist)\n");
+				wprintf(L"-g sharing matrix, bytes shared by every pair of files (file), directories (dir) or groups (a file with one path prefix per line)\n");
+				wprintf(L"-u exclusive bytes of every file (referred to by no other file, freed when it is deleted) next to its size\n");
 				goto CLEANUP;
 				break;
 			}
@@ -1220,129 +6795,106 @@ int main(int argc, char* argv[])
 			//copy compare
 			mbstowcs_s(&conv, filealloc, SUPERMAXPATH, argv[i], strlen(argv[i]));
 
-			//if the file exists, add it to the file stack for comparissoon
-			if (PathFileExists(filealloc)) {
-				files[filesc] = filealloc;
-				filesc++;
-			}
-			else {
-				//otherwise freeing resources
-				free(filealloc);
-			}
+			//the discovery thread checks if it exists
+			sources[sourcesc].type = DISCOVERFILE;
+			sources[sourcesc].arg = filealloc;
+			sourcesc++;
 		}
 	}
 
-	//if strlen of readfromfile is bigger, it means somebody supplied a file with -i
-	//each line in this file will be added as a file for comparisson
-	if (strlen(readfromfile) > 0) {
-		FILE *input;
-		wchar_t buf[SUPERMAXPATH];
-		buf[0] = 0;
-
-		//open the file as UTF-16LE aka Unicode. This is done for easy "integration" with powershell.
-		if ((fopen_s(&input,readfromfile, "r, ccs=UTF-16LE")) == NULL) {
-			//while we can read a line from the file
-			while (fgetws(buf, SUPERMAXPATH, input) != NULL) {
-				bool nlq = false;
-				//looking for end of the line char. If we find it, replace it with end of string (\0) char so the newline char is removed. winapi do not like new lines
-				for (int i = 0; i < SUPERMAXPATH && !nlq; i++) {
-					if (buf[i] == '\n' || buf[i] == '\r') {
-						buf[i] = 0;
-						nlq = true;
-					}
-				}
-				//if the file exists copy it to another location (reusing buf in the while loop)
-				if (PathFileExists(buf)) {
-					int cplen = wcslen(buf)+1;
-					wchar_t * pcp = (wchar_t*)malloc(sizeof(wchar_t)*cplen);
-					//safe copy
-					wcscpy_s(pcp, cplen, buf);
-
-					//add to stack
-					files[filesc] = pcp;
-					filesc++;
-
-				}
-				else {
-					wprintf(L"%ls does not exit\n", buf);
-				}
-				buf[0] = 0;
-			}
-			fclose(input);
-		}
+#ifdef _WIN32
+	//no newline translation in the binary dump
+	if (bsf->format == OUTBIN) {
+		_setmode(_fileno(bsf->printer), _O_BINARY);
+	}
+#endif
+	bsf->out = newWriter(bsf->printer);
+	if (bsf->telemetry != NULL && bsf->replay != NULL) {
+		bsf->telemetry->mapped = (LONGLONG)bsf->replay->mapsize;
+	}
+	//a recording has no file identity, there is nothing to cache
+	if (bsf->cache != NULL && bsf->replay != NULL) {
+		freeExtentCache(bsf->cache);
+		bsf->cache = NULL;
 	}
-	
-
-	//check if there is content in stdin (aka somebody used the pipeline)
-	//go to the end of the pipeline to tell the the size, then seek back to the beginning
-	//this doesn't work at all with powershell since it sends unicode through the pipe, better use -i
-	fseek(stdin, 0, SEEK_END);
-	long fsize = ftell(stdin);
-	fseek(stdin, 0, SEEK_SET);
-
-	char * buffer = (char*)malloc(sizeof(char)*SUPERMAXPATH);
-	//if there is stuff in the pipeline, get line per line
-	if (fsize > 0) {
-		//printf("getting from pipeline");
-		while (fgets(buffer, SUPERMAXPATH, stdin) != NULL) {
-			bool nlq = false;
-			//again search for the newline char and replacing it with 0 so that there is no new line in the string
-			for (int i = 0; i < SUPERMAXPATH && !nlq; i++) {
-				if (buffer[i] == '\n' || buffer[i] == '\r') {
-					buffer[i] = 0;
-					nlq = true;
-				}
-			}
-			//making a buffer for copying the file
-			//using mbstowcs to convert to a widechar
-			wchar_t * filealloc = (wchar_t*)malloc(sizeof(wchar_t)*SUPERMAXPATH); filealloc[0] = 0;
-			size_t conv = { 0 };
-			mbstowcs_s(&conv, filealloc, SUPERMAXPATH, buffer, strlen(buffer));
-
 
-			//if file exists, add to the file stack
-			if (PathFileExists(filealloc)) {
-				files[filesc] = filealloc;
-				filesc++;
-			}
-			else {
-				wprintf(L"Path does not exist for file %ls\n", filealloc);
-				free(filealloc);
-			}
-			buffer[0] = 0;
-		}
+	//a recording without files to look up replays all its files
+	if (bsf->replay != NULL && sourcesc == 0 && strlen(readfromfile) == 0) {
+		sources[sourcesc].type = DISCOVERREPLAY;
+		sources[sourcesc].arg = NULL;
+		sourcesc++;
 	}
-	free(buffer);
 
+	//the files are found on the discovery thread and compared while it is still running (see PIPELINE)
+	//main only waits for the first 2 files to know if it should compare or dump
+	dc.sources = sources;
+	dc.sourcesc = sourcesc;
+	dc.readfromfile = readfromfile;
+	dc.out = paths;
+	dc.pushed = 0;
+	dc.jobs = bsf->jobs;
+	dc.replay = bsf->replay;
+	dc.telemetry = bsf->telemetry;
+	discovery = new std::thread(discoverfiles, &dc);
+
+	filesc = pathqueuewait(paths, 2);
 
 	//if more then 1 file, do a comparisson (check shared blocks)
 	if (filesc > 1) {
-		retvalue = comparefiles(bsf,files, filesc);
+		retvalue = comparefiles(bsf, paths);
 	} 
 	//else dump the current file
 	else if (filesc > 0) {
-		retvalue = dumpfile(bsf,files[0]);
+		wchar_t * file = pathqueuepop(paths);
+		retvalue = dumpfile(bsf, file);
+		free(file);
 	}
 	else {
 		retvalue = 1;
-		printf("Need at least 2 files to compare and 1 to dump");
+		wprintf(L"Need at least 2 files to compare and 1 to dump\n");
+	}
+	discovery->join();
+	delete discovery;
+
+	if (bsf->telemetry != NULL && !telemetrywrite(bsf->telemetry, telemetryfile)) {
+		wprintf(L"Could not write the telemetry to %hs\n", telemetryfile);
 	}
 	
 	//cleanup the output file, 
 	CLEANUP:
+	if (bsf->out != NULL) {
+		//the results are useless if they did not all make it to the output (on stderr, stdout might be the one that is full)
+		writerflush(bsf->out);
+		if (bsf->out->failed || fflush(bsf->printer) != 0) {
+			fwprintf(stderr, L"DIE: UNABLE TO WRITE OUTPUT\n");
+			retvalue = 1006;
+		}
+		freeWriter(bsf->out);
+	}
+	if (bsf->replay != NULL) {
+		freeReplay(bsf->replay);
+	}
+	if (bsf->telemetry != NULL) {
+		freeTelemetry(bsf->telemetry);
+	}
+	if (bsf->cache != NULL) {
+		freeExtentCache(bsf->cache);
+	}
+	freeStringStack(bsf->groups);
 	if (bsf->printerisfile) {
 		fflush(bsf->printer);
 		fclose(bsf->printer);
-		free(bsf->printer);
 	}
 
 	//clean up buffers 
 	//this program might have memory leaks but who cares for a program that is running 10 seconds ;)
-	for (int i = 0; i < filesc; i++) {
-		free(files[i]);
+	for (int i = 0; i < sourcesc; i++) {
+		free(sources[i].arg);
 	}
-	free(files);
+	free(sources);
+	freePathQueue(paths);
 	free(readfromfile);
     return retvalue;
 }
+#endif
 
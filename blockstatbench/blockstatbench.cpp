@@ -0,0 +1,1189 @@
+/*
+Benchmarks of blockstat, a separate program so they do not ship in the scanner
+
+blockstat.cpp is included without its main, so the engines, kernels and printers that are measured are the ones of the app
+Options
+	-B [clusters]		the histogram kernels against the loop as it was before them (see BENCHMARKS)
+	-M baseline [threshold]	the hot kernels in isolation with a regression gate (see MICROBENCHMARKS)
+	-W dir			the tree walk of -t against the walk as it was before the walker (see TREE WALK)
+	-G spec			writes a generated recording (-f bin) to the output (see GENERATED WORKLOAD)
+	-E spec			generates a recording and runs every phase of the app on it
+	-o file			output of -G instead of stdout
+	-f, -j, -w, -H, -S	as in blockstat, used by the compares of -E (-j also by -W)
+
+On Windows build the blockstatbench project of blockstat.sln, on Linux
+	g++ -std=c++11 -O2 -pthread -o blockstatbench blockstatbench/blockstatbench.cpp
+*/
+#define BLOCKSTAT_NOMAIN
+#include "../blockstat/blockstat.cpp"
+
+#ifdef _WIN32
+	#define NULLDEVICE "NUL"
+#else
+	#define NULLDEVICE "/dev/null"
+
+//the tree of -W is made with these
+BOOL CreateDirectory(const wchar_t * path, void * /*security*/) {
+	char mb[SUPERMAXPATH * 4];
+	return tombpath(path, mb, sizeof(mb)) && mkdir(mb, 0777) == 0;
+}
+
+int _wfopen_s(FILE ** f, const wchar_t * name, const wchar_t * mode) {
+	char mb[SUPERMAXPATH * 4];
+	char m[16];
+	*f = NULL;
+	if (!tombpath(name, mb, sizeof(mb)) || !tombpath(mode, m, sizeof(m))) {
+		return errno;
+	}
+	*f = fopen(mb, m);
+	return (*f == NULL) ? errno : 0;
+}
+#endif
+
+
+/*
+BENCHMARKS
+
+Runs the hot parts of the app on synthetic data in memory and prints the throughput, so changes can be compared on the same machine
+-B [clusters] the histogram pass of every counter width and simd level against histlegacy (64M clusters by default)
+*/
+#define BENCHROUNDS 3
+//size of the shared array in the histogram benchmark
+#define BENCHSHARED 1024
+
+double benchseconds(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+//cheap random numbers, always the same sequence
+ULONGLONG benchrand(ULONGLONG * state) {
+	ULONGLONG x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return x;
+}
+
+//the histogram loop as it was before the kernels, used as reference
+template <typename T>
+void histlegacy(const T * refmap, LONGLONG clusters, LONGLONG * shared, int sharedsz, int * topshare) {
+	for (LONGLONG r = 0; r < clusters; r++) {
+		if (refmap[r] != 0) {
+			//the counters are unsigned, widen them so the compares with the int sizes stay signed
+			if ((LONGLONG)refmap[r] < sharedsz) {
+				shared[refmap[r]]++;
+				if (*topshare < (LONGLONG)refmap[r]) {
+					*topshare = (int)refmap[r];
+				}
+			}
+		}
+	}
+}
+
+//used is the part of the map that has files on it, filled in runs of 256 clusters with share ratios 1 till 4
+template <typename T>
+void benchhistogramwidth(LONGLONG clusters, double used) {
+	T * map = (T*)calloc(clusters, sizeof(T));
+	if (map == NULL) {
+		wprintf(L"Not enough memory for %lld clusters\n", clusters);
+		return;
+	}
+
+	ULONGLONG rng = 88172645463325252ULL;
+	for (LONGLONG r = 0; r + 256 <= clusters; r += 256) {
+		if ((double)(benchrand(&rng) % 1000000) < used * 1000000) {
+			for (LONGLONG c = r; c < r + 256; c++) {
+				map[c] = (T)(1 + benchrand(&rng) % 4);
+			}
+		}
+	}
+
+	//every kernel runs BENCHROUNDS times, the fastest round counts
+	LONGLONG * reference = (LONGLONG*)calloc(BENCHSHARED, sizeof(LONGLONG));
+	double legacy = 0;
+	for (int round = 0; round < BENCHROUNDS; round++) {
+		int topshare = 1;
+		memset(reference, 0, sizeof(LONGLONG)*BENCHSHARED);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		histlegacy(map, clusters, reference, BENCHSHARED, &topshare);
+		double took = benchseconds(start);
+		if (round == 0 || took < legacy) { legacy = took; }
+	}
+	wprintf(L"%2d bit %6.2f%% used %-8ls %10.1f Mclusters/s\n", (int)(sizeof(T) * 8), used * 100, L"legacy", clusters / legacy / 1000000);
+
+	const wchar_t * names[] = { L"scalar", L"sse4.2", L"avx2" };
+	for (int level = SIMDSCALAR; level <= simdlevel(); level++) {
+		LONGLONG * shared = (LONGLONG*)calloc(BENCHSHARED, sizeof(LONGLONG));
+		double took = 0;
+		for (int round = 0; round < BENCHROUNDS; round++) {
+			ShareMap overflow;
+			HistOut ho;
+			memset(shared, 0, sizeof(LONGLONG)*BENCHSHARED);
+			histoutinit(&ho, shared, BENCHSHARED, &overflow, NULL, (T)~(T)0);
+
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			histrange(level, (const T*)map, 0, clusters, &ho);
+			histoutdone(&ho);
+			double roundtook = benchseconds(start);
+			if (round == 0 || roundtook < took) { took = roundtook; }
+		}
+
+		bool same = (memcmp(shared, reference, sizeof(LONGLONG)*BENCHSHARED) == 0);
+		wprintf(L"%2d bit %6.2f%% used %-8ls %10.1f Mclusters/s %5.1fx %ls\n", (int)(sizeof(T) * 8), used * 100, names[level], clusters / took / 1000000, legacy / took, same ? L"" : L"MISMATCH");
+		free(shared);
+	}
+	free(reference);
+	free(map);
+}
+
+void benchhistogram(LONGLONG clusters) {
+	double useds[] = { 0.001, 0.05, 1.0 };
+	wprintf(L"Histogram pass over %lld clusters\n", clusters);
+	for (int u = 0; u < 3; u++) {
+		benchhistogramwidth<uint8_t>(clusters, useds[u]);
+		benchhistogramwidth<uint16_t>(clusters, useds[u]);
+		benchhistogramwidth<uint32_t>(clusters, useds[u]);
+	}
+}
+
+/*
+MICROBENCHMARKS
+
+-M baseline [threshold], the hot kernels in isolation with a regression gate
+	refmap		add of the extents to every engine, random small extents (frag) and the volume twice in big extents (seq)
+	histogram	share ratios out of the same engines
+	commit		first touch (zero fill) of the lazy dense map
+	vcnstack	addVCNStack growth
+	strstack	addStrStack growth
+	format		the extent lines of the single file printers
+Every kernel runs at least MICROROUNDS times and MICROMINTIME seconds on the same synthetic input, the fastest round counts
+If the baseline file does not exist it is written with the results (delete it to take a new baseline)
+Otherwise every kernel is compared with its baseline, one that is more than threshold percent slower (default MICROTHRESHOLD) fails the run with 2002
+A slow kernel is often just a busy machine, so if one looks slower the suite runs again and the best of both runs counts
+A baseline is only worth something on the machine and build it was taken with
+*/
+#define MICROROUNDS 5
+#define MICROMINTIME 0.5
+#define MICROTHRESHOLD 5
+//volume of the refmap kernels and the amount of random extents on it
+#define MICROCLUSTERS (16LL * 1024 * 1024)
+#define MICROEXTENTS (1024 * 1024)
+#define MICRONAME 64
+#define MICROMAX 64
+
+typedef struct _microresult {
+	char name[MICRONAME];
+	const wchar_t * unit;
+	double persec;
+} MicroResult;
+
+typedef struct _microgate {
+	MicroResult baseline[MICROMAX];
+	int baselinec;
+	MicroResult results[MICROMAX];
+	int resultsc;
+	double threshold;
+} MicroGate;
+
+//short kernels get more rounds, they are the most noisy
+bool micromore(int round, std::chrono::steady_clock::time_point begin) {
+	return round < MICROROUNDS || (round < 20 * MICROROUNDS && benchseconds(begin) < MICROMINTIME);
+}
+
+//every line is a name and units per second
+void microload(MicroGate * mg, FILE * f) {
+	char name[MICRONAME];
+	double persec;
+	while (mg->baselinec < MICROMAX && fscanf(f, "%63s %lf", name, &persec) == 2) {
+		strcpy_s(mg->baseline[mg->baselinec].name, MICRONAME, name);
+		mg->baseline[mg->baselinec].unit = L"";
+		mg->baseline[mg->baselinec].persec = persec;
+		mg->baselinec++;
+	}
+}
+
+void microsave(MicroGate * mg, FILE * f) {
+	for (int i = 0; i < mg->resultsc; i++) {
+		fprintf(f, "%s %.0f\n", mg->results[i].name, mg->results[i].persec);
+	}
+}
+
+//best is the fastest round in seconds for units of work, a kernel that was already measured keeps its best result
+void microreport(MicroGate * mg, const char * name, const wchar_t * unit, double units, double best) {
+	double persec = units / best;
+	for (int i = 0; i < mg->resultsc; i++) {
+		if (strcmp(mg->results[i].name, name) == 0) {
+			if (persec > mg->results[i].persec) { mg->results[i].persec = persec; }
+			return;
+		}
+	}
+	if (mg->resultsc < MICROMAX) {
+		strcpy_s(mg->results[mg->resultsc].name, MICRONAME, name);
+		mg->results[mg->resultsc].unit = unit;
+		mg->results[mg->resultsc].persec = persec;
+		mg->resultsc++;
+	}
+}
+
+//0 if the kernel is not in the baseline
+double microbaseline(MicroGate * mg, const char * name) {
+	for (int i = 0; i < mg->baselinec; i++) {
+		if (strcmp(mg->baseline[i].name, name) == 0) {
+			return mg->baseline[i].persec;
+		}
+	}
+	return 0;
+}
+
+//print prints the table, returns the amount of kernels that are slower than the threshold
+int microcompare(MicroGate * mg, bool print) {
+	int slower = 0;
+	if (print) {
+		wprintf(L"%-24ls %14ls %-12ls %14ls %8ls (threshold %.1f%%)\n", L"kernel", L"result", L"", L"baseline", L"change", mg->threshold);
+	}
+	for (int i = 0; i < mg->resultsc; i++) {
+		MicroResult * r = &mg->results[i];
+		double base = microbaseline(mg, r->name);
+		if (base <= 0) {
+			if (print) { wprintf(L"%-24hs %14.0f %-12ls %14ls\n", r->name, r->persec, r->unit, L"new"); }
+			continue;
+		}
+		double change = (r->persec / base - 1) * 100;
+		bool slow = change < -mg->threshold;
+		if (slow) { slower++; }
+		if (print) { wprintf(L"%-24hs %14.0f %-12ls %14.0f %+7.1f%% %ls\n", r->name, r->persec, r->unit, base, change, slow ? L"SLOWER" : L""); }
+	}
+	return slower;
+}
+
+//frag -> n random extents of 1 till 16 clusters, otherwise the volume twice in extents of 256 clusters (n is ignored)
+//returns the amount of extents
+LONGLONG microextents(Extent * ex, LONGLONG n, bool frag) {
+	ULONGLONG rng = 88172645463325252ULL;
+	if (!frag) {
+		n = 0;
+		for (int pass = 0; pass < 2; pass++) {
+			for (LONGLONG lcn = 0; lcn < MICROCLUSTERS; lcn += 256) {
+				ex[n].vcn = n * 256;
+				ex[n].lcn = lcn;
+				ex[n].clusters = 256;
+				n++;
+			}
+		}
+		return n;
+	}
+	LONGLONG vcn = 0;
+	for (LONGLONG i = 0; i < n; i++) {
+		ex[i].clusters = 1 + (LONGLONG)(benchrand(&rng) % 16);
+		ex[i].lcn = (LONGLONG)(benchrand(&rng) % (ULONGLONG)(MICROCLUSTERS - 16));
+		ex[i].vcn = vcn;
+		vcn += ex[i].clusters;
+	}
+	return n;
+}
+
+//the first pass over the extents commits the memory of the engine (see the commit kernel), the second one is timed
+void microengine(MicroGate * mg, int engine, const char * name, const char * dist, Extent * ex, LONGLONG n) {
+	VINFO vinfo;
+	vinfo.ClusterSize = 4096;
+	vinfo.Clusters = MICROCLUSTERS;
+	vinfo.Device = 0;
+	vinfo.Volume[0] = 0;
+	LONGLONG clusters = 0;
+	for (LONGLONG i = 0; i < n; i++) {
+		clusters += ex[i].clusters;
+	}
+
+	double add = 0;
+	double hist = 0;
+	LONGLONG * shared = (LONGLONG*)malloc(sizeof(LONGLONG) * BENCHSHARED);
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	for (int round = 0; micromore(round, begin); round++) {
+		RefEngine * re = newRefEngine(engine, &vinfo, 2, 0, false, 0);
+		if (re == NULL) {
+			wprintf(L"Could not make the %hs engine\n", name);
+			free(shared);
+			return;
+		}
+		for (LONGLONG i = 0; i < n; i++) {
+			re->add(re, ex[i].lcn, ex[i].clusters);
+		}
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (LONGLONG i = 0; i < n; i++) {
+			re->add(re, ex[i].lcn, ex[i].clusters);
+		}
+		double took = benchseconds(start);
+		if (round == 0 || took < add) { add = took; }
+
+		ShareMap overflow;
+		memset(shared, 0, sizeof(LONGLONG) * BENCHSHARED);
+		start = std::chrono::steady_clock::now();
+		re->histogram(re, shared, BENCHSHARED, &overflow, 1);
+		took = benchseconds(start);
+		if (round == 0 || took < hist) { hist = took; }
+		re->destroy(re);
+	}
+	free(shared);
+
+	char metric[MICRONAME];
+	bool percluster = (engine == REFENGINEDENSE);
+	snprintf(metric, MICRONAME, "refmap.%s.%s", name, dist);
+	microreport(mg, metric, percluster ? L"clusters/s" : L"extents/s", (double)(percluster ? clusters : n), add);
+	//dense and delta walk the whole map, sparse and sweep their ranges or events
+	bool wholemap = (engine == REFENGINEDENSE || engine == REFENGINEDELTA);
+	snprintf(metric, MICRONAME, "histogram.%s.%s", name, dist);
+	microreport(mg, metric, wholemap ? L"clusters/s" : L"extents/s", (double)(wholemap ? MICROCLUSTERS : 2 * n), hist);
+}
+
+//first write to every page of a lazy 16 bit map
+void microcommit(MicroGate * mg) {
+	LONGLONG size = MICROCLUSTERS * sizeof(uint16_t);
+	double best = 0;
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	for (int round = 0; micromore(round, begin); round++) {
+		LazyMem lm;
+		if (!lazyreserve(&lm, size, 0)) {
+			wprintf(L"Could not reserve the map\n");
+			return;
+		}
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (LONGLONG off = 0; off < size; off += 4096) {
+			lazytouch(&lm, off, off + 1);
+			lm.base[off] = 1;
+		}
+		double took = benchseconds(start);
+		if (round == 0 || took < best) { best = took; }
+		lazyrelease(&lm);
+	}
+	microreport(mg, "refmap.commit", L"bytes/s", (double)size, best);
+}
+
+void microstacks(MicroGate * mg) {
+	LONGLONG n = 4LL * MICROEXTENTS;
+	double best = 0;
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	for (int round = 0; micromore(round, begin); round++) {
+		VCNStack * vs = newVCNStack();
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (LONGLONG i = 0; i < n; i++) {
+			addVCNStack(vs, i * 16, i * 32, 65536, i * 65536);
+		}
+		double took = benchseconds(start);
+		if (round == 0 || took < best) { best = took; }
+		freeVCNStack(vs);
+	}
+	microreport(mg, "vcnstack.add", L"extents/s", (double)n, best);
+
+	const wchar_t * line = L"Error opening file (in use?) : 32 The process cannot access the file";
+	n = MICROEXTENTS;
+	begin = std::chrono::steady_clock::now();
+	for (int round = 0; micromore(round, begin); round++) {
+		StringStack * ss = newStringStack();
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (LONGLONG i = 0; i < n; i++) {
+			addStrStack(ss, line);
+		}
+		double took = benchseconds(start);
+		if (round == 0 || took < best) { best = took; }
+		freeStringStack(ss);
+	}
+	microreport(mg, "strstack.add", L"strings/s", (double)n, best);
+}
+
+//the extent lines of a single file dump, written to the null device
+void microformat(MicroGate * mg, Extent * ex, LONGLONG n) {
+	FILE * nul = NULL;
+	if (fopen_s(&nul, NULLDEVICE, "w") != 0) {
+		return;
+	}
+	VINFO vinfo;
+	vinfo.ClusterSize = 4096;
+	vinfo.Clusters = MICROCLUSTERS;
+	vinfo.Device = 0;
+	wcscpy_s(vinfo.Volume, SUPERMAXPATH, L"micro");
+	SingleResult sr;
+	sr.file = (wchar_t*)L"micro.vbk";
+	sr.errors = newStringStack();
+	sr.vcnstack = newVCNStack();
+	sr.ioctls = 0;
+	sr.gvinfo = &vinfo;
+	sr.headprinted = true;
+	sr.errorsprinted = 0;
+	sr.binrecord = 0;
+	LONGLONG total = 0;
+	for (LONGLONG i = 0; i < n; i++) {
+		total += ex[i].clusters * vinfo.ClusterSize;
+		addVCNStack(sr.vcnstack, ex[i].vcn, ex[i].lcn, ex[i].clusters * vinfo.ClusterSize, total);
+	}
+
+	const char * names[] = { "format.text", "format.xml", "format.json", "format.csv" };
+	void (*printers[])(Writer*, SingleResult*) = { printsingle, xmlprintsingle, jsonprintsingle, csvprintsingle };
+	Writer * w = newWriter(nul);
+	for (int p = 0; p < 4; p++) {
+		double best = 0;
+		std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+		for (int round = 0; micromore(round, begin); round++) {
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			printers[p](w, &sr);
+			writerflush(w);
+			double took = benchseconds(start);
+			if (round == 0 || took < best) { best = took; }
+		}
+		microreport(mg, names[p], L"extents/s", (double)n, best);
+	}
+	freeWriter(w);
+	fclose(nul);
+	freeVCNStack(sr.vcnstack);
+	freeStringStack(sr.errors);
+}
+
+//all kernels, the results are added to mg
+void microsuite(MicroGate * mg) {
+	Extent * ex = (Extent*)malloc(sizeof(Extent) * ((MICROEXTENTS > 2 * MICROCLUSTERS / 256) ? MICROEXTENTS : 2 * MICROCLUSTERS / 256));
+	const char * names[] = { "dense", "sparse", "sweep", "delta" };
+	int engines[] = { REFENGINEDENSE, REFENGINESPARSE, REFENGINESWEEP, REFENGINEDELTA };
+	//the sparse engine is a tree, it gets less extents so the rounds stay short
+	LONGLONG n = microextents(ex, MICROEXTENTS, true);
+	for (int e = 0; e < 4; e++) {
+		microengine(mg, engines[e], names[e], "frag", ex, (engines[e] == REFENGINESPARSE) ? n / 8 : n);
+	}
+	n = microextents(ex, 0, false);
+	microengine(mg, REFENGINEDENSE, "dense", "seq", ex, n);
+	microengine(mg, REFENGINEDELTA, "delta", "seq", ex, n);
+	microcommit(mg);
+	microstacks(mg);
+	n = microextents(ex, MICROEXTENTS, true);
+	microformat(mg, ex, n);
+	free(ex);
+}
+
+//returns 0 if nothing is slower then the baseline, 2002 if something is
+int benchmicro(const char * baselinefile, double threshold) {
+	MicroGate * mg = (MicroGate*)malloc(sizeof(MicroGate));
+	mg->baselinec = 0;
+	mg->resultsc = 0;
+	mg->threshold = threshold;
+	FILE * f = NULL;
+	bool hasbaseline = (fopen_s(&f, baselinefile, "r") == 0);
+	if (hasbaseline) {
+		microload(mg, f);
+		fclose(f);
+	}
+	microsuite(mg);
+	int slower = microcompare(mg, false);
+	if (hasbaseline && slower > 0) {
+		wprintf(L"%d kernels look slower, running again\n", slower);
+		microsuite(mg);
+	}
+	slower = microcompare(mg, true);
+
+	int ret = 0;
+	if (!hasbaseline) {
+		if (fopen_s(&f, baselinefile, "w") == 0) {
+			microsave(mg, f);
+			fclose(f);
+			wprintf(L"Baseline written to %hs\n", baselinefile);
+		}
+		else {
+			wprintf(L"Could not write the baseline %hs\n", baselinefile);
+		}
+	}
+	else if (slower > 0) {
+		wprintf(L"%d kernels are more than %.1f%% slower than the baseline\n", slower, threshold);
+		ret = 2002;
+	}
+	free(mg);
+	return ret;
+}
+
+
+/*
+TREE WALK
+
+-W dir walks dir with the walker of -t (one and -j walkers) and with walklegacy, dir is generated first if it does not exist
+*/
+//the directory walk as it was before the walker (one thread, two SUPERMAXPATH buffers per entry, PathFileExists on every file), used as reference
+void walklegacy(wchar_t* basedir, DiscoveryCtx * dc) {
+	WIN32_FIND_DATA ffd;
+	HANDLE hFind = INVALID_HANDLE_VALUE;
+	wchar_t * qdir = (wchar_t*)(malloc(sizeof(wchar_t)*SUPERMAXPATH));
+
+	if (wcslen(basedir) + 3 < SUPERMAXPATH) {
+		wcscat_s(basedir, SUPERMAXPATH, PATHSEPSTR);
+		wcscpy_s(qdir, SUPERMAXPATH, basedir);
+		wcscat_s(qdir, SUPERMAXPATH, L"*");
+		hFind = FindFirstFile(qdir, &ffd);
+		if (INVALID_HANDLE_VALUE != hFind)
+		{
+			do {
+				wchar_t * nextpath = (wchar_t*)(malloc(sizeof(wchar_t)*SUPERMAXPATH));
+				nextpath[0] = L'\0';
+				wcscpy_s(nextpath, SUPERMAXPATH, basedir);
+				wcscat_s(nextpath, SUPERMAXPATH, ffd.cFileName);
+
+				if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+					//links to directories are skipped like in the walker
+					if (!(wcscmp(ffd.cFileName, L".") == 0 || wcscmp(ffd.cFileName, L"..") == 0 || (ffd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))) {
+						walklegacy(nextpath, dc);
+					}
+					free(nextpath);
+				}
+				else {
+					discoverpush(dc, nextpath);
+				}
+			} while (FindNextFile(hFind, &ffd) != 0);
+			FindClose(hFind);
+		}
+	}
+	free(qdir);
+}
+
+//deep tree for the walk benchmark, BENCHTREEFANOUT subdirectories and BENCHTREEFILES empty files per directory
+#define BENCHTREEDEPTH 6
+#define BENCHTREEFANOUT 4
+#define BENCHTREEFILES 16
+
+//dir is a SUPERMAXPATH buffer, it is used to build the paths below it
+bool benchtree(wchar_t * dir, int depth) {
+	if (!CreateDirectory(dir, NULL)) {
+		return false;
+	}
+	size_t len = wcslen(dir);
+	bool ok = true;
+	for (int f = 0; ok && f < BENCHTREEFILES; f++) {
+		FILE * ff = NULL;
+		swprintf_s(dir + len, SUPERMAXPATH - len, PATHSEPSTR L"file%02d.vbk", f);
+		ok = (_wfopen_s(&ff, dir, L"w") == 0);
+		if (ok) { fclose(ff); }
+	}
+	for (int s = 0; ok && depth > 1 && s < BENCHTREEFANOUT; s++) {
+		swprintf_s(dir + len, SUPERMAXPATH - len, PATHSEPSTR L"dir%02d", s);
+		ok = benchtree(dir, depth - 1);
+	}
+	dir[len] = 0;
+	return ok;
+}
+
+//-W dir, generates the tree if dir does not exist yet
+//the rounds after the first one run with a warm cache, the fastest round counts
+void benchwalk(const char * rootarg, int jobs) {
+	wchar_t * root = (wchar_t*)malloc(sizeof(wchar_t)*SUPERMAXPATH);
+	wchar_t * legacyroot = (wchar_t*)malloc(sizeof(wchar_t)*SUPERMAXPATH);
+	size_t conv = { 0 };
+	mbstowcs_s(&conv, root, SUPERMAXPATH, rootarg, strlen(rootarg));
+	if (wcslen(root) > 1 && root[wcslen(root) - 1] == PATHSEP) {
+		root[wcslen(root) - 1] = L'\0';
+	}
+
+	if (!PathFileExists(root)) {
+		wprintf(L"Generating a tree of depth %d in %ls\n", BENCHTREEDEPTH, root);
+		if (!benchtree(root, BENCHTREEDEPTH)) {
+			printLastError(L"Could not generate the tree");
+			free(root);
+			free(legacyroot);
+			return;
+		}
+	}
+
+	int counts[] = { 1, jobs };
+	for (int c = -1; c < 2; c++) {
+		if (c == 1 && jobs <= 1) {
+			break;
+		}
+		double took = 0;
+		int files = 0;
+		for (int round = 0; round < BENCHROUNDS; round++) {
+			DiscoveryCtx dc;
+			dc.out = NULL;
+			dc.pushed = 0;
+			dc.jobs = (c < 0) ? 1 : counts[c];
+			dc.replay = NULL;
+			dc.telemetry = NULL;
+
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			if (c < 0) {
+				wcscpy_s(legacyroot, SUPERMAXPATH, root);
+				walklegacy(legacyroot, &dc);
+			}
+			else {
+				walktree(root, &dc);
+			}
+			double roundtook = benchseconds(start);
+			if (round == 0 || roundtook < took) { took = roundtook; }
+			files = dc.pushed;
+		}
+		if (c < 0) {
+			wprintf(L"%-8ls %2d walkers %9d files %12.0f files/s\n", L"legacy", 1, files, files / took);
+		}
+		else {
+			wprintf(L"%-8ls %2d walkers %9d files %12.0f files/s\n", L"walker", counts[c], files, files / took);
+		}
+	}
+	free(root);
+	free(legacyroot);
+}
+
+/*
+GENERATED WORKLOAD
+
+-G spec writes a recording (-f bin) of synthetic backup chains to the output, -E spec generates one and runs it end to end (see benchendtoend)
+spec is a comma separated list of key=value, anything not given keeps its default
+	chains		amount of backup chains (4)
+	points		restore points per chain, the first one is a full (15)
+	full		size of a full in clusters (262144, 1 GB with 4 KB clusters)
+	block		backup block in clusters, the unit that changes (256)
+	change		percent of the blocks that change per point (10)
+	frag		percent of the new blocks that do not continue where the previous allocation stopped (20)
+	synthetic	every this many points a synthetic full is made with block clone, 0 is never (7)
+	volume		clusters on the volume, 0 is twice the data (0)
+	clustersize	bytes (4096)
+
+Every chain keeps an image (the lcn of every block of the latest full)
+	full		new blocks for the whole image
+	incremental	.vib with new blocks for the changed part, the image points to them
+	synthetic	.vbk that is the image itself, no new data so every block is shared with the earlier fulls and incrementals
+New blocks are allocated from the start of the volume, a jump leaves a random gap so the data is spread over the whole volume
+*/
+typedef struct _genspec {
+	int chains;
+	int points;
+	LONGLONG full;
+	LONGLONG block;
+	int change;
+	int frag;
+	int synthetic;
+	LONGLONG volume;
+	int clustersize;
+} GenSpec;
+
+typedef struct _genstats {
+	int files;
+	LONGLONG extents;
+	LONGLONG clusters;
+	LONGLONG allocated;
+	LONGLONG bytes;
+	//extents of the first full (the single file phase)
+	LONGLONG first;
+} GenStats;
+
+void genspecinit(GenSpec * gs) {
+	gs->chains = 4;
+	gs->points = 15;
+	gs->full = 262144;
+	gs->block = 256;
+	gs->change = 10;
+	gs->frag = 20;
+	gs->synthetic = 7;
+	gs->volume = 0;
+	gs->clustersize = 4096;
+}
+
+bool genspecparse(GenSpec * gs, const char * spec) {
+	genspecinit(gs);
+	const char * p = spec;
+	while (*p != '\0') {
+		char key[32];
+		LONGLONG v;
+		int used = 0;
+		if (sscanf(p, "%31[^=,]=%lld%n", key, &v, &used) != 2 || v < 0) {
+			return false;
+		}
+		if (strcmp(key, "chains") == 0) { gs->chains = (int)v; }
+		else if (strcmp(key, "points") == 0) { gs->points = (int)v; }
+		else if (strcmp(key, "full") == 0) { gs->full = v; }
+		else if (strcmp(key, "block") == 0) { gs->block = v; }
+		else if (strcmp(key, "change") == 0) { gs->change = (int)v; }
+		else if (strcmp(key, "frag") == 0) { gs->frag = (int)v; }
+		else if (strcmp(key, "synthetic") == 0) { gs->synthetic = (int)v; }
+		else if (strcmp(key, "volume") == 0) { gs->volume = v; }
+		else if (strcmp(key, "clustersize") == 0) { gs->clustersize = (int)v; }
+		else { return false; }
+		p += used;
+		if (*p == ',') { p++; }
+	}
+	return gs->chains > 0 && gs->points > 0 && gs->block > 0 && gs->full >= gs->block && gs->change <= 100 && gs->frag <= 100 && gs->clustersize > 0;
+}
+
+//bump allocator over the volume
+typedef struct _genalloc {
+	ULONGLONG rng;
+	LONGLONG next;
+	LONGLONG volume;
+	LONGLONG left;
+	LONGLONG gap;
+	int frag;
+} GenAlloc;
+
+LONGLONG genblock(GenAlloc * ga, LONGLONG block) {
+	if ((LONGLONG)(benchrand(&ga->rng) % 100) < ga->frag && ga->gap > 0) {
+		LONGLONG gap = (LONGLONG)(benchrand(&ga->rng) % (ULONGLONG)(2 * ga->gap));
+		//never run out of room for the data that still has to come
+		LONGLONG room = ga->volume - ga->next - ga->left;
+		ga->next += (gap < room) ? gap : room;
+	}
+	LONGLONG lcn = ga->next;
+	ga->next += block;
+	ga->left -= block;
+	return lcn;
+}
+
+//adds a block to the log, continues the previous extent if it is contiguous
+void genextent(ExtentLog * log, LONGLONG * pend, LONGLONG vcn, LONGLONG lcn, LONGLONG clusters) {
+	if (pend[2] > 0 && pend[0] + pend[2] == vcn && pend[1] + pend[2] == lcn) {
+		pend[2] += clusters;
+		return;
+	}
+	if (pend[2] > 0) {
+		extentlogadd(log, pend[0], pend[1], pend[2]);
+	}
+	pend[0] = vcn;
+	pend[1] = lcn;
+	pend[2] = clusters;
+}
+
+//writes the recording, the stats tell how much was generated
+void genrecording(GenSpec * gs, Writer * w, GenStats * st) {
+	LONGLONG blocks = gs->full / gs->block;
+	LONGLONG changed = blocks * gs->change / 100;
+	if (changed < 1) { changed = 1; }
+	int incrementals = 0;
+	for (int pt = 1; pt < gs->points; pt++) {
+		if (gs->synthetic == 0 || pt % gs->synthetic != 0) { incrementals++; }
+	}
+	LONGLONG data = (LONGLONG)gs->chains * (blocks + incrementals * changed) * gs->block;
+
+	GenAlloc ga;
+	ga.rng = 88172645463325252ULL;
+	ga.next = 0;
+	ga.volume = (gs->volume > data) ? gs->volume : 2 * data;
+	ga.left = data;
+	ga.frag = gs->frag;
+	LONGLONG jumps = (data / gs->block) * gs->frag / 100 + 1;
+	ga.gap = (ga.volume - data) / jumps;
+
+	VINFO * vinfo = (VINFO*)malloc(sizeof(VINFO));
+	vinfo->ClusterSize = gs->clustersize;
+	vinfo->Clusters = ga.volume;
+	vinfo->Device = 0;
+	wcscpy_s(vinfo->Volume, SUPERMAXPATH, L"generated");
+
+	int files = gs->chains * gs->points;
+	LONGLONG * records = (LONGLONG*)malloc(sizeof(LONGLONG) * files);
+	LONGLONG * extents = (LONGLONG*)malloc(sizeof(LONGLONG) * files);
+	LONGLONG * image = (LONGLONG*)malloc(sizeof(LONGLONG) * blocks);
+	wchar_t path[64];
+	ExtentLog log;
+	extentloginit(&log);
+	memset(st, 0, sizeof(GenStats));
+
+	writebinheader(w, vinfo);
+	for (int c = 0; c < gs->chains; c++) {
+		for (int pt = 0; pt < gs->points; pt++) {
+			int f = c * gs->points + pt;
+			LONGLONG pend[3] = { 0, 0, 0 };
+			extentlogreset(&log);
+
+			if (pt == 0) {
+				swprintf_s(path, 64, L"chain%03d" PATHSEPSTR L"point%04d.vbk", c, pt);
+				for (LONGLONG b = 0; b < blocks; b++) {
+					image[b] = genblock(&ga, gs->block);
+					genextent(&log, pend, b * gs->block, image[b], gs->block);
+				}
+				st->allocated += blocks * gs->block;
+			}
+			else if (gs->synthetic != 0 && pt % gs->synthetic == 0) {
+				swprintf_s(path, 64, L"chain%03d" PATHSEPSTR L"point%04d.vbk", c, pt);
+				for (LONGLONG b = 0; b < blocks; b++) {
+					genextent(&log, pend, b * gs->block, image[b], gs->block);
+				}
+			}
+			else {
+				swprintf_s(path, 64, L"chain%03d" PATHSEPSTR L"point%04d.vib", c, pt);
+				for (LONGLONG i = 0; i < changed; i++) {
+					LONGLONG b = (LONGLONG)(benchrand(&ga.rng) % (ULONGLONG)blocks);
+					image[b] = genblock(&ga, gs->block);
+					genextent(&log, pend, i * gs->block, image[b], gs->block);
+				}
+				st->allocated += changed * gs->block;
+			}
+			if (pend[2] > 0) {
+				extentlogadd(&log, pend[0], pend[1], pend[2]);
+				st->clusters += log.nextvcn;
+			}
+
+			records[f] = writeroffset(w);
+			writebinstr(w, path);
+			writebinrun(w, log.count, log.buf, log.used);
+			if (log.count > 0) { writevarint(w, 0); }
+			extents[f] = log.count;
+			st->extents += log.count;
+		}
+	}
+
+	//empty summary, nothing was compared
+	LONGLONG summary = writeroffset(w);
+	for (int i = 0; i < 5; i++) { writevarint(w, 0); }
+	LONGLONG index = writeroffset(w);
+	for (int f = 0; f < files; f++) {
+		writefixed(w, records[f]);
+		writefixed(w, extents[f]);
+		writefixed(w, 0);
+	}
+	writebintrailer(w, index, summary, files);
+	writerflush(w);
+	st->files = files;
+	st->bytes = writeroffset(w);
+	st->first = extents[0];
+
+	extentlogfree(&log);
+	free(image);
+	free(extents);
+	free(records);
+	free(vinfo);
+}
+
+//peak memory per phase, linux can reset the high water mark of the process (clear_refs 5), on windows it is the peak of the process so far
+void benchresetpeak() {
+#ifndef _WIN32
+	FILE * f = fopen("/proc/self/clear_refs", "w");
+	if (f != NULL) {
+		fputs("5", f);
+		fclose(f);
+	}
+#endif
+}
+LONGLONG benchpeak() {
+#ifndef _WIN32
+	FILE * f = fopen("/proc/self/status", "r");
+	if (f != NULL) {
+		char line[256];
+		LONGLONG kb = -1;
+		while (fgets(line, sizeof(line), f) != NULL) {
+			if (sscanf(line, "VmHWM: %lld kB", &kb) == 1) {
+				break;
+			}
+		}
+		fclose(f);
+		if (kb >= 0) {
+			return kb * 1024;
+		}
+	}
+#endif
+	return peakmemory();
+}
+void benchphase(const wchar_t * name, double took, LONGLONG extents, LONGLONG clusters, const wchar_t * note) {
+	wprintf(L"%-10ls %9.3f s %14.0f extents/s %16.0f clusters/s %8lld MB peak %ls\n", name, took, extents / took, clusters / took, benchpeak() / 1024 / 1024, note);
+}
+
+//the recording is written next to the current directory, loaded with -r and compared with every engine (with the -j, -w, -H and -f that were given)
+//the compare and dump output goes to the null device
+#define BENCHRECORDING "blockstat-bench.bin"
+void benchendtoend(Blockstatflags * bsf, GenSpec * gs) {
+	FILE * rec = NULL;
+	if (fopen_s(&rec, BENCHRECORDING, "wb") != 0) {
+		wprintf(L"Could not write %hs\n", BENCHRECORDING);
+		return;
+	}
+	wprintf(L"%d chains of %d points, full %lld clusters, block %lld, change %d%%, frag %d%%, synthetic every %d\n", gs->chains, gs->points, gs->full, gs->block, gs->change, gs->frag, gs->synthetic);
+
+	benchresetpeak();
+	GenStats st;
+	Writer * w = newWriter(rec);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	genrecording(gs, w, &st);
+	freeWriter(w);
+	fclose(rec);
+	benchphase(L"generate", benchseconds(start), st.extents, st.clusters, L"");
+	wprintf(L"%d files, %lld extents, %lld clusters in the files, %lld allocated, %lld KB recording\n", st.files, st.extents, st.clusters, st.allocated, st.bytes / 1024);
+
+	benchresetpeak();
+	start = std::chrono::steady_clock::now();
+	Replay * rp = openreplay(BENCHRECORDING);
+	if (rp == NULL) {
+		wprintf(L"Could not load %hs\n", BENCHRECORDING);
+		return;
+	}
+	benchphase(L"load", benchseconds(start), st.extents, st.clusters, L"");
+
+	FILE * nul = NULL;
+	fopen_s(&nul, NULLDEVICE, "w");
+	const wchar_t * names[] = { L"dense", L"sparse", L"sweep", L"delta" };
+	int engines[] = { REFENGINEDENSE, REFENGINESPARSE, REFENGINESWEEP, REFENGINEDELTA };
+	for (int e = 0; e < 4 && nul != NULL; e++) {
+		Blockstatflags run = *bsf;
+		run.engine = engines[e];
+		run.replay = rp;
+		run.verbose = false;
+		run.telemetry = NULL;
+		run.cache = NULL;
+		run.matrix = MATRIXNONE;
+		run.exclusive = false;
+		run.progress = 0;
+		run.printer = nul;
+		run.out = newWriter(nul);
+
+		benchresetpeak();
+		start = std::chrono::steady_clock::now();
+		PathQueue * paths = newPathQueue(PIPELINEQUEUE);
+		DiscoverSource src;
+		src.type = DISCOVERREPLAY;
+		src.arg = NULL;
+		DiscoveryCtx dc;
+		dc.sources = &src;
+		dc.sourcesc = 1;
+		dc.readfromfile = (char*)"";
+		dc.out = paths;
+		dc.pushed = 0;
+		dc.jobs = run.jobs;
+		dc.replay = rp;
+		dc.telemetry = NULL;
+		std::thread discovery(discoverfiles, &dc);
+		int ret = comparefiles(&run, paths);
+		discovery.join();
+		freePathQueue(paths);
+		benchphase(names[e], benchseconds(start), st.extents, st.clusters, (ret == 0) ? L"" : L"FAILED");
+		freeWriter(run.out);
+	}
+
+	//the first full of the first chain through the single file path
+	if (nul != NULL && rp->filesc > 0) {
+		Blockstatflags run = *bsf;
+		run.replay = rp;
+		run.verbose = false;
+		run.telemetry = NULL;
+		run.cache = NULL;
+		run.matrix = MATRIXNONE;
+		run.exclusive = false;
+		run.printer = nul;
+		run.out = newWriter(nul);
+		wchar_t * first = discovercopy(rp->files[0].path);
+		LONGLONG clusters = rp->files[0].vcns;
+
+		benchresetpeak();
+		start = std::chrono::steady_clock::now();
+		int ret = dumpfile(&run, first);
+		benchphase(L"single", benchseconds(start), st.first, clusters, (ret == 0) ? L"" : L"FAILED");
+		freeWriter(run.out);
+		free(first);
+	}
+	if (nul != NULL) {
+		fclose(nul);
+	}
+	freeReplay(rp);
+	remove(BENCHRECORDING);
+}
+
+
+void benchusage() {
+	wprintf(L"-B [clusters] histogram kernels benchmark (default 64M clusters)\n");
+	wprintf(L"-M baseline [threshold] microbenchmarks compared with a baseline file (written if it does not exist), fails with 2002 if a kernel is threshold percent slower (default %d)\n", MICROTHRESHOLD);
+	wprintf(L"-W dir tree walk benchmark, generates the tree if dir does not exist (-j for the amount of walkers)\n");
+	wprintf(L"-G spec writes a generated recording to the output, -E spec generates one and benchmarks every phase on it\n");
+	wprintf(L"   spec is chains,points,full,block,change,frag,synthetic,volume,clustersize as key=value (see GENERATED WORKLOAD)\n");
+	wprintf(L"-o file output of -G, -f text|xml|json|csv, -j jobs, -w 8|16|32, -H huge pages and -S streaming for the compares of -E\n");
+}
+
+int main(int argc, char* argv[])
+{
+	int retvalue = 0;
+
+#ifndef _WIN32
+	//use the locale of the environment so paths convert correctly from/to utf8
+	setlocale(LC_ALL, "");
+#endif
+
+	//the same defaults as blockstat, only the options that change the benchmarked path are parsed
+	Blockstatflags * bsf = (Blockstatflags*)(malloc(sizeof(Blockstatflags)));
+	bsf->format = OUTTEXT;
+	bsf->printer = stdout;
+	bsf->out = NULL;
+	bsf->printerisfile = false;
+	bsf->verbose = false;
+	bsf->engine = REFENGINEDENSE;
+	bsf->width = 0;
+	bsf->jobs = 1;
+	bsf->hugepages = false;
+	bsf->stream = false;
+	bsf->replay = NULL;
+	bsf->telemetry = NULL;
+	bsf->progress = 0;
+	bsf->cache = NULL;
+	bsf->matrix = MATRIXNONE;
+	bsf->groups = newStringStack();
+	bsf->exclusive = false;
+
+	//-B, -M, -W, -G or -E, run once all options are known
+	char bench = 0;
+	char * benchfile = NULL;
+	double threshold = MICROTHRESHOLD;
+	LONGLONG clusters = 64LL * 1024 * 1024;
+	GenSpec gs;
+
+	for (int i = 1; i < argc; i++) {
+		if (strlen(argv[i]) < 2 || argv[i][0] != '-') {
+			wprintf(L"Unknown argument %hs\n\n", argv[i]);
+			benchusage();
+			retvalue = 1;
+			goto CLEANUP;
+		}
+		switch (argv[i][1]) {
+		//-B benchmark the histogram kernels (optionally with the amount of clusters)
+		case 'B':
+			bench = 'B';
+			if ((i + 1) < argc && argv[i + 1][0] != '-') {
+				i++;
+				clusters = atoll(argv[i]);
+			}
+			break;
+		//-M microbenchmarks compared with a baseline file (and optionally the threshold in percent)
+		case 'M':
+			if ((i + 1) < argc) {
+				i++;
+				bench = 'M';
+				benchfile = argv[i];
+				if ((i + 1) < argc && argv[i + 1][0] != '-') {
+					i++;
+					threshold = atof(argv[i]);
+				}
+			}
+			break;
+		//-W benchmark the tree walk
+		case 'W':
+			if ((i + 1) < argc) {
+				i++;
+				bench = 'W';
+				benchfile = argv[i];
+			}
+			break;
+		//-G write a generated recording to the output
+		//-E generate a recording and benchmark every phase on it
+		case 'G':
+		case 'E':
+			if ((i + 1) < argc) {
+				i++;
+				bench = argv[i - 1][1];
+				benchfile = argv[i];
+			}
+			break;
+		case 'o':
+			if ((i + 1) < argc) {
+				i++;
+				FILE* ff = NULL;
+				if (fopen_s(&ff, argv[i], "w+") != 0) {
+					wprintf(L"DIE: UNABLE TO OPEN FILE\n");
+					retvalue = 1001;
+					goto CLEANUP;
+				}
+				bsf->printerisfile = true;
+				bsf->printer = ff;
+			}
+			break;
+		case 'f':
+			if ((i + 1) < argc) {
+				i++;
+				if (strcmp(argv[i], "text") == 0) {
+					bsf->format = OUTTEXT;
+				}
+				else if (strcmp(argv[i], "xml") == 0) {
+					bsf->format = OUTXML;
+				}
+				else if (strcmp(argv[i], "json") == 0) {
+					bsf->format = OUTJSON;
+				}
+				else if (strcmp(argv[i], "csv") == 0) {
+					bsf->format = OUTCSV;
+				}
+				else {
+					wprintf(L"Unknown format %hs\n", argv[i]);
+					retvalue = 1;
+					goto CLEANUP;
+				}
+			}
+			break;
+		case 'j':
+			if ((i + 1) < argc) {
+				i++;
+				bsf->jobs = atoi(argv[i]);
+				if (bsf->jobs <= 0) {
+					bsf->jobs = (int)std::thread::hardware_concurrency();
+					if (bsf->jobs <= 0) { bsf->jobs = 1; }
+				}
+			}
+			break;
+		case 'w':
+			if ((i + 1) < argc) {
+				i++;
+				bsf->width = atoi(argv[i]);
+				if (bsf->width != 8 && bsf->width != 16 && bsf->width != 32) {
+					wprintf(L"Width should be 8, 16 or 32\n");
+					retvalue = 1;
+					goto CLEANUP;
+				}
+			}
+			break;
+		case 'H':
+			bsf->hugepages = true;
+			break;
+		case 'S':
+			bsf->stream = true;
+			break;
+		default:
+			wprintf(L"Unknown option -%hc\n\n", argv[i][1]);
+			benchusage();
+			retvalue = 1;
+			goto CLEANUP;
+		}
+	}
+
+	if (bench == 'G' || bench == 'E') {
+		if (!genspecparse(&gs, benchfile)) {
+			wprintf(L"Invalid spec %hs (chains,points,full,block,change,frag,synthetic,volume,clustersize)\n", benchfile);
+			retvalue = 1;
+			goto CLEANUP;
+		}
+	}
+
+	if (bench == 'B') {
+		benchhistogram(clusters);
+	}
+	else if (bench == 'M') {
+		retvalue = benchmicro(benchfile, threshold);
+	}
+	else if (bench == 'W') {
+		benchwalk(benchfile, bsf->jobs);
+	}
+	else if (bench == 'G') {
+#ifdef _WIN32
+		//no newline translation in the recording
+		_setmode(_fileno(bsf->printer), _O_BINARY);
+#endif
+		bsf->out = newWriter(bsf->printer);
+		GenStats st;
+		genrecording(&gs, bsf->out, &st);
+	}
+	else if (bench == 'E') {
+		benchendtoend(bsf, &gs);
+	}
+	else {
+		benchusage();
+		retvalue = 1;
+	}
+
+	CLEANUP:
+	if (bsf->out != NULL) {
+		writerflush(bsf->out);
+		if (bsf->out->failed) {
+			fwprintf(stderr, L"DIE: UNABLE TO WRITE OUTPUT\n");
+			retvalue = 1006;
+		}
+		freeWriter(bsf->out);
+	}
+	freeStringStack(bsf->groups);
+	if (bsf->printerisfile) {
+		fflush(bsf->printer);
+		fclose(bsf->printer);
+	}
+	free(bsf);
+	return retvalue;
+}